@@ -9,85 +9,77 @@
 
 /*
  * block_init:
- * Initialize the block code. For USB access, no initialization is
- * needed. However, it exists so that the interface is the same as for
- * the block_sim code.
+ * Initialize the block code. For USB access only the buffer cache
+ * needs initialization.
  *
  */
 void block_init(void) {
 	/* We assume that block_size == sector size */
 	ASSERT(BLOCK_SIZE == SECTOR_SIZE);
+	block_cache_init();
 }
 
 /*
  * block_destruct:
- * Cleanup for the block code. For USB access, no cleanup is
- * needed. However, it exists so that the interface is the same as for
- * the block_sim code.
+ * Cleanup for the block code. For USB access we only have to write
+ * back the dirty buffers.
  *
  */
 void block_destruct(void) {
-	/* Nothing to do */
+	block_sync();
 }
 
 /*
- * block_read:
- * Reads a disk block (512 bytes) from block_num
- * into the memory pointed to by address.
+ * block_dev_read:
+ * Reads count consecutive disk blocks starting at block_num into the
+ * memory pointed to by address.
  */
-int block_read(int block_num, void *address) {
-	return scsi_read(block_num, 1, (char *)address);
+int block_dev_read(int block_num, int count, void *address) {
+	return scsi_read(block_num, count, (char *)address);
 }
 
 /*
- * block_write:
- * Writes the 512 bytes starting at address to the disk block
- * block_num
+ * block_dev_write:
+ * Writes count blocks starting at address to the disk, starting at
+ * block block_num.
  */
-int block_write(int block_num, void *address) {
-	return scsi_write(block_num, 1, (char *)address);
+int block_dev_write(int block_num, int count, void *address) {
+	return scsi_write(block_num, count, (char *)address);
 }
 
 /*
- * block_modify:
- * Changes a part of a disk block. The block block_num is changed so
- * that the part pf the block from offset until offset+data_size is
- * replaced with the first data_size bytes from data.
+ * block_dev_write_list:
+ * Writes the n single blocks block_num[i] from address[i]. They are
+ * all queued before waiting, so the I/O thread can sort and merge
+ * them. Called by the buffer cache with its lock held, which guards
+ * the request array.
  */
-int block_modify(int block_num, int offset, int data_size, void *data) {
-	int rc;
-	char buf[BLOCK_SIZE];
+int block_dev_write_list(int n, int block_num[], char *address[]) {
+	static struct scsi_request req[BCACHE_ENTRIES];
+	int i, rc = 0;
 
-	ASSERT((offset + data_size) <= BLOCK_SIZE);
+	ASSERT(n <= BCACHE_ENTRIES);
 
-	rc = block_read(block_num, buf);
-	if (rc == 0) {
-		bcopy(data, &buf[offset], data_size);
-		rc = block_write(block_num, buf);
+	for (i = 0; i < n; i++) {
+		req[i].dir = SCSI_WRITE;
+		req[i].block_start = block_num[i];
+		req[i].block_count = 1;
+		req[i].data = address[i];
+		req[i].done = NULL;
+		scsi_submit(&req[i]);
 	}
-	else
-		return -1;
+	for (i = 0; i < n; i++)
+		if (scsi_wait(&req[i]) < 0)
+			rc = -1;
 
 	return rc;
 }
 
 /*
- * block_read_part:
- * Read a part of a disk block. The data from the disk block block_num
- * starting at offset until offset+bytes is read into the memory
- * starting at address.
+ * block_dev_sync:
+ * Makes the blocks written so far durable. scsi_write returns when
+ * the stick has the data, so there is nothing to wait for.
  */
-int block_read_part(int block_num, int offset, int bytes, void *address) {
-	int rc;
-	char buf[BLOCK_SIZE];
-
-	ASSERT((offset + bytes) <= BLOCK_SIZE);
-
-	rc = block_read(block_num, buf);
-	if (rc == 0) {
-		bcopy(&(buf[offset]), address, bytes);
-		return 0;
-	}
-
-	return -1;
+int block_dev_sync(void) {
+	return 1;
 }
@@ -1,4 +1,4 @@
-/* Header file for block.c and blockFake.c */
+/* Header file for block.c, block_sim.c and block_cache.c */
 
 #ifndef BLOCK_H
 #define BLOCK_H
@@ -8,11 +8,56 @@
 #define BLOCK_SIZE SECTOR_SIZE
 #define BLOCKS (SECTORS / (BLOCK_SIZE / SECTOR_SIZE))
 
+/* Buffer cache geometry, BCACHE_BUCKETS must be a power of two */
+#define BCACHE_ENTRIES 32
+#define BCACHE_BUCKETS 16
+
+/* Largest number of blocks moved by one block_read_multi/block_write_multi */
+#define BLOCK_MULTI_MAX 32
+
+/* Largest number of blocks read by one block_prefetch */
+#define BLOCK_PREFETCH_MAX 8
+
 void block_init(void);
 void block_destruct(void);
 int block_read(int block_num, void *address);
 int block_write(int block_num, void *address);
 int block_modify(int block_num, int offset, int data_size, void *data);
 int block_read_part(int block_num, int offset, int bytes, void *address);
+int block_read_multi(int block_num, int count, void *address);
+int block_write_multi(int block_num, int count, void *address);
+
+/* Buffer cache (block_cache.c) */
+void block_cache_init(void);
+int block_sync(void);
+int block_flush(void);
+void block_cache_stat(int *hits, int *misses);
+int block_prefetch(int block_num, int count);
+
+/* Write-ahead journal (block_cache.c) */
+void block_journal_init(int start, int nblocks);
+int block_journal_replay(void);
+int block_txn_begin(int nblocks);
+int block_txn_end(int nblocks);
+
+/* Most buffers one call may dirty, a few stay clean for reading */
+#define BLOCK_TXN_MAX (BCACHE_ENTRIES - 2)
+
+/*
+ * Raw device access, implemented by block.c (USB stick) and
+ * block_sim.c (image file). Only the buffer cache should call these.
+ */
+int block_dev_read(int block_num, int count, void *address);
+int block_dev_write(int block_num, int count, void *address);
+int block_dev_write_list(int n, int block_num[], char *address[]);
+int block_dev_sync(void);
+
+#ifdef LINUX_SIM
+/* Image file opened by block_init, "image_sim" unless a tool sets it */
+extern char *block_image;
+
+/* Device requests and blocks moved by block_dev_read/block_dev_write */
+void block_dev_stat(int *reads, int *writes, int *blocks_read, int *blocks_written);
+#endif /* LINUX_SIM */
 
 #endif /* !BLOCK_H */
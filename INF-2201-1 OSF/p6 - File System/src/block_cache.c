@@ -0,0 +1,684 @@
+/*
+ * Write-back buffer cache for disk blocks.
+ *
+ * The block_* functions used by fs.c go through this cache, and only
+ * the cache talks to the device (block_dev_read/block_dev_write in
+ * block.c or block_sim.c). Blocks are found through a small hash
+ * table and replaced in LRU order. Writes only mark the buffer dirty;
+ * dirty buffers reach the disk when they are evicted or when
+ * block_sync() is called.
+ *
+ * When a journal region is set up with block_journal_init(), dirty
+ * buffers only reach their home location through commit(). Commit
+ * first writes every dirty block to the journal (a descriptor block,
+ * the block images and a commit block, written sequentially), then
+ * writes the blocks home and retires the journal. The blocks changed
+ * by several file system calls are grouped into one commit. A call
+ * brackets its changes with block_txn_begin() and block_txn_end(),
+ * and a commit is only made when no call is in the middle of its
+ * changes, so a transaction never holds half of a call. If the system
+ * stops before a commit is retired, block_journal_replay() writes the
+ * journaled blocks home again.
+ *
+ * block_prefetch() reads blocks into the cache ahead of use. The
+ * device is read without holding the cache lock, so other callers
+ * are not held up by readahead.
+ */
+
+#ifdef LINUX_SIM
+#include <assert.h>
+#endif /* LINUX_SIM */
+
+#include "block.h"
+#include "common.h"
+#include "thread.h"
+#include "util.h"
+
+#define NO_BLOCK -1
+#define HASH(b) ((b) & (BCACHE_BUCKETS - 1))
+
+#define JOURNAL_MAGIC 0x4a524e4c  /* descriptor block of a transaction */
+#define JOURNAL_COMMIT 0x434d4954 /* commit block of a transaction */
+#define JOURNAL_CHUNK 8           /* journal blocks moved per device request */
+#define JOURNAL_GROUP_OPS 8       /* calls to block_txn_end per commit */
+
+struct buf {
+	struct buf *next;  /* LRU list, most recently used first */
+	struct buf *prev;
+	struct buf *hnext; /* hash chain */
+	int block_num;     /* cached block, NO_BLOCK if unused */
+	char dirty;        /* True if data differs from the disk */
+	char data[BLOCK_SIZE];
+};
+
+static struct buf bufs[BCACHE_ENTRIES];
+static struct buf *hash_table[BCACHE_BUCKETS];
+/* Head of circular LRU list, head.next is the most recently used buffer */
+static struct buf lru;
+static lock_t bcache_lock;
+
+static int hits;
+static int misses;
+
+/* Device writes so far, lets block_prefetch notice that data it read
+ * without holding bcache_lock may be stale */
+static int dev_gen;
+static char prefetch_buf[BLOCK_PREFETCH_MAX * BLOCK_SIZE];
+
+/*
+ * Descriptor and commit block of a journal transaction. The
+ * descriptor lists the home block of every image that follows it.
+ */
+struct journal_header {
+	int magic;
+	int seq;
+	int count;
+	int checksum;
+	int block[BCACHE_ENTRIES];
+};
+
+static int journal_start; /* first journal block on the device */
+static int journal_len;   /* journal blocks, 0 if there is no journal */
+static int journal_seq;   /* sequence number of the next transaction */
+static int txn_ops;       /* calls to block_txn_end since the last commit */
+static int txn_handles;   /* calls between block_txn_begin and block_txn_end */
+static int txn_credits;   /* buffers those calls may still dirty */
+static condition_t txn_done; /* signalled when a call ends */
+static char journal_buf[JOURNAL_CHUNK * BLOCK_SIZE];
+
+static int commit(void);
+
+/* Unlink buffer from the LRU list */
+static void lru_unlink(struct buf *b) {
+	b->next->prev = b->prev;
+	b->prev->next = b->next;
+}
+
+/* Insert buffer as most recently used */
+static void lru_push_front(struct buf *b) {
+	b->next = lru.next;
+	b->prev = &lru;
+	lru.next->prev = b;
+	lru.next = b;
+}
+
+static void hash_insert(struct buf *b) {
+	b->hnext = hash_table[HASH(b->block_num)];
+	hash_table[HASH(b->block_num)] = b;
+}
+
+static void hash_remove(struct buf *b) {
+	struct buf **p = &hash_table[HASH(b->block_num)];
+
+	while (*p != b)
+		p = &(*p)->hnext;
+	*p = b->hnext;
+}
+
+static struct buf *lookup(int block_num) {
+	struct buf *b;
+
+	for (b = hash_table[HASH(block_num)]; b != NULL; b = b->hnext)
+		if (b->block_num == block_num)
+			return b;
+	return NULL;
+}
+
+/* Number of dirty buffers */
+static int count_dirty(void) {
+	int i, dirty = 0;
+
+	for (i = 0; i < BCACHE_ENTRIES; i++)
+		dirty += bufs[i].dirty;
+	return dirty;
+}
+
+/* Write a dirty buffer to disk */
+static int flush(struct buf *b) {
+	int rc = block_dev_write(b->block_num, 1, b->data);
+	dev_gen++;
+	if (rc < 0)
+		return -1;
+	b->dirty = 0;
+	return 0;
+}
+
+/*
+ * Return the buffer holding block_num, reusing the least recently
+ * used buffer on a miss. If fill is true the block is read from disk
+ * on a miss, otherwise the caller is about to overwrite all of it.
+ * Must be called with bcache_lock held.
+ */
+static struct buf *getblk(int block_num, int fill) {
+	struct buf *b = lookup(block_num);
+
+	if (b != NULL) {
+		hits++;
+		lru_unlink(b);
+		lru_push_front(b);
+		return b;
+	}
+
+	/* Evict least recently used buffer. With a journal, dirty buffers
+	 * may not go home before they are committed, so a clean buffer is
+	 * taken. block_txn_begin keeps enough buffers clean for the calls
+	 * in progress, so all buffers are only dirty between calls, and
+	 * then they are committed. */
+	b = lru.prev;
+	if (journal_len > 0) {
+		while (b != &lru && b->dirty)
+			b = b->prev;
+		if (b == &lru) {
+			ASSERT(txn_handles == 0);
+			if (commit() < 0)
+				return NULL;
+			b = lru.prev;
+		}
+	}
+	if (b->dirty && flush(b) < 0)
+		return NULL;
+	if (b->block_num != NO_BLOCK)
+		hash_remove(b);
+	b->block_num = NO_BLOCK;
+
+	if (fill) {
+		misses++;
+		if (block_dev_read(block_num, 1, b->data) < 0)
+			return NULL;
+	}
+
+	b->block_num = block_num;
+	hash_insert(b);
+	lru_unlink(b);
+	lru_push_front(b);
+
+	return b;
+}
+
+void block_cache_init(void) {
+	int i;
+
+	lock_init(&bcache_lock);
+	condition_init(&txn_done);
+	lru.next = lru.prev = &lru;
+
+	for (i = 0; i < BCACHE_BUCKETS; i++)
+		hash_table[i] = NULL;
+
+	for (i = 0; i < BCACHE_ENTRIES; i++) {
+		bufs[i].block_num = NO_BLOCK;
+		bufs[i].dirty = 0;
+		bufs[i].hnext = NULL;
+		lru_push_front(&bufs[i]);
+	}
+
+	hits = 0;
+	misses = 0;
+	journal_len = 0;
+	txn_handles = 0;
+	txn_credits = 0;
+}
+
+/*
+ * block_read:
+ * Reads a disk block (512 bytes) from block_num
+ * into the memory pointed to by address.
+ */
+int block_read(int block_num, void *address) {
+	struct buf *b;
+
+	lock_acquire(&bcache_lock);
+	b = getblk(block_num, 1);
+	if (b != NULL)
+		bcopy(b->data, address, BLOCK_SIZE);
+	lock_release(&bcache_lock);
+
+	return (b == NULL) ? -1 : 0;
+}
+
+/*
+ * block_write:
+ * Writes the 512 bytes starting at address to the disk block
+ * block_num. The block is only marked dirty, see block_sync().
+ */
+int block_write(int block_num, void *address) {
+	struct buf *b;
+
+	lock_acquire(&bcache_lock);
+	b = getblk(block_num, 0);
+	if (b != NULL) {
+		bcopy(address, b->data, BLOCK_SIZE);
+		b->dirty = 1;
+	}
+	lock_release(&bcache_lock);
+
+	return (b == NULL) ? -1 : 0;
+}
+
+/*
+ * block_modify:
+ * Changes a part of a disk block. The block block_num is changed so
+ * that the part of the block from offset until offset+data_size is
+ * replaced with the first data_size bytes from data.
+ */
+int block_modify(int block_num, int offset, int data_size, void *data) {
+	struct buf *b;
+
+	ASSERT((offset + data_size) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	b = getblk(block_num, 1);
+	if (b != NULL) {
+		bcopy(data, &b->data[offset], data_size);
+		b->dirty = 1;
+	}
+	lock_release(&bcache_lock);
+
+	return (b == NULL) ? -1 : 0;
+}
+
+/*
+ * block_read_part:
+ * Read a part of a disk block. The data from the disk block block_num
+ * starting at offset until offset+bytes is read into the memory
+ * starting at address.
+ */
+int block_read_part(int block_num, int offset, int bytes, void *address) {
+	struct buf *b;
+
+	ASSERT((offset + bytes) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	b = getblk(block_num, 1);
+	if (b != NULL)
+		bcopy(&b->data[offset], address, bytes);
+	lock_release(&bcache_lock);
+
+	return (b == NULL) ? -1 : 0;
+}
+
+/*
+ * block_read_multi:
+ * Reads count consecutive disk blocks starting at block_num into the
+ * memory pointed to by address. Cached blocks are copied from the
+ * cache, and every run of uncached blocks is fetched with a single
+ * device request. Blocks read from disk are not inserted into the
+ * cache, so streaming a large file does not push out metadata.
+ */
+int block_read_multi(int block_num, int count, void *address) {
+	char *dst = address;
+	int i, run = 0, rc = 0;
+	struct buf *b;
+
+	ASSERT(count <= BLOCK_MULTI_MAX);
+
+	lock_acquire(&bcache_lock);
+	for (i = 0; i <= count && rc == 0; i++) {
+		b = (i < count) ? lookup(block_num + i) : NULL;
+		if (b == NULL && i < count) {
+			run++;
+			continue;
+		}
+
+		/* Fetch the uncached blocks before this one */
+		if (run > 0) {
+			misses += run;
+			if (block_dev_read(block_num + i - run, run, &dst[(i - run) * BLOCK_SIZE]) < 0)
+				rc = -1;
+			run = 0;
+		}
+
+		if (b != NULL) {
+			hits++;
+			bcopy(b->data, &dst[i * BLOCK_SIZE], BLOCK_SIZE);
+		}
+	}
+	lock_release(&bcache_lock);
+
+	return rc;
+}
+
+/*
+ * block_write_multi:
+ * Writes count blocks starting at address to the disk with a single
+ * device request, starting at block block_num. Cached copies of the
+ * blocks are updated, and are clean afterwards. The blocks do not go
+ * through the journal, so the caller must not write over a block
+ * whose free is not committed yet.
+ */
+int block_write_multi(int block_num, int count, void *address) {
+	char *src = address;
+	int i, rc;
+	struct buf *b;
+
+	ASSERT(count <= BLOCK_MULTI_MAX);
+
+	lock_acquire(&bcache_lock);
+	rc = block_dev_write(block_num, count, address);
+	dev_gen++;
+	for (i = 0; i < count; i++) {
+		if ((b = lookup(block_num + i)) != NULL) {
+			bcopy(&src[i * BLOCK_SIZE], b->data, BLOCK_SIZE);
+			b->dirty = (rc < 0);
+		}
+	}
+	lock_release(&bcache_lock);
+
+	return (rc < 0) ? -1 : 0;
+}
+
+/* True if getblk can take a buffer without committing the journal */
+static int have_clean(void) {
+	struct buf *b;
+
+	if (journal_len == 0)
+		return 1;
+	for (b = lru.prev; b != &lru; b = b->prev)
+		if (!b->dirty)
+			return 1;
+	return 0;
+}
+
+/*
+ * block_prefetch:
+ * Read the count consecutive blocks starting at block_num into the
+ * cache, so later reads of them are hits. Cached blocks at either end
+ * of the range are skipped, and the rest is read with one device
+ * request. The blocks are only inserted if no device write happened
+ * during the read, and a prefetch never forces a journal commit.
+ * Used by one thread at a time (the readahead thread).
+ */
+int block_prefetch(int block_num, int count) {
+	int i, gen;
+	struct buf *b;
+
+	ASSERT(count <= BLOCK_PREFETCH_MAX);
+
+	lock_acquire(&bcache_lock);
+	while (count > 0 && lookup(block_num) != NULL) {
+		block_num++;
+		count--;
+	}
+	while (count > 0 && lookup(block_num + count - 1) != NULL)
+		count--;
+	gen = dev_gen;
+	lock_release(&bcache_lock);
+
+	if (count == 0)
+		return 0;
+	if (block_dev_read(block_num, count, prefetch_buf) < 0)
+		return -1;
+
+	lock_acquire(&bcache_lock);
+	for (i = 0; i < count && gen == dev_gen; i++) {
+		if (lookup(block_num + i) != NULL)
+			continue;
+		if (!have_clean() || (b = getblk(block_num + i, 0)) == NULL)
+			break;
+		bcopy(&prefetch_buf[i * BLOCK_SIZE], b->data, BLOCK_SIZE);
+	}
+	lock_release(&bcache_lock);
+
+	return 0;
+}
+
+/* Sum of the words of a block, used to detect torn journal writes */
+static int checksum(char *data) {
+	int i, sum = 0;
+
+	for (i = 0; i < BLOCK_SIZE / (int)sizeof(int); i++)
+		sum += ((int *)data)[i];
+	return sum;
+}
+
+/*
+ * Write the images of the dirty buffers to the journal, followed by a
+ * commit block. Blocks are gathered JOURNAL_CHUNK at a time in
+ * journal_buf, so the journal is written in a few sequential requests.
+ */
+static int journal_write(struct buf *list[], int n) {
+	struct journal_header *jh = (struct journal_header *)journal_buf;
+	int i, sum = 0, chunk, pos = 0;
+
+	ASSERT(n + 2 <= journal_len);
+
+	for (i = 0; i < n; i++)
+		sum += list[i]->block_num + checksum(list[i]->data);
+
+	bzero(journal_buf, BLOCK_SIZE);
+	jh->magic = JOURNAL_MAGIC;
+	jh->seq = journal_seq;
+	jh->count = n;
+	jh->checksum = sum;
+	for (i = 0; i < n; i++)
+		jh->block[i] = list[i]->block_num;
+
+	/* Descriptor and images */
+	chunk = 1;
+	for (i = 0; i < n; i++) {
+		bcopy(list[i]->data, &journal_buf[chunk++ * BLOCK_SIZE], BLOCK_SIZE);
+		if (chunk == JOURNAL_CHUNK || i == n - 1) {
+			if (block_dev_write(journal_start + pos, chunk, journal_buf) < 0)
+				return -1;
+			pos += chunk;
+			chunk = 0;
+		}
+	}
+
+	/* Commit block, only written once the images are on disk */
+	bzero(journal_buf, BLOCK_SIZE);
+	jh->magic = JOURNAL_COMMIT;
+	jh->seq = journal_seq;
+	jh->count = n;
+	jh->checksum = sum;
+	if (block_dev_write(journal_start + pos, 1, journal_buf) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Mark the journal empty, its transaction is home */
+static int journal_retire(void) {
+	bzero(journal_buf, BLOCK_SIZE);
+	journal_seq++;
+	return block_dev_write(journal_start, 1, journal_buf) < 0 ? -1 : 0;
+}
+
+/*
+ * Commit the running transaction: journal every dirty buffer, write
+ * them home and retire the journal. Without a journal the buffers are
+ * just written home. Must be called with bcache_lock held.
+ */
+static int commit(void) {
+	struct buf *list[BCACHE_ENTRIES];
+	int block_num[BCACHE_ENTRIES];
+	char *data[BCACHE_ENTRIES];
+	int i, n = 0, rc = 0;
+
+	txn_ops = 0;
+	for (i = 0; i < BCACHE_ENTRIES; i++)
+		if (bufs[i].dirty)
+			list[n++] = &bufs[i];
+	if (n == 0)
+		return 0;
+
+	if (journal_len > 0 && journal_write(list, n) < 0)
+		return -1;
+
+	/* Handed to the device together, so it may sort and merge them */
+	for (i = 0; i < n; i++) {
+		block_num[i] = list[i]->block_num;
+		data[i] = list[i]->data;
+	}
+	if (block_dev_write_list(n, block_num, data) < 0)
+		rc = -1;
+	dev_gen++;
+	for (i = 0; i < n && rc == 0; i++)
+		list[i]->dirty = 0;
+
+	/* A failed home write stays in the journal for replay */
+	if (journal_len > 0 && rc == 0)
+		rc = journal_retire();
+
+	return rc;
+}
+
+/*
+ * block_sync:
+ * Write every dirty buffer back to disk, once no call is in the middle
+ * of its changes. Returns -1 if any of the writes failed, the buffers
+ * are then left dirty.
+ */
+int block_sync(void) {
+	int rc;
+
+	lock_acquire(&bcache_lock);
+	while (txn_handles > 0)
+		condition_wait(&bcache_lock, &txn_done);
+	rc = commit();
+	lock_release(&bcache_lock);
+
+	return rc;
+}
+
+/*
+ * block_flush:
+ * Like block_sync, and then have the device write back what it holds
+ * (the simulator msyncs a mapped image). Used by fs_sync, block_sync
+ * alone is enough for the writes made by every fs_close.
+ */
+int block_flush(void) {
+	int rc = block_sync();
+
+	if (block_dev_sync() < 0)
+		rc = -1;
+	return rc;
+}
+
+/*
+ * block_txn_begin:
+ * Called before a file system call makes changes that may dirty up to
+ * nblocks buffers, at most BLOCK_TXN_MAX. The call joins the running
+ * transaction if those buffers fit beside the ones already dirty and
+ * the ones the calls in progress may still dirty. Otherwise the
+ * running transaction is committed first, after waiting for the calls
+ * in progress to end. Returns -1 if that commit failed, the call must
+ * then not make its changes.
+ */
+int block_txn_begin(int nblocks) {
+	int rc = 0;
+
+	ASSERT(nblocks <= BLOCK_TXN_MAX);
+
+	lock_acquire(&bcache_lock);
+	while (journal_len > 0 && count_dirty() + txn_credits + nblocks > BLOCK_TXN_MAX) {
+		if (txn_handles > 0)
+			condition_wait(&bcache_lock, &txn_done);
+		else if ((rc = commit()) < 0)
+			break;
+	}
+	if (rc == 0) {
+		txn_handles++;
+		txn_credits += nblocks;
+	}
+	lock_release(&bcache_lock);
+
+	return rc;
+}
+
+/*
+ * block_txn_end:
+ * Called when a file system call has made all its changes, with the
+ * nblocks it passed to block_txn_begin. Once no call is in progress,
+ * the changes of JOURNAL_GROUP_OPS calls are committed together, or
+ * earlier when half of the buffers are dirty.
+ */
+int block_txn_end(int nblocks) {
+	int rc = 0;
+
+	lock_acquire(&bcache_lock);
+	txn_handles--;
+	txn_credits -= nblocks;
+	txn_ops++;
+	if (txn_handles == 0 && (txn_ops >= JOURNAL_GROUP_OPS || count_dirty() > BCACHE_ENTRIES / 2))
+		rc = commit();
+	condition_broadcast(&txn_done);
+	lock_release(&bcache_lock);
+
+	return rc;
+}
+
+/*
+ * block_journal_init:
+ * Use the nblocks device blocks from start as the journal.
+ */
+void block_journal_init(int start, int nblocks) {
+	ASSERT(nblocks >= BCACHE_ENTRIES + 2);
+
+	journal_start = start;
+	journal_len = nblocks;
+	journal_seq = 1;
+	txn_ops = 0;
+	txn_handles = 0;
+	txn_credits = 0;
+}
+
+/*
+ * block_journal_replay:
+ * If the journal holds a complete transaction, write its blocks home.
+ * A transaction without a valid commit block is discarded. Must be
+ * called before anything is read through the cache. Returns the
+ * number of blocks replayed, or -1 on a device error.
+ */
+int block_journal_replay(void) {
+	struct journal_header desc, *jh = (struct journal_header *)journal_buf;
+	int i, j, chunk, sum = 0;
+
+	if (journal_len == 0)
+		return 0;
+	if (block_dev_read(journal_start, 1, journal_buf) < 0)
+		return -1;
+	bcopy(journal_buf, (char *)&desc, sizeof(desc));
+	if (desc.magic != JOURNAL_MAGIC)
+		return 0;
+	journal_seq = desc.seq;
+
+	/* Check the commit block and the images, a descriptor lists at
+	 * most BCACHE_ENTRIES blocks (see journal_write) */
+	if (desc.count <= 0 || desc.count > BCACHE_ENTRIES || desc.count + 2 > journal_len)
+		return journal_retire();
+	if (block_dev_read(journal_start + 1 + desc.count, 1, journal_buf) < 0)
+		return -1;
+	if (jh->magic != JOURNAL_COMMIT || jh->seq != desc.seq || jh->count != desc.count)
+		return journal_retire();
+
+	for (i = 0; i < desc.count; i += chunk) {
+		chunk = (desc.count - i < JOURNAL_CHUNK) ? desc.count - i : JOURNAL_CHUNK;
+		if (block_dev_read(journal_start + 1 + i, chunk, journal_buf) < 0)
+			return -1;
+		for (j = 0; j < chunk; j++)
+			sum += desc.block[i + j] + checksum(&journal_buf[j * BLOCK_SIZE]);
+	}
+	if (sum != desc.checksum)
+		return journal_retire();
+
+	/* Write the images home */
+	for (i = 0; i < desc.count; i += chunk) {
+		chunk = (desc.count - i < JOURNAL_CHUNK) ? desc.count - i : JOURNAL_CHUNK;
+		if (block_dev_read(journal_start + 1 + i, chunk, journal_buf) < 0)
+			return -1;
+		for (j = 0; j < chunk; j++)
+			if (block_dev_write(desc.block[i + j], 1, &journal_buf[j * BLOCK_SIZE]) < 0)
+				return -1;
+	}
+
+	if (journal_retire() < 0)
+		return -1;
+	return desc.count;
+}
+
+/* Number of lookups served from the cache and number of disk reads */
+void block_cache_stat(int *h, int *m) {
+	*h = hits;
+	*m = misses;
+}
@@ -1,7 +1,13 @@
 /*
  * This simulates the operation of the filesystem on Linux.
  *
- * The block function read or writes a block of the file system.
+ * The block_dev functions read or write blocks of the file system
+ * image. Everything else goes through the buffer cache in block_cache.c.
+ *
+ * The image is read and written with stdio, or, when the environment
+ * variable BLOCK_SIM is "mmap", mapped into memory so blocks are moved
+ * with bcopy. The mapping grows when a block past the end of the
+ * image is written, and is written back with msync by block_dev_sync.
  */
 
 #include <assert.h>
@@ -9,89 +15,143 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "block.h"
 #include "util.h"
 
 static FILE *fp; /* The file used to simulate a diskette */
 
+/* Memory mapped image, map_size bytes of it, NULL with stdio */
+static char *map;
+static long map_size;
+
+char *block_image = "image_sim";
+
+/* Device requests and blocks moved, see block_dev_stat */
+static int dev_reads, dev_writes;
+static int dev_blocks_read, dev_blocks_written;
+
+static void map_image(long size);
 static void error(char *fmt, ...);
 
 /* Initialize the file */
 void block_init(void) {
-	if ((fp = fopen("image_sim", "r+")) == NULL) {
+	char *backend = getenv("BLOCK_SIM");
+
+	if (map != NULL) {
+		munmap(map, map_size);
+		map = NULL;
+	}
+	if ((fp = fopen(block_image, "r+")) == NULL) {
 		error("could not open image file:");
 	}
+	if (backend != NULL && same_string(backend, "mmap")) {
+		fseek(fp, 0, SEEK_END);
+		map_image(ftell(fp));
+	}
+	block_cache_init();
 }
 
 void block_destruct(void) {
+	block_flush();
+	if (map != NULL) {
+		munmap(map, map_size);
+		map = NULL;
+	}
 	fclose(fp);
 }
 
-/* Read a block into memory[address] */
-int block_read(int block_num, void *address) {
-	if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
-		error("fseek error: ");
+/* Write back the image, so it is on disk */
+int block_dev_sync(void) {
+	if (map != NULL && msync(map, map_size, MS_SYNC) < 0) {
+		error("msync error: ");
 	}
+	return 1;
+}
 
-	if (fread(address, BLOCK_SIZE, 1, fp) != 1) {
+/* Read count blocks into memory[address] */
+int block_dev_read(int block_num, int count, void *address) {
+	if (map != NULL) {
+		if ((long)(block_num + count) * BLOCK_SIZE > map_size) {
+			error("read past end of image: block %d\n", block_num + count - 1);
+		}
+		bcopy(map + (long)block_num * BLOCK_SIZE, address, count * BLOCK_SIZE);
+	}
+	else if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
+		error("fseek error: ");
+	}
+	else if (fread(address, BLOCK_SIZE, count, fp) != (size_t)count) {
 		error("fread error: ");
 	}
+	dev_reads++;
+	dev_blocks_read += count;
 #ifndef NDEBUG
-	printf("block %d read\n", block_num);
+	printf("block %d read (%d blocks)\n", block_num, count);
 #endif /* NDEBUG */
 
 	return 1;
 }
 
-/* Wrtie from memory['address'] into block 'block' in the file */
-int block_write(int block_num, void *address) {
-	if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
-		error("fseek error: ");
+/* Write count blocks from memory['address'] into the file, starting at block 'block_num' */
+int block_dev_write(int block_num, int count, void *address) {
+	if (map != NULL) {
+		/* Writing past the end makes the image larger, like fwrite */
+		if ((long)(block_num + count) * BLOCK_SIZE > map_size) {
+			map_image((long)(block_num + count) * BLOCK_SIZE);
+		}
+		bcopy(address, map + (long)block_num * BLOCK_SIZE, count * BLOCK_SIZE);
 	}
-
-	if (fwrite(address, BLOCK_SIZE, 1, fp) != 1) {
-		error("write error: ");
+	else {
+		if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
+			error("fseek error: ");
+		}
+		if (fwrite(address, BLOCK_SIZE, count, fp) != (size_t)count) {
+			error("write error: ");
+		}
+		fflush(fp);
 	}
+	dev_writes++;
+	dev_blocks_written += count;
 #ifndef NDEBUG
-	printf("block %d written\n", block_num);
+	printf("block %d written (%d blocks)\n", block_num, count);
 #endif /* NDEBUG */
 
-	fflush(fp);
 	return 1;
 }
 
-/* Modify a block */
-int block_modify(int block_num, int offset, int data_size, void *data) {
-	char buf[BLOCK_SIZE];
-
-	assert((offset + data_size) <= BLOCK_SIZE);
-
-	block_read(block_num, buf);
-	bcopy(data, &buf[offset], data_size);
-	block_write(block_num, buf);
-
-#ifndef NDEBUG
-	printf("block %d modified (%d bytes)\n", block_num, data_size);
-#endif /* NDEBUG */
-
+/* Write the n single blocks block_num[i] from address[i] */
+int block_dev_write_list(int n, int block_num[], char *address[]) {
+	for (int i = 0; i < n; i++) {
+		block_dev_write(block_num[i], 1, address[i]);
+	}
 	return 1;
 }
 
-/* Read part of a block */
-int block_read_part(int block_num, int offset, int bytes, void *address) {
-	char buf[BLOCK_SIZE];
-
-	assert((offset + bytes) <= BLOCK_SIZE);
-
-	block_read(block_num, buf);
-	bcopy(&(buf[offset]), address, bytes);
-
-#ifndef NDEBUG
-	printf("block %d read from %d (%d bytes)\n", block_num, offset, bytes);
-#endif /* NDEBUG */
+/* Device requests and blocks read and written since the program started */
+void block_dev_stat(int *reads, int *writes, int *blocks_read, int *blocks_written) {
+	*reads = dev_reads;
+	*writes = dev_writes;
+	*blocks_read = dev_blocks_read;
+	*blocks_written = dev_blocks_written;
+}
 
-	return 1;
+/* Map the first size bytes of the image, making the file that large if it is smaller */
+static void map_image(long size) {
+	if (map != NULL) {
+		munmap(map, map_size);
+	}
+	fseek(fp, 0, SEEK_END);
+	if (ftell(fp) < size) {
+		fseek(fp, size - 1, SEEK_SET);
+		fputc(0, fp);
+		fflush(fp);
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+	if (map == MAP_FAILED) {
+		error("mmap error: ");
+	}
+	map_size = size;
 }
 
 /* print an error message and exit */
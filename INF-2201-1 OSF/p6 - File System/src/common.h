@@ -40,6 +40,11 @@ enum {
         SYSCALL_FS_MKDIR,
         SYSCALL_FS_CHDIR,       /* 25 */
         SYSCALL_FS_RMDIR,
+        SYSCALL_FS_GETDENTS,
+        SYSCALL_FS_SYNC,
+        SYSCALL_FS_READV,
+        SYSCALL_FS_WRITEV,
+        SYSCALL_FS_MMAP,
    SYSCALL_COUNT
 };
 
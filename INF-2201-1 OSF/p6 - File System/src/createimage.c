@@ -6,11 +6,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "fslayout.h"
+
 #define IMAGE_FILE "./image"
 #define ARGS "[--extended] [--vm]" \
 " [--fs] [--kernel] <bootblock> <executable-file> ..."
 
 #define SECTOR_SIZE 512
+
 #define OS_SIZE_LOC 2
 #define BOOT_MEM_LOC 0x7c00
 #define OS_MEM_LOC 0x8000
@@ -131,7 +134,7 @@ static void create_images(int nfiles, char *files[]) {
 
 	if (options.fs == 1) {
 		/* reserve some blocks for the filesystem. */
-		reserve_fs_blocks(&image, 512 + 2);
+		reserve_fs_blocks(&image, FS_BLOCKS);
 	}
 
 	while (nfiles > 0) {
@@ -370,8 +373,10 @@ static void reserve_fs_blocks(struct image_t *im, int fs_blocks) {
 		error("Unable to reserve %d blocks for filesystem\n", fs_blocks, left);
 	im->nbytes += fs_blocks * SECTOR_SIZE;
 	/* TODO: print which blocks were reserved */
-	if (options.extended == 1)
+	if (options.extended == 1) {
 		printf("Reserved %d blocks for the filesystem\n", fs_blocks);
+		printf("\tjournal: %d blocks from block %d\n", FS_JOURNAL_BLOCKS, FS_JOURNAL_START);
+	}
 }
 
 /* print an error message and exit */
@@ -12,40 +12,282 @@
 #include "fs_error.h"
 #include "inode.h"
 #include "kernel.h"
+#ifndef LINUX_SIM
+#include "memory.h"
+#include "usb/allocator.h"
+#else
+#define kzalloc(size) calloc(1, size)
+#define kfree free
+#endif /* LINUX_SIM */
 #include "superblock.h"
 #include "thread.h"
 #include "util.h"
 
-#define INODE_TABLE_ENTRIES 20
-#define BITMAP_ENTRIES 256
-#define MAGIC_NUM 0x420
+#define INODE_TABLE_ENTRIES 128 /* files open at the same time */
+#define INODE_HASH_BUCKETS 32   /* must be a power of two */
+#define FILE_TABLE_ENTRIES 256  /* opens of files by all processes */
+#define MAGIC_NUM 0x423 /* changes with the on-disk layout */
 #define FREE_BLK -1
 #define SIZEX 50
+#define RSV_WINDOWS 8 /* number of files that can have a reservation window */
+#define RSV_BLOCKS 8  /* blocks reserved for a growing file at a time */
+#define DCACHE_ENTRIES 64 /* cached directory entries */
+#define DCACHE_BUCKETS 32 /* must be a power of two */
+#define ICACHE_BLOCKS 8   /* inode table blocks kept in memory */
+#define INODES_PER_BLK (BLOCK_SIZE / sizeof(struct disk_inode))
+#define GDESC_PER_BLK (BLOCK_SIZE / sizeof(struct group_desc))
+#define GDT_BLOCKS ((FS_MAX_GROUPS + GDESC_PER_BLK - 1) / GDESC_PER_BLK)
+#define INODE_RATIO 2     /* blocks per inode made by fs_mkfs */
+#define RA_MIN 2          /* readahead window after the first sequential read */
+#define RA_MAX BLOCK_PREFETCH_MAX /* largest readahead window, in blocks */
+#define RA_QUEUE 8        /* readahead requests waiting for the thread */
+#define WBUF_ENTRIES 4    /* files that can have buffered writes */
+#define WBUF_SIZE (4 * BLOCK_SIZE) /* bytes buffered per file */
+#define WRITE_CHUNK 4     /* blocks written per transaction by write_data */
+#define FREE_CHUNK 4      /* blocks freed per transaction by fs_unlink and fs_rmdir */
+#define IO_BLOCKS 8       /* blocks moved through io_buf at a time, at least WRITE_CHUNK */
+
+/*
+ * Journal credits, the most buffers a transaction can dirty, see
+ * block_txn_begin. TXN_META is the superblock and the group
+ * descriptors, TXN_IND the indirect blocks that a few consecutive
+ * blocks can touch when they are allocated or freed, with their
+ * bitmaps.
+ */
+#define TXN_META (1 + GDT_BLOCKS)
+#define TXN_IND 7
+/* Every block of a chunk written, allocated past the end with its bitmap; the inline block; the inode */
+#define TXN_WRITE (3 * (WRITE_CHUNK + 1) + 2 + TXN_IND + 1 + TXN_META)
+/* Directory block allocated and changed; new inode and its bitmap; block of a new directory; two inodes */
+#define TXN_CREATE (3 + TXN_IND + 2 + 2 + 2 + TXN_META)
+/* New bucket, the bucket split, the directory inode */
+#define TXN_SPLIT (2 + TXN_IND + 1 + 1 + TXN_META)
+/* Bitmaps of the blocks freed, the inode */
+#define TXN_FREE (FREE_CHUNK + TXN_IND + 1 + TXN_META)
+/* Entry removed (two blocks, one freed), the last blocks of the inode removed, its bitmap, two inodes */
+#define TXN_REMOVE (3 + TXN_IND + FREE_CHUNK + TXN_IND + 1 + 2 + TXN_META)
+/* The block inline data moves to, its bitmap, the inode */
+#define TXN_INLINE (2 + 1 + TXN_META)
 
 /* Block index of superblock */
 int superblock_blk;
 /* Global superblock */
 static struct mem_superblock mem_superblock;
 
-/* Memory inode table */
-static char mem_inode_bmap[INODE_TABLE_ENTRIES];
+/*
+ * Memory inode table. Open inodes are chained by inode number from
+ * inode_hash, free entries are chained from mem_inode_free.
+ */
 static struct mem_inode mem_inode_table[INODE_TABLE_ENTRIES];
+static short inode_hash[INODE_HASH_BUCKETS];
+static short mem_inode_free;
+
+/*
+ * Open file table, shared by all processes. Every fs_open makes an
+ * entry holding the mode and position of that open, and a descriptor
+ * of the process refers to it. Free entries are chained from
+ * file_free through next.
+ */
+struct open_file {
+	short idx;         /* index into the memory inode table */
+	short next;        /* next free entry */
+	unsigned int mode; /* mode bits (see MODE_XXX enum vals in fs.h) */
+	int pos;           /* read/write position */
+	int ra_pos;        /* position a sequential read would start at next */
+	int ra_end;        /* first block that has not been read ahead yet */
+	short ra_window;   /* blocks to read ahead, 0 if reads are not sequential */
+};
+static struct open_file file_table[FILE_TABLE_ENTRIES];
+static short file_free;
 
 /* Char array with 0, used to clean */
 static char zero_block[BLOCK_SIZE];
 static char zero_dirent[sizeof(struct dirent)];
 static char zero_inode[sizeof(struct disk_inode)];
 
-/* Bitmaps */
-static char inode_bmap[BITMAP_ENTRIES];
-static char dblk_bmap[BITMAP_ENTRIES];
+/* Block being filled with inline data of a growing file, kept off the kernel stack */
+static char inline_block[BLOCK_SIZE];
+
+/* File data on its way between the buffer cache and a user buffer (see
+ * read_data), or inode table blocks read by fs_fsck */
+static union {
+	char data[IO_BLOCKS * BLOCK_SIZE];
+	struct disk_inode inode[IO_BLOCKS * INODES_PER_BLK];
+} io_buf;
+
+/* Indirect block with every entry set to FREE_BLK, used to init new indirect blocks */
+static blknum_t free_ind_block[INODE_NINDIRECT];
+
+/* Group descriptor table */
+static struct group_desc group_table[FS_MAX_GROUPS];
+
+/* Copy of the bitmap block of a group being searched for a free entry */
+static unsigned char bmap_buf[BLOCK_SIZE];
+
+/*
+ * Reservation windows. A file that is being written reserves a run
+ * of free data blocks within a group (in memory only), so it can keep
+ * growing contiguously. rsv_mask marks the windows of one group while
+ * its bitmap is searched. alloc_inode is the file currently acquiring
+ * blocks, or FREE_BLK if the allocation should not reserve.
+ */
+struct rsv_window {
+	inode_t inode; /* owner, FREE_BLK if unused */
+	int next;      /* next block to hand out */
+	int end;       /* first block after the window */
+};
+
+static unsigned char rsv_mask[BLOCK_SIZE];
+static struct rsv_window rsv_table[RSV_WINDOWS];
+static int rsv_victim;
+static inode_t alloc_inode = FREE_BLK;
+
+/*
+ * Directory entry cache. Maps (directory inode, name) to the inode
+ * the name refers to, or to FSE_DENOTFOUND for names known to be
+ * missing. Entries are kept up to date by write_dirent and
+ * remove_dirent, and replaced round robin.
+ */
+struct dcache_entry {
+	struct dcache_entry *hnext; /* hash chain */
+	inode_t dir;                /* directory, FREE_BLK if unused */
+	inode_t inode;              /* FSE_DENOTFOUND for a negative entry */
+	char name[MAX_FILENAME_LEN];
+};
+
+static struct dcache_entry dcache[DCACHE_ENTRIES];
+static struct dcache_entry *dcache_hash[DCACHE_BUCKETS];
+static int dcache_victim;
+static int dcache_hits;
+static int dcache_misses;
+
+/*
+ * Inode cache. Keeps whole blocks of the inode table in memory, so
+ * read_inode and write_inode only copy 64 bytes. Changed blocks are
+ * marked dirty and written as a whole by icache_flush, which fs_flush
+ * calls when an operation is done, or when the block is replaced.
+ */
+struct icache_block {
+	int block;      /* inode table block (filesystem block number), FREE_BLK if unused */
+	char dirty;     /* True if an inode changed since the block was written */
+	struct disk_inode inode[INODES_PER_BLK];
+};
+
+static struct icache_block icache[ICACHE_BLOCKS];
+static int icache_victim;
+
+/*
+ * fs_fsck state, allocated for the size of the file system: what the
+ * pass over the inode tables found for every inode, and the block
+ * bitmap being rebuilt for the groups from fsck_first (a block
+ * number), fsck_span blocks.
+ */
+struct fsck_inode {
+	short refs;   /* directory entries referring to it, other than "." and ".." */
+	short nlinks; /* on disk */
+	char type;    /* on disk if the inode is in use, 0 otherwise */
+};
+
+static struct fsck_inode *fsck_inodes;
+static int fsck_ninodes;
+static unsigned char *fsck_bmap;
+static int fsck_first;
+static int fsck_span;
+static blknum_t fsck_ind[2][INODE_NINDIRECT];
+
+/*
+ * Readahead requests, device block ranges queued by fs_read and read
+ * into the buffer cache by the readahead thread (fs_readahead).
+ */
+struct ra_request {
+	int block;
+	int count;
+};
+
+static struct ra_request ra_requests[RA_QUEUE];
+static int ra_head;
+static int ra_count;
+static lock_t ra_lock;
+static condition_t ra_more;
+
+/*
+ * Write buffers (delayed allocation). fs_write appends to the buffer
+ * of the file instead of writing through, and the blocks are only
+ * allocated and written by wbuf_flush: when the buffer is full, when
+ * the file is read, stated, seeked from the end, reopened or closed,
+ * and by fs_sync, which the flusher thread calls periodically. Until
+ * then d_inode.size does not include the buffered bytes.
+ */
+struct wbuf {
+	int idx;  /* memory inode table entry, FREE_BLK if unused */
+	int pos;  /* file offset of data[0] */
+	int len;  /* bytes buffered */
+	char data[WBUF_SIZE];
+};
+
+static struct wbuf wbufs[WBUF_ENTRIES];
+static int wbuf_victim;
+static int fs_mounted;
+
+/*
+ * Set when a block is freed, cleared by commit_frees. Runs of data
+ * blocks are written home by block_write_multi, outside the journal,
+ * and a block freed by an uncommitted call may be allocated again:
+ * written home before the free commits, a crash would leave its old
+ * owner pointing at the new data.
+ */
+static int blocks_freed;
+
+/*
+ * Every exported function runs its body (fs_<name>_locked) with
+ * fs_lock held, so system calls and the flusher thread never see each
+ * other's changes half done. The bitmaps, group descriptors, write
+ * buffers and static scratch buffers are all shared. fs_map_read and
+ * fs_map_write do without it: the pager calls them from a page fault,
+ * which may be taken by a call that already holds it.
+ */
+static lock_t fs_lock;
 
 int	printf (const char *__restrict, ...);
-static int get_free_entry(unsigned char *bitmap);
-static int free_bitmap_entry(int entry, unsigned char *bitmap);
+static int get_free_entry(unsigned char *bitmap, int nbits);
+static int free_bitmap_entry(int entry, unsigned char *bitmap, int nbits);
 static inode_t path2inode(char *name);
 static blknum_t ino2blk(inode_t ino);
 static blknum_t idx2blk(int index);
+static inode_t inode_alloc(inode_t near);
+static void inode_free(inode_t inode);
+static blknum_t alloc_block(char *fill, int goal);
+static int get_data_block(int goal);
+static void rsv_init(void);
+static void rsv_drop(inode_t inode);
+static blknum_t bmap(struct disk_inode *disk_inode, int lblk, int alloc);
+static void release_block(struct disk_inode *disk_inode, int lblk);
+static void dcache_init(void);
+static void dcache_set(inode_t dir, char *name, inode_t inode);
+static void dcache_purge(inode_t dir);
+static void icache_init(void);
+static int fs_flush(void);
+static int fs_mkfs_locked(int dir_format, int nblocks);
+static int fs_fsck_locked(void);
+static int commit_frees(void);
+static int fs_txn_end(int credits);
+static void wbuf_init(void);
+static struct wbuf *wbuf_find(int idx);
+static int wbuf_flush(struct wbuf *wb);
+static int test_bit(unsigned char *bitmap, int entry);
+static void set_bit(unsigned char *bitmap, int entry);
+static void clear_bit(unsigned char *bitmap, int entry);
+static int count_bits(unsigned char *bitmap, int nbits);
+static void fsck_walk(struct disk_inode *disk_inode, int mark);
+static void fsck_scan_dir(struct disk_inode *disk_inode);
+static int is_hashed(struct disk_inode *disk_inode);
+static int is_inline(struct disk_inode *disk_inode);
+static int dir_blocks(struct disk_inode *disk_inode);
+static int hdir_find(struct disk_inode *disk_inode, char *name, struct dirent *dirent);
+static int hdir_add(struct disk_inode *disk_inode, inode_t inode, char *name);
+static int hdir_make_room(struct disk_inode *disk_inode, inode_t dir, char *name);
+static int hdir_remove(struct disk_inode *disk_inode, char *name);
+static int hdir_read(struct disk_inode *disk_inode, int *pos, struct dirent *dirents, int count);
 
 /* Extract every directory name out of a path. This consist of replacing every '/' with '\0'.
  * Return number of directories in path. */
@@ -107,37 +349,164 @@ static int read_superblock(void) {
 	return block_read_part((os_size + 2) + superblock_blk, sizeof(struct disk_superblock) * 0, sizeof(struct disk_superblock), &mem_superblock.d_super);
 }
 
-static int write_bitmap(void) {
-	int ret = block_modify((os_size + 2) + mem_superblock.d_super.root_bmap, BITMAP_ENTRIES * 0, BITMAP_ENTRIES, mem_superblock.ibmap);
-	if(ret < 0)
-		return ret;
-	return block_modify((os_size + 2) + mem_superblock.d_super.root_bmap, BITMAP_ENTRIES * 1, BITMAP_ENTRIES, mem_superblock.dbmap);
+static int write_group(int group) {
+	blknum_t blk = mem_superblock.d_super.gdt_blk + group / GDESC_PER_BLK;
+	int offset = (group % GDESC_PER_BLK) * sizeof(struct group_desc);
+	return block_modify((os_size + 2) + blk, offset, sizeof(struct group_desc), &mem_superblock.gdt[group]);
+}
+
+static int read_groups(void) {
+	int ngroups = mem_superblock.d_super.ngroups;
+	if(ngroups <= 0 || ngroups > FS_MAX_GROUPS)
+		return -1;
+
+	/* A block of descriptors at a time */
+	for(int g = 0; g < ngroups; g += GDESC_PER_BLK) {
+		int n = (ngroups - g < (int)GDESC_PER_BLK) ? ngroups - g : (int)GDESC_PER_BLK;
+		blknum_t blk = mem_superblock.d_super.gdt_blk + g / GDESC_PER_BLK;
+		if(block_read_part((os_size + 2) + blk, 0, n * sizeof(struct group_desc), &mem_superblock.gdt[g]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* First block of a group, its number of blocks, and the group of a block */
+static blknum_t group_start(int group) {
+	return mem_superblock.d_super.first_group + group * mem_superblock.d_super.group_blocks;
+}
+
+static int group_size(int group) {
+	int n = mem_superblock.d_super.nblocks - group_start(group);
+	return (n < mem_superblock.d_super.group_blocks) ? n : mem_superblock.d_super.group_blocks;
+}
+
+static int block_group(blknum_t blk) {
+	return (blk - mem_superblock.d_super.first_group) / mem_superblock.d_super.group_blocks;
+}
+
+/* Inode table block holding an inode, FREE_BLK if there is no such inode */
+static blknum_t inode_block(inode_t inode_num) {
+	int group_inodes = mem_superblock.d_super.group_inodes;
+	if(inode_num < 0 || inode_num >= mem_superblock.d_super.ngroups * group_inodes)
+		return FREE_BLK;
+	return mem_superblock.gdt[inode_num / group_inodes].inode_table + (inode_num % group_inodes) / INODES_PER_BLK;
+}
+
+static void icache_init(void) {
+	for(int i = 0; i < ICACHE_BLOCKS; i++)
+		icache[i].block = FREE_BLK;
+	icache_victim = 0;
 }
 
-static int read_bitmap(void) {
-	int ret = block_read_part((os_size + 2) +  mem_superblock.d_super.root_bmap, BITMAP_ENTRIES * 0, BITMAP_ENTRIES, mem_superblock.ibmap);
+static int icache_write(struct icache_block *ib) {
+	int ret = block_write((os_size + 2) + ib->block, ib->inode);
 	if(ret < 0)
 		return ret;
-	return block_read_part((os_size + 2) +  mem_superblock.d_super.root_bmap, BITMAP_ENTRIES * 1, BITMAP_ENTRIES, mem_superblock.dbmap);
+	ib->dirty = 0;
+	return 0;
+}
+
+/* Write every dirty inode table block */
+static int icache_flush(void) {
+	int ret = 0;
+	for(int i = 0; i < ICACHE_BLOCKS; i++)
+		if(icache[i].block != FREE_BLK && icache[i].dirty && icache_write(&icache[i]) < 0)
+			ret = -1;
+	return ret;
+}
+
+/* Return the cached copy of inode table block, reading it on a miss */
+static struct icache_block *icache_get(int block) {
+	for(int i = 0; i < ICACHE_BLOCKS; i++)
+		if(icache[i].block == block)
+			return &icache[i];
+
+	/* Replace blocks round robin */
+	struct icache_block *ib = &icache[icache_victim];
+	icache_victim = (icache_victim + 1) % ICACHE_BLOCKS;
+	if(ib->block != FREE_BLK && ib->dirty && icache_write(ib) < 0)
+		return NULL;
+
+	ib->block = FREE_BLK;
+	if(block_read((os_size + 2) + block, ib->inode) < 0)
+		return NULL;
+	ib->block = block;
+	ib->dirty = 0;
+
+	return ib;
 }
 
 static int write_inode(struct disk_inode *disk_inode, inode_t inode_num) {
 
-	int block = inode_num / (BLOCK_SIZE / sizeof(struct disk_inode)); 	// Block to write
-	int offset = inode_num % (BLOCK_SIZE / sizeof(struct disk_inode));	// Offset to start write
+	blknum_t block = inode_block(inode_num);	// Block to write
+	int offset = inode_num % INODES_PER_BLK;	// Inode within block
 
-	return block_modify((os_size + 2) + mem_superblock.d_super.root_inode + block,  sizeof(struct disk_inode) * offset, sizeof(struct disk_inode), disk_inode);
+	if(block == FREE_BLK)
+		return -1;
+	struct icache_block *ib = icache_get(block);
+	if(ib == NULL)
+		return -1;
+	bcopy((char*)disk_inode, (char*)&ib->inode[offset], sizeof(struct disk_inode));
+	ib->dirty = 1;
+
+	return 0;
 }
 
 static int read_inode(struct disk_inode *disk_inode, inode_t inode_num) {
 
-	int block = inode_num / (BLOCK_SIZE / sizeof(struct disk_inode));	// Block to read
-	int offset = inode_num % (BLOCK_SIZE / sizeof(struct disk_inode));	// Offset to start read
+	blknum_t block = inode_block(inode_num);	// Block to read
+	int offset = inode_num % INODES_PER_BLK;	// Inode within block
+
+	if(block == FREE_BLK)
+		return -1;
+	struct icache_block *ib = icache_get(block);
+	if(ib == NULL)
+		return -1;
+	bcopy((char*)&ib->inode[offset], (char*)disk_inode, sizeof(struct disk_inode));
+
+	return 0;
+}
+
+/* Write cached inodes, then every dirty buffer, to disk */
+static int fs_flush(void) {
+	int ret = icache_flush();
+	if(block_sync() < 0)
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Commit the blocks freed since the last call, before data is written
+ * home outside the journal (see blocks_freed). Only called between
+ * transactions.
+ */
+static int commit_frees(void) {
+	if(!blocks_freed)
+		return 0;
+	blocks_freed = 0;
+	return block_sync();
+}
 
-	return block_read_part((os_size + 2) + mem_superblock.d_super.root_inode + block, sizeof(struct disk_inode) * offset, sizeof(struct disk_inode), disk_inode);
+/*
+ * End of a transaction begun with block_txn_begin(credits), its
+ * changes join the running journal transaction.
+ */
+static int fs_txn_end(int credits) {
+	int ret = icache_flush();
+	if(block_txn_end(credits) < 0)
+		ret = -1;
+	return ret;
 }
 
-static int write_dirent(struct disk_inode *disk_inode, inode_t inode, char *name) {
+static int write_dirent(struct disk_inode *disk_inode, inode_t dir, inode_t inode, char *name) {
+
+	/* Hashed directories place the entry in its bucket */
+	if(is_hashed(disk_inode)) {
+		if(hdir_add(disk_inode, inode, name) < 0)
+			return FSE_ADDDIR;
+		dcache_set(dir, name, inode);
+		return 1;
+	}
 
 	/* Declare directory entry */
 	struct dirent dirent;
@@ -151,11 +520,22 @@ static int write_dirent(struct disk_inode *disk_inode, inode_t inode, char *name
 
 	/* Update size in disk inode */
 	disk_inode->size += sizeof(struct dirent);
+	dcache_set(dir, name, inode);
 
 	return 1;
 }
 
-static int remove_dirent(struct disk_inode *disk_inode, char *remove_name) {
+static int remove_dirent(struct disk_inode *disk_inode, inode_t dir, char *remove_name) {
+
+	dcache_set(dir, remove_name, FSE_DENOTFOUND);
+
+	/* Hashed directories clear the slot in its bucket */
+	if(is_hashed(disk_inode)) {
+		if(hdir_remove(disk_inode, remove_name) < 0)
+			return FSE_DENOTFOUND;
+		disk_inode->size -= sizeof(struct dirent);
+		return 1;
+	}
 
 	/* Move last directory entry into slot where the removed directory entry resided.
 	 * Only necessary if there is more than 3 directory entries. */
@@ -187,13 +567,10 @@ static int remove_dirent(struct disk_inode *disk_inode, char *remove_name) {
 	int cur_blk = disk_inode->size / BLOCK_SIZE;
 	int new_blk = (disk_inode->size - sizeof(struct dirent)) / BLOCK_SIZE;
 	if(cur_blk > new_blk) {
-		free_bitmap_entry(disk_inode->direct[cur_blk], mem_superblock.dbmap);
-		disk_inode->direct[cur_blk] = FREE_BLK;
+		release_block(disk_inode, cur_blk);
 
 		/* Update superblock */
-		mem_superblock.d_super.ndata_blks--;
 		write_superblock();
-		write_bitmap();
 	}
 
 	/* Update size for parent inode */
@@ -203,25 +580,31 @@ static int remove_dirent(struct disk_inode *disk_inode, char *remove_name) {
 }
 
 static int open_inode(inode_t inode_num) {
+	short *chain = &inode_hash[inode_num & (INODE_HASH_BUCKETS - 1)];
 
 	/* Check if inode is open */
-	for(int i = 0; i < INODE_TABLE_ENTRIES; i++)
+	for(int i = *chain; i != FREE_BLK; i = mem_inode_table[i].hnext)
 		if(mem_inode_table[i].inode_num == inode_num) {
 			mem_inode_table[i].open_count++;
 			return i;
 		}
 
 	/* Get free slot in memory inode table */
-	int entry = get_free_entry((unsigned char *)mem_inode_bmap);
+	int entry = mem_inode_free;
+	if(entry == FREE_BLK)
+		return FSE_INODETABLEFULL;
 	int ret = read_inode(&mem_inode_table[entry].d_inode, inode_num);
 	if(ret < 0)
-		return -1;
+		return FSE_INVALIDINODE;
+	mem_inode_free = mem_inode_table[entry].hnext;
 
 	/* Init memory inode values */
 	mem_inode_table[entry].inode_num = inode_num;
 	mem_inode_table[entry].open_count = 1;
+	mem_inode_table[entry].map_count = 0;
 	mem_inode_table[entry].dirty = 0;
-	mem_inode_table[entry].pos = 0;
+	mem_inode_table[entry].hnext = *chain;
+	*chain = entry;
 
 	return entry;
 }
@@ -237,128 +620,493 @@ static int close_inode(int entry) {
 		if(mem_inode_table[entry].dirty == 1)
 			write_inode(&mem_inode_table[entry].d_inode, mem_inode_table[entry].inode_num);
 
+		/* Hand back blocks reserved for the file */
+		rsv_drop(mem_inode_table[entry].inode_num);
+
+		/* Unlink from the hash chain, and put on the free list */
+		short *chain = &inode_hash[mem_inode_table[entry].inode_num & (INODE_HASH_BUCKETS - 1)];
+		while(*chain != entry)
+			chain = &mem_inode_table[*chain].hnext;
+		*chain = mem_inode_table[entry].hnext;
+
 		mem_inode_table[entry].inode_num = FREE_BLK;
-		return free_bitmap_entry(entry, (unsigned char *)mem_inode_bmap);
+		mem_inode_table[entry].hnext = mem_inode_free;
+		mem_inode_free = entry;
+		return 0;
 	}
 
 	return FSE_COUNT;
 }
 
-static int helper_read_write(int (*operation)(int, int, int, void*), struct disk_inode *disk_inode, int offset, int size, char *buffer) {
-	
-	int new_blk = (offset + size) / (BLOCK_SIZE + 1);
+/*
+ * Open file table and descriptors
+ */
 
-	/* Check If read/write will span over to not acquired block */
-	if(disk_inode->direct[new_blk] == FREE_BLK)
-		return FSE_INVALIDBLOCK;
+/*
+ * file_table_init:
+ * Empty the memory inode table and the open file table.
+ */
+static void file_table_init(void) {
+	for(int i = 0; i < INODE_HASH_BUCKETS; i++)
+		inode_hash[i] = FREE_BLK;
+	for(int i = 0; i < INODE_TABLE_ENTRIES; i++) {
+		mem_inode_table[i].inode_num = FREE_BLK;
+		mem_inode_table[i].hnext = (i + 1 < INODE_TABLE_ENTRIES) ? i + 1 : FREE_BLK;
+	}
+	mem_inode_free = 0;
+
+	for(int i = 0; i < FILE_TABLE_ENTRIES; i++) {
+		file_table[i].idx = FREE_BLK;
+		file_table[i].next = (i + 1 < FILE_TABLE_ENTRIES) ? i + 1 : FREE_BLK;
+	}
+	file_free = 0;
+}
+
+/*
+ * file_open:
+ * Make an open file table entry for memory inode idx, read/written
+ * from pos on.
+ */
+static int file_open(int idx, unsigned int mode, int pos) {
+	int file = file_free;
+	if(file == FREE_BLK)
+		return FSE_NOMOREFDTE;
+	file_free = file_table[file].next;
+
+	file_table[file].idx = idx;
+	file_table[file].mode = mode;
+	file_table[file].pos = pos;
+	file_table[file].ra_pos = pos;
+	file_table[file].ra_window = 0;
+	file_table[file].ra_end = 0;
+	return file;
+}
+
+/*
+ * file_close:
+ * Release an open file table entry and its reference to the memory
+ * inode, after flushing the buffered writes of the file. Returns the
+ * result of the flush.
+ */
+static int file_close(int file) {
+	int idx = file_table[file].idx;
+
+	/* Allocate and write the buffered data */
+	int ret = wbuf_flush(wbuf_find(idx));
+	close_inode(idx);
+
+	file_table[file].idx = FREE_BLK;
+	file_table[file].next = file_free;
+	file_free = file;
+	return ret;
+}
+
+/*
+ * fd_file:
+ * Open file of descriptor fd of the running process, NULL if fd is
+ * not open.
+ */
+static struct open_file *fd_file(int fd) {
+	struct fd_table *fdt = current_running->filedes;
+
+	if(fdt == NULL || fd < 0 || fd >= fdt->size || fdt->file[fd] == FREE_BLK)
+		return NULL;
+	return &file_table[fdt->file[fd]];
+}
 
-	/* Calculate block to start read/write */
-	int cur_blk = 0;
-	while(offset >= BLOCK_SIZE) {
-		offset -= BLOCK_SIZE;
-		cur_blk++;
+/*
+ * fd_alloc:
+ * Give open file table entry file the lowest free descriptor of the
+ * running process. The descriptor table is made on the first open,
+ * and doubled when it is full, up to MAX_OPEN_FILES descriptors.
+ */
+static int fd_alloc(int file) {
+	struct fd_table *fdt = current_running->filedes;
+	int fd = 0;
+
+	if(fdt != NULL)
+		while(fd < fdt->size && fdt->file[fd] != FREE_BLK)
+			fd++;
+
+	if(fdt == NULL || fd == fdt->size) {
+		int size = (fdt == NULL) ? FD_TABLE_MIN : fdt->size * 2;
+		if(size > MAX_OPEN_FILES)
+			return FSE_NOMOREFDTE;
+
+		struct fd_table *grown = kzalloc(sizeof(struct fd_table) + size * sizeof(int));
+		if(grown == NULL)
+			return FSE_NOMOREFDTE;
+		grown->size = size;
+		for(int i = 0; i < size; i++)
+			grown->file[i] = (fdt != NULL && i < fdt->size) ? fdt->file[i] : FREE_BLK;
+
+		if(fdt != NULL)
+			kfree(fdt);
+		current_running->filedes = fdt = grown;
 	}
 
-	/* Calculate multiple read/write offsets */
-	int rw_offset[ (new_blk - cur_blk) + 1 ];
-	rw_offset[0] = offset;
-	for(int i = 1; i < (new_blk - cur_blk) + 1; i++)
-		rw_offset[i] = 0;
+	fdt->file[fd] = file;
+	return fd;
+}
+
+static int helper_read_write(int (*operation)(int, int, int, void*), struct disk_inode *disk_inode, int offset, int size, char *buffer) {
 
-	/* Calculate multiple read/write sizes */
-	int rw_size[ (new_blk - cur_blk) + 1 ];
-	for(int i = 0; i < (new_blk - cur_blk) + 1; i++) {
-		if( (rw_offset[i] + size) > BLOCK_SIZE )
-			rw_size[i] = BLOCK_SIZE - rw_offset[i];
+	/* Inline data is copied to or from the inode, the caller writes the inode */
+	if(is_inline(disk_inode)) {
+		if(offset + size > INODE_INLINE_MAX)
+			return FSE_INVALIDBLOCK;
+		if(operation == block_read_part)
+			bcopy((char *)disk_inode->direct + offset, buffer, size);
 		else
-			rw_size[i] = size;
-		size -= rw_size[i];
+			bcopy(buffer, (char *)disk_inode->direct + offset, size);
+		return 1;
 	}
 
-	/* Read/write part of block(s) */
-	int ret;
-	ret = operation((os_size + 2) + disk_inode->direct[cur_blk], rw_offset[0], rw_size[0], buffer);
-	if(ret < 0)
-		return FSE_INVALIDBLOCK;
-	for(int i = 1; i < (new_blk - cur_blk) + 1; i++) {
-		ret = operation((os_size + 2) + disk_inode->direct[cur_blk + i], rw_offset[i], rw_size[i], &buffer[rw_size[i-1]]);
+	while(size > 0) {
+		/* Block to read/write, and part of that block */
+		int lblk = offset / BLOCK_SIZE;
+		int blk_offset = offset % BLOCK_SIZE;
+		int blk_size = BLOCK_SIZE - blk_offset;
+		if(blk_size > size)
+			blk_size = size;
+
+		/* Check if read/write will span over to not acquired block */
+		blknum_t blk = bmap(disk_inode, lblk, 0);
+		if(blk == FREE_BLK)
+			return FSE_INVALIDBLOCK;
+
+		/* Count whole blocks that follow contiguously on disk */
+		int count = 1;
+		if(blk_offset == 0)
+			while(count < BLOCK_MULTI_MAX && (count + 1) * BLOCK_SIZE <= size &&
+			      bmap(disk_inode, lblk + count, 0) == blk + count)
+				count++;
+
+		int ret;
+		if(count > 1) {
+			/* Read/write the whole run with one request */
+			blk_size = count * BLOCK_SIZE;
+			if(operation == block_read_part)
+				ret = block_read_multi((os_size + 2) + blk, count, buffer);
+			else
+				ret = block_write_multi((os_size + 2) + blk, count, buffer);
+		} else {
+			/* Read/write part of block */
+			ret = operation((os_size + 2) + blk, blk_offset, blk_size, buffer);
+		}
 		if(ret < 0)
 			return FSE_INVALIDBLOCK;
+
+		offset += blk_size;
+		buffer += blk_size;
+		size -= blk_size;
 	}
 
 	return 1;
 }
 
+/* Hand a range of device blocks to the readahead thread */
+static void ra_queue(int block, int count) {
+#ifdef LINUX_SIM
+	/* The simulator has no background threads, read it right away */
+	block_prefetch(block, count);
+#else
+	lock_acquire(&ra_lock);
+	/* Readahead is only a hint, drop it if the thread is behind */
+	if(ra_count < RA_QUEUE) {
+		ra_requests[(ra_head + ra_count) % RA_QUEUE].block = block;
+		ra_requests[(ra_head + ra_count) % RA_QUEUE].count = count;
+		ra_count++;
+		condition_signal(&ra_more);
+	}
+	lock_release(&ra_lock);
+#endif /* LINUX_SIM */
+}
+
+/*
+ * While a file is read sequentially, the window of blocks read ahead
+ * of the reader doubles from RA_MIN up to RA_MAX. A read anywhere else
+ * turns readahead off until reads are sequential again. New blocks are
+ * only queued once the reader has used up half of the window, so the
+ * thread gets a few larger requests rather than one per read.
+ */
+static void readahead(struct open_file *file, int pos, int size) {
+	struct disk_inode *disk_inode = &mem_inode_table[file->idx].d_inode;
+
+	if(pos != file->ra_pos) {
+		file->ra_pos = pos + size;
+		file->ra_window = 0;
+		file->ra_end = 0;
+		return;
+	}
+	file->ra_pos = pos + size;
+
+	int next = (pos + size) / BLOCK_SIZE;
+	if(file->ra_end - next > file->ra_window / 2)
+		return;
+
+	if(file->ra_window == 0)
+		file->ra_window = RA_MIN;
+	else if(file->ra_window < RA_MAX)
+		file->ra_window *= 2;
+
+	/* Blocks from the next one to be read to the end of the window */
+	int lblk = (file->ra_end > next) ? file->ra_end : next;
+	int last = next + file->ra_window - 1;
+	if(last > (disk_inode->size - 1) / BLOCK_SIZE)
+		last = (disk_inode->size - 1) / BLOCK_SIZE;
+
+	/* Queue every run of blocks that are contiguous on disk */
+	while(lblk <= last) {
+		blknum_t blk = bmap(disk_inode, lblk, 0);
+		if(blk == FREE_BLK)
+			break;
+
+		int count = 1;
+		while(lblk + count <= last && bmap(disk_inode, lblk + count, 0) == blk + count)
+			count++;
+
+		ra_queue((os_size + 2) + blk, count);
+		lblk += count;
+	}
+	file->ra_end = lblk;
+}
+
+/*
+ * Called once by the kernel before the threads are started.
+ */
+void fs_static_init(void) {
+	lock_init(&fs_lock);
+	lock_init(&ra_lock);
+	condition_init(&ra_more);
+	ra_head = 0;
+	ra_count = 0;
+}
+
+/*
+ * Body of the readahead thread: wait for a request from fs_read and
+ * read its blocks into the buffer cache.
+ */
+void fs_readahead(void) {
+	struct ra_request req;
+
+	lock_acquire(&ra_lock);
+	while(ra_count == 0)
+		condition_wait(&ra_lock, &ra_more);
+	req = ra_requests[ra_head];
+	ra_head = (ra_head + 1) % RA_QUEUE;
+	ra_count--;
+	lock_release(&ra_lock);
+
+	block_prefetch(req.block, req.count);
+}
+
+/*
+ * Move the inline data of a file to a block of its own, in the group
+ * of the inode. The direct blocks are free for block numbers again.
+ */
+static int inline_to_block(struct disk_inode *disk_inode, inode_t inode) {
+	bzero(inline_block, BLOCK_SIZE);
+	bcopy((char *)disk_inode->direct, inline_block, INODE_INLINE_MAX);
+
+	int group = inode / mem_superblock.d_super.group_inodes;
+	blknum_t blk = alloc_block(inline_block, group_start(group));
+	if(blk == FREE_BLK)
+		return FSE_FULL;
+
+	for(int i = 0; i < INODE_NDIRECT; i++)
+		disk_inode->direct[i] = FREE_BLK;
+	disk_inode->direct[0] = blk;
+	disk_inode->flags &= ~INFLAG_INLINE;
+
+	return 0;
+}
+
 static int acquire_datablock(struct disk_inode *disk_inode, inode_t inode, int size) {
-	int idx;
+
+	/* Hashed directories get new buckets from write_dirent */
+	if(is_hashed(disk_inode))
+		return 0;
+
+	int ret = 1;
 
 	/* Check if inode need new datablock */
 	int cur_blk = disk_inode->size / BLOCK_SIZE;
 	int new_blk = (disk_inode->size + size) / BLOCK_SIZE;
-	if(cur_blk == new_blk)
+	if(is_inline(disk_inode) ? disk_inode->size + size <= INODE_INLINE_MAX : cur_blk == new_blk)
 		return 0;
 
-	/* Search for free space in inode */
-	for(idx = 0; idx < INODE_NDIRECT; idx++)
-		if(disk_inode->direct[idx] == FREE_BLK)
-			break;
-
-	/* If there is no free space in inode */
-	if(idx == INODE_NDIRECT)
+	/* Check if file would grow past what the inode can address */
+	if(new_blk >= INODE_MAXBLOCKS)
 		return FSE_FULL;
 
-	/* Insert block index into inode */
-	disk_inode->direct[idx] = get_free_entry((unsigned char *)mem_superblock.dbmap);
-	block_write((os_size + 2) + disk_inode->direct[idx], zero_block);
+	/* Map every block the write spans, acquiring the missing ones.
+	 * Files get a reservation window so they stay contiguous. */
+	alloc_inode = (disk_inode->type == INTYPE_FILE) ? inode : FREE_BLK;
+	if(is_inline(disk_inode) && inline_to_block(disk_inode, inode) < 0)
+		ret = FSE_FULL;
+	for(int lblk = cur_blk; lblk <= new_blk && ret >= 0; lblk++)
+		if(bmap(disk_inode, lblk, 1) == FREE_BLK) {
+			ret = FSE_FULL;
+			break;
+		}
+	alloc_inode = FREE_BLK;
 
-	/* Increament number of datablocks and write */
-	mem_superblock.d_super.ndata_blks++;
+	/* Write inode and superblock, also if we ran out of blocks half way */
 	write_inode(disk_inode, inode);
 	write_superblock();
-	write_bitmap();
+
+	return ret;
+}
+
+/*
+ * Read len bytes at pos of a file into buffer, which may be a user
+ * buffer. The blocks are read into io_buf and copied on from there:
+ * the buffer cache lock is never held while a user buffer is touched,
+ * since a page fault on it may need that lock (see memory.c), and the
+ * device only gets kernel addresses.
+ */
+static int read_data(struct disk_inode *disk_inode, int pos, char *buffer, int len) {
+	while(len > 0) {
+		/* Up to a block boundary, so later pieces are whole blocks */
+		int n = sizeof(io_buf.data) - pos % BLOCK_SIZE;
+		if(n > len)
+			n = len;
+
+		int ret = helper_read_write(block_read_part, disk_inode, pos, n, io_buf.data);
+		if(ret < 0)
+			return ret;
+		bcopy(io_buf.data, buffer, n);
+
+		pos += n;
+		buffer += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+/*
+ * Allocate the blocks for len bytes written at pos, write them and
+ * grow the file if the write ends past it. The inode goes to the inode cache so fs_sync makes
+ * the new size durable. The data is written WRITE_CHUNK blocks at a
+ * time, each chunk a transaction of its own that grows the file, so
+ * a large write never has to be committed half way. Like read_data,
+ * each chunk is copied to io_buf first, data may be a user buffer.
+ */
+static int write_data(struct mem_inode *mem_inode, int pos, char *data, int len) {
+	if(commit_frees() < 0)
+		return FSE_ERROR;
+
+	while(len > 0) {
+		/* Up to the next chunk boundary, so later chunks are whole blocks */
+		int n = WRITE_CHUNK * BLOCK_SIZE - pos % BLOCK_SIZE;
+		if(n > len)
+			n = len;
+		bcopy(data, io_buf.data, n);
+
+		if(block_txn_begin(TXN_WRITE) < 0)
+			return FSE_ERROR;
+
+		/* Only the part past the end of the file needs new blocks */
+		int grow = pos + n - mem_inode->d_inode.size;
+		int ret = (grow > 0) ? acquire_datablock(&mem_inode->d_inode, mem_inode->inode_num, grow) : 0;
+		if(ret < 0) {
+			fs_txn_end(TXN_WRITE);
+			return FSE_FULL;
+		}
+
+		ret = helper_read_write(block_modify, &mem_inode->d_inode, pos, n, io_buf.data);
+		if(grow > 0)
+			mem_inode->d_inode.size = pos + n;
+		write_inode(&mem_inode->d_inode, mem_inode->inode_num);
+		fs_txn_end(TXN_WRITE);
+		if(ret < 0)
+			return ret;
+
+		pos += n;
+		data += n;
+		len -= n;
+	}
 
 	return 1;
 }
 
+static void wbuf_init(void) {
+	for(int i = 0; i < WBUF_ENTRIES; i++) {
+		wbufs[i].idx = FREE_BLK;
+		wbufs[i].len = 0;
+	}
+	wbuf_victim = 0;
+}
+
+/* Write buffer of a memory inode table entry, NULL if it has none */
+static struct wbuf *wbuf_find(int idx) {
+	for(int i = 0; i < WBUF_ENTRIES; i++)
+		if(wbufs[i].idx == idx)
+			return &wbufs[i];
+	return NULL;
+}
+
+/* Write out a buffer (if any) and free it */
+static int wbuf_flush(struct wbuf *wb) {
+	int ret = 0;
+
+	if(wb == NULL || wb->idx == FREE_BLK)
+		return 0;
+
+	if(wb->len > 0)
+		ret = write_data(&mem_inode_table[wb->idx], wb->pos, wb->data, wb->len);
+	wb->idx = FREE_BLK;
+	wb->len = 0;
+
+	return ret;
+}
+
 static inode_t create_type(int type) {
 	int ret;
 
-	/* Get inode-entry index for directory.
+	/* Get inode-entry index for directory, in the group of the
+	 * current directory if it has room.
 	 * If there is no free entry, return  */
-	inode_t inode_entry = (inode_t)get_free_entry((unsigned char *)mem_superblock.ibmap);
+	inode_t inode_entry = inode_alloc(current_running->cwd);
 	if(inode_entry < 0)
 		return inode_entry;
 	write_inode((struct disk_inode*)zero_inode, inode_entry);	// Clear space on disk
-	mem_superblock.d_super.ninodes++;
-
-	/* Get datablock index for directory.
-	 * If there is no free entry, retrun */
-	int dblk_blk = get_free_entry((unsigned char *)mem_superblock.dbmap);
-	if(dblk_blk < 0)
-		return (inode_t)dblk_blk;
-	block_write((os_size + 2) + dblk_blk, zero_block);			// Clear space on disk
-	mem_superblock.d_super.ndata_blks++;
+	dcache_purge(inode_entry);									// Forget a previous directory with this inode
 
-	/* Init disk inode for directory */
+	/* Init disk inode, a file starts out with its data inline */
 	struct disk_inode disk_inode;
 	for(int i = 0; i < INODE_NDIRECT; i++)
-		disk_inode.direct[i] = FREE_BLK;
-	disk_inode.direct[0] = dblk_blk;
+		disk_inode.direct[i] = (type == INTYPE_FILE) ? 0 : FREE_BLK;
+	disk_inode.indirect = FREE_BLK;
+	disk_inode.dindirect = FREE_BLK;
 	disk_inode.nlinks = 0;
 	disk_inode.size = 0;
 	disk_inode.type = type;
+	disk_inode.nbuckets = (type == INTYPE_DIR && mem_superblock.d_super.dir_format == FS_DIR_HASHED);
+	disk_inode.flags = (type == INTYPE_FILE) ? INFLAG_INLINE : 0;
+
+	/* Get datablock index for directory, in the group of the inode.
+	 * If there is no free entry, retrun */
+	if(type == INTYPE_DIR) {
+		int group = inode_entry / mem_superblock.d_super.group_inodes;
+		disk_inode.direct[0] = alloc_block(zero_block, group_start(group));	// Cleared on disk
+		if(disk_inode.direct[0] == FREE_BLK)
+			return (inode_t)-1;
+	}
 
 	/* Check for type */
 	if(type == INTYPE_DIR) {
 		/* Write "." into datablock for inode */
 		char self[] = ".";
-		ret = write_dirent(&disk_inode, inode_entry, self);
+		ret = write_dirent(&disk_inode, inode_entry, inode_entry, self);
 		if(ret < 0)
 			return (inode_t)-1;
 
 		/* Write ".." into datablock for inode */
 		char parent[] = "..";
-		ret = write_dirent(&disk_inode, current_running->cwd, parent);
+		ret = write_dirent(&disk_inode, inode_entry, current_running->cwd, parent);
 		if(ret < 0)
 			return (inode_t)-1;
 	}
@@ -370,11 +1118,6 @@ static inode_t create_type(int type) {
 
 	/* Write superblock onto disk */
 	ret = write_superblock();
-	if(ret < 0)
-		return (inode_t)-1;
-
-	 /* Write datablock bitmap and inode bitmap onto disk */
-	ret = write_bitmap();
 	if(ret < 0)
 		return (inode_t)-1;
 
@@ -382,16 +1125,64 @@ static inode_t create_type(int type) {
 }
 
 /*
- * Exported functions.
+ * truncate_blocks:
+ * Free logical blocks nblks - 1 down to keep of an inode, FREE_CHUNK
+ * blocks per transaction. After every step the inode is written with
+ * its size (or buckets) cut to the blocks left, so each transaction
+ * leaves a consistent, shorter inode behind.
  */
-void fs_init(void) {
+static int truncate_blocks(struct disk_inode *disk_inode, inode_t inode, int nblks, int keep) {
+	while(nblks > keep) {
+		int stop = (nblks - FREE_CHUNK > keep) ? nblks - FREE_CHUNK : keep;
+
+		if(block_txn_begin(TXN_FREE) < 0)
+			return FSE_ERROR;
+		for(int i = nblks - 1; i >= stop; i--)
+			release_block(disk_inode, i);
+		nblks = stop;
+
+		if(is_hashed(disk_inode))
+			disk_inode->nbuckets = nblks;
+		else if(disk_inode->size > nblks * BLOCK_SIZE)
+			disk_inode->size = nblks * BLOCK_SIZE;
+		write_inode(disk_inode, inode);
+		write_superblock();
+		fs_txn_end(TXN_FREE);
+	}
+
+	return 0;
+}
+
+static void destroy_type(inode_t inode_num) {
+	struct disk_inode disk_inode;
+	read_inode(&disk_inode, inode_num);
+
+	/* Release last block first, so indirect blocks are freed as they empty */
+	int blocks = (disk_inode.type == INTYPE_DIR) ? dir_blocks(&disk_inode) : disk_inode.size / BLOCK_SIZE + 1;
+	for(int i = blocks - 1; i >= 0; i--)
+		release_block(&disk_inode, i);
+
+	inode_free(inode_num);
+	write_superblock();
+}
+
+/*
+ * Exported functions, the bodies run with fs_lock held.
+ */
+static void fs_init_locked(void) {
 
 	block_init();
 
+	/* Finish the last journal transaction, before anything is read */
+	block_journal_init((os_size + 2) + FS_JOURNAL_START, FS_JOURNAL_BLOCKS);
+	block_journal_replay();
+
 	/* Init char arrays with 0 */
 	bzero(zero_block, sizeof(zero_block));
 	bzero(zero_dirent, sizeof(zero_dirent));
 	bzero(zero_inode, sizeof(zero_inode));
+	for(int i = 0; i < INODE_NINDIRECT; i++)
+		free_ind_block[i] = FREE_BLK;
 
 	/* Block index of superblock, should always be first block in filesystem */
 	superblock_blk = 0;
@@ -400,106 +1191,142 @@ void fs_init(void) {
 	current_running->cwd = 0;
 
 	/* Init superblock on memory */
-	mem_superblock.dbmap = &dblk_bmap;
-	mem_superblock.ibmap = &inode_bmap;
+	mem_superblock.gdt = group_table;
 	mem_superblock.dirty = 0;
+	rsv_init();
+	dcache_init();
+	icache_init();
+	wbuf_init();
 	
 	/* Mark file descriptor table as "unused" */
-	for (int i = 0; i < MAX_OPEN_FILES; i++)
-		current_running->filedes[i].mode = MODE_UNUSED;
-
-	/* Mark memory inodes as "free" */
-	for(int i = 0; i < INODE_TABLE_ENTRIES; i++) {
-		mem_inode_bmap[i] = 0;
-		mem_inode_table[i].inode_num = -1;
+	if(current_running->filedes != NULL) {
+		kfree(current_running->filedes);
+		current_running->filedes = NULL;
 	}
 
+	/* Mark memory inodes and open files as "free" */
+	file_table_init();
+
 	read_superblock();
 	
 	/* Check if filesystem exists */
-	if(mem_superblock.d_super.magic != MAGIC_NUM)
-		fs_mkfs();
-	else
-		read_bitmap();
+	if(mem_superblock.d_super.magic != MAGIC_NUM || read_groups() < 0)
+		fs_mkfs_locked(FS_DIR_LINEAR, 0);
+	else {
+		struct disk_superblock *sb = &mem_superblock.d_super;
+		int free_inodes = 0;
+		int free_blocks = 0;
+		for(int g = 0; g < sb->ngroups; g++) {
+			free_inodes += mem_superblock.gdt[g].free_inodes;
+			free_blocks += mem_superblock.gdt[g].free_blocks;
+		}
 
+		/* Check the file system if the counts of the groups do not add up */
+		if(sb->ngroups * sb->group_inodes - free_inodes != sb->ninodes ||
+		   (sb->nblocks - sb->first_group) - free_blocks != sb->ndata_blks)
+			fs_fsck_locked();
+	}
+
+	fs_mounted = 1;
 }
 
 /*
- * Make a new file system.
- * Argument: kernel size
+ * Make a new file system of nblocks blocks, FS_BLOCKS if nblocks is
+ * 0. The blocks after the group descriptor table are split into
+ * groups of FS_GROUP_BLOCKS, a last group too small to hold its
+ * bitmaps and inode table is left out. Inode tables are not cleared,
+ * an inode is only read once its bitmap entry is set.
+ * Argument: directory format, FS_DIR_LINEAR or FS_DIR_HASHED
+ * Returns 0, or FSE_INVALIDSIZE if the groups do not fit in nblocks
+ * or the group descriptor table.
  */
-void fs_mkfs(void) {
-	int count = 0;	// number of datablocks acquired.
-
-	/* Mark inodes and data blocks as "free" */
-	for(int i = 0; i < BITMAP_ENTRIES; i++){
-		inode_bmap[i] = 0;
-		dblk_bmap[i] = 0;
+static int fs_mkfs_locked(int dir_format, int nblocks) {
+	struct disk_superblock *sb = &mem_superblock.d_super;
+	int first_group = FS_JOURNAL_START + FS_JOURNAL_BLOCKS + GDT_BLOCKS;
+
+	if(nblocks == 0)
+		nblocks = FS_BLOCKS;
+
+	/* About one inode per INODE_RATIO blocks, filling whole inode table blocks */
+	int avail = nblocks - first_group;
+	int span = (avail < FS_GROUP_BLOCKS) ? avail : FS_GROUP_BLOCKS;
+	int group_inodes = (span / INODE_RATIO + INODES_PER_BLK - 1) / INODES_PER_BLK * INODES_PER_BLK;
+	int itable_blocks = group_inodes / INODES_PER_BLK;
+
+	/* A group holds its two bitmaps, its inode table and at least one data block */
+	int ngroups = (avail + FS_GROUP_BLOCKS - 1) / FS_GROUP_BLOCKS;
+	if(ngroups > 0 && avail - (ngroups - 1) * FS_GROUP_BLOCKS < 2 + itable_blocks + 1) {
+		ngroups--;
+		nblocks = first_group + ngroups * FS_GROUP_BLOCKS;
 	}
+	if(ngroups <= 0 || ngroups > FS_MAX_GROUPS)
+		return FSE_INVALIDSIZE;
+
+	rsv_init();
+	dcache_init();
+	icache_init();
+	wbuf_init();
 
-	/* Get block-index for superblock */
-	superblock_blk = get_free_entry((unsigned char *)mem_superblock.dbmap);
+	/* Init superblock */
+	superblock_blk = 0;
+	bzero((char *)sb, sizeof(*sb));
+	sb->magic = MAGIC_NUM;
+	sb->dir_format = (dir_format == FS_DIR_HASHED) ? FS_DIR_HASHED : FS_DIR_LINEAR;
+	sb->max_filesize = INODE_MAXBLOCKS * BLOCK_SIZE;
+	sb->nblocks = nblocks;
+	sb->ngroups = ngroups;
+	sb->group_blocks = FS_GROUP_BLOCKS;
+	sb->group_inodes = group_inodes;
+	sb->gdt_blk = FS_JOURNAL_START + FS_JOURNAL_BLOCKS;
+	sb->first_group = first_group;
+	sb->journal_blk = FS_JOURNAL_START;
+	sb->journal_len = FS_JOURNAL_BLOCKS;
 	block_write((os_size + 2) + superblock_blk, zero_block);
-	count++;
-
-	/* Number of blocks for whole inode table */
-	int num = BLOCK_SIZE / sizeof(struct disk_inode);	// Number of inodes per block.
-	int blocks = (BITMAP_ENTRIES / num) + ((BITMAP_ENTRIES % num) != 0);	// Number of blocks for entire inode table, rounded up
-
-	/* Get block-index for root of inode table */
-	int inode_table_blk = get_free_entry((unsigned char *)mem_superblock.dbmap);
-	block_write((os_size + 2) + inode_table_blk, zero_block);
-	count++;
-
-	/* Fill rest of inode table */
-	for(int i = 0; i < (blocks - 1); i++) {
-		int ent = get_free_entry((unsigned char *)mem_superblock.dbmap);
-		block_write((os_size + 2) + ent, zero_block);
-		count++;
-	}
-
-	/* Get block-index for block allocation bitmap */
-	int block_alloc_blk = get_free_entry((unsigned char *)mem_superblock.dbmap);
-	block_write((os_size + 2) + block_alloc_blk, zero_block);
-	count++;
-
-	/* Init superblock on disk */
-	mem_superblock.d_super.magic = MAGIC_NUM;
-	mem_superblock.d_super.max_filesize = INODE_NDIRECT * BLOCK_SIZE;
-	mem_superblock.d_super.ndata_blks = count;
-	mem_superblock.d_super.ninodes = 0;
-	mem_superblock.d_super.root_inode = (blknum_t)inode_table_blk;
-	mem_superblock.d_super.root_bmap = (blknum_t)block_alloc_blk;
-
-	/* Create root directory */
+	for(int i = 0; i < (int)GDT_BLOCKS; i++)
+		block_write((os_size + 2) + sb->gdt_blk + i, zero_block);
+
+	/* Every group starts with its bitmaps and inode table, which are in use */
+	for(int g = 0; g < ngroups; g++) {
+		struct group_desc *gd = &mem_superblock.gdt[g];
+		int meta = 2 + itable_blocks;
+
+		gd->block_bmap = group_start(g);
+		gd->inode_bmap = group_start(g) + 1;
+		gd->inode_table = group_start(g) + 2;
+		gd->free_blocks = group_size(g) - meta;
+		gd->free_inodes = group_inodes;
+		sb->ndata_blks += meta;
+
+		bzero((char *)bmap_buf, sizeof(bmap_buf));
+		for(int i = 0; i < meta; i++)
+			set_bit(bmap_buf, i);
+		block_write((os_size + 2) + gd->block_bmap, bmap_buf);
+		block_write((os_size + 2) + gd->inode_bmap, zero_block);
+		write_group(g);
+	}
+
+	/* Make sure the device holds the last block */
+	block_write((os_size + 2) + nblocks - 1, zero_block);
+	write_superblock();
+
+	/* Create root directory, its ".." refers to itself */
+	current_running->cwd = 0;
 	create_type(INTYPE_DIR);
-}
 
-/* Return index into file descriptor, update file descriptor */
-int fs_open(const char *path, int mode) {
+	/* Write the new filesystem out of the buffer cache */
+	fs_flush();
 
-	int fd_idx, mode_bit, mem_entry_idx = 0;
+	return 0;
+}
 
-	/* Search for unused file descriptor */
-	for(fd_idx = 0; fd_idx < MAX_OPEN_FILES; fd_idx++)
-		if( current_running->filedes[fd_idx].mode == MODE_UNUSED )
-			break;
+/* Return index into file descriptor, update file descriptor */
+static int fs_open_locked(const char *path, int mode) {
 
-	/* Out of file descriptor table entries */
-	if(fd_idx == MAX_OPEN_FILES)
-		return FSE_NOMOREFDTE;
+	int mode_bit, mem_entry_idx, pos = 0;
 
 	/* Get inode for last name in path */
 	inode_t inode = path2inode((char*)path);
 
-	/* If mode read only, check if filename exists */
-	mode_bit = mode & MODE_RDONLY;
-	if(mode_bit == MODE_RDONLY) {
-		if(inode < 0)
-			return FSE_NOTEXIST;
-		mem_entry_idx = open_inode(inode);
-	}
-
 	/* If mode create, create new file if name does not exist.
 	 * If name exists, check if name is of type file. */
 	mode_bit = mode & MODE_CREAT;
@@ -519,22 +1346,42 @@ int fs_open(const char *path, int mode) {
 			struct disk_inode disk_inode;
 			read_inode(&disk_inode, current_running->cwd);
 
+			/* The new inode and directory entry are one transaction */
+			if(hdir_make_room(&disk_inode, current_running->cwd, (char*)path) < 0)
+				return FSE_FULL;
+			if(block_txn_begin(TXN_CREATE) < 0)
+				return FSE_ERROR;
+
 			/* Check if current working directory need a new block for the new directory entry */
 			ret = acquire_datablock(&disk_inode, current_running->cwd, (int)sizeof(struct dirent));
-			if(ret < 0)
+			if(ret < 0) {
+				fs_txn_end(TXN_CREATE);
 				return FSE_FULL;
+			}
 
 			/* Init new file */
 			inode_t file_inode = create_type(INTYPE_FILE);
+			if(file_inode < 0) {
+				fs_txn_end(TXN_CREATE);
+				return FSE_FULL;
+			}
 
 			/* Write new directory entry, into current working directory */
-			write_dirent(&disk_inode, file_inode, (char*)path);
+			ret = write_dirent(&disk_inode, current_running->cwd, file_inode, (char*)path);
 
 			/* Update current working inode, since the new entry increases size */
 			write_inode(&disk_inode, current_running->cwd);
+			if(ret < 0) {
+				destroy_type(file_inode);
+				fs_txn_end(TXN_CREATE);
+				return FSE_FULL;
+			}
 
 			/* Open newly created file */
 			mem_entry_idx = open_inode(file_inode);
+
+			/* Commit the new inode and directory entry */
+			fs_txn_end(TXN_CREATE);
 		} 
 		/* File exist */
 		else {
@@ -547,47 +1394,136 @@ int fs_open(const char *path, int mode) {
 
 			/* Open previously created file */
 			mem_entry_idx = open_inode(inode);
+			if(mem_entry_idx < 0)
+				return mem_entry_idx;
 
-			/* Update position to where file last left off */
-			mem_inode_table[mem_entry_idx].pos = mem_inode_table[mem_entry_idx].d_inode.size;
+			/* Writes buffered through another descriptor count in the size */
+			wbuf_flush(wbuf_find(mem_entry_idx));
+
+			/* Start at where file last left off */
+			pos = mem_inode_table[mem_entry_idx].d_inode.size;
 		}
 	}
+	/* Else the name must exist */
+	else {
+		if(inode < 0)
+			return FSE_NOTEXIST;
+		mem_entry_idx = open_inode(inode);
+	}
+	if(mem_entry_idx < 0)
+		return mem_entry_idx;
+
+	/* Make an open file with its own position, and a descriptor for it */
+	int file = file_open(mem_entry_idx, mode, pos);
+	if(file < 0) {
+		close_inode(mem_entry_idx);
+		return file;
+	}
+	int fd = fd_alloc(file);
+	if(fd < 0)
+		file_close(file);
+
+	return fd;
+}
 
-	/* Init file descriptor */
-	current_running->filedes[fd_idx].idx = mem_entry_idx;
-	current_running->filedes[fd_idx].mode = mode;
+static int fs_close_locked(int fd) {
+	struct open_file *file = fd_file(fd);
+	if(file == NULL)
+		return FSE_INVALIDHANDLE;
 
-	return fd_idx;
+	/* Flush and close the open file, then free the descriptor */
+	int ret = file_close(file - file_table);
+	current_running->filedes->file[fd] = FREE_BLK;
+
+	/* Write back data and metadata buffered since open */
+	fs_flush();
+
+	return (ret < 0) ? ret : 0;
 }
 
-int fs_close(int fd) {
+/*
+ * Drop the file mappings and close every descriptor of the running
+ * process, called when it exits.
+ */
+static void fs_exit_locked(void) {
+#ifndef LINUX_SIM
+	/* Drop the references of the mappings, memory_unmap_files detached the pages */
+	if(!current_running->is_thread)
+		for(int i = 0; i < MAX_MMAPS; i++) {
+			struct mmap_region *r = &current_running->mmaps[i];
+			if(r->vaddr == 0)
+				continue;
+			mem_inode_table[r->idx].map_count--;
+			close_inode(r->idx);
+			r->vaddr = 0;
+		}
+#endif /* LINUX_SIM */
 
-	/* Close inode in memory inode table */
-	close_inode(current_running->filedes[fd].idx);
-	current_running->filedes[fd].mode = MODE_UNUSED;
+	struct fd_table *fdt = current_running->filedes;
+	if(fdt == NULL)
+		return;
 
-	return 0;
+	for(int fd = 0; fd < fdt->size; fd++)
+		if(fdt->file[fd] != FREE_BLK)
+			file_close(fdt->file[fd]);
+	fs_flush();
+
+	current_running->filedes = NULL;
+	kfree(fdt);
 }
 
-int fs_read(int fd, char *buffer, int size) {
+/*
+ * Write every buffered file and all dirty metadata to disk.
+ */
+int fs_sync(void) {
+	int ret = 0;
+
+	/* Nothing to do before fs_init, the flusher thread may run early */
+	if(!fs_mounted)
+		return 0;
+
+#ifndef LINUX_SIM
+	/* Pages changed through fs_mmap */
+	memory_sync_files();
+#endif /* LINUX_SIM */
+
+	lock_acquire(&fs_lock);
+	for(int i = 0; i < WBUF_ENTRIES; i++)
+		if(wbuf_flush(&wbufs[i]) < 0)
+			ret = FSE_FULL;
+
+	if(fs_flush() < 0 || block_flush() < 0)
+		ret = FSE_ERROR;
+	lock_release(&fs_lock);
+
+	return ret;
+}
+
+static int fs_read_locked(int fd, char *buffer, int size) {
 	int read_size = 0;
 
-	/* Index into global memory inode table */
-	int idx = current_running->filedes[fd].idx;
+	/* Open file of the descriptor, and its index into global memory inode table */
+	struct open_file *file = fd_file(fd);
+	if(file == NULL)
+		return FSE_INVALIDHANDLE;
+	int idx = file->idx;
 
 	/* Check if caller have permission to read */
-	int mode_bit = current_running->filedes[fd].mode & MODE_RDONLY;
+	int mode_bit = file->mode & MODE_RDONLY;
 	if(mode_bit != MODE_RDONLY)
 		return 0;
 
+	/* Buffered writes must be on disk before they can be read */
+	wbuf_flush(wbuf_find(idx));
+
 	/* Read values for different types */
 	switch(mem_inode_table[idx].d_inode.type) {
 		case INTYPE_FILE:
 			/* Check how much to read */
-			if( ( mem_inode_table[idx].d_inode.size - (mem_inode_table[idx].pos + BLOCK_SIZE) ) > 0 )
-				read_size = size;															// read block size
+			if( ( mem_inode_table[idx].d_inode.size - (file->pos + size) ) > 0 )
+				read_size = size;															// read requested size
 			else
-				read_size = mem_inode_table[idx].d_inode.size - mem_inode_table[idx].pos;	// read remaining
+				read_size = mem_inode_table[idx].d_inode.size - file->pos;	// read remaining
 		break;
 
 		case INTYPE_DIR:
@@ -595,29 +1531,43 @@ int fs_read(int fd, char *buffer, int size) {
 			if(size > (int)sizeof(struct dirent))
 				return 0;
 			read_size = size;
+
+			/* Hashed directories have empty slots, return the next entry in use */
+			if(is_hashed(&mem_inode_table[idx].d_inode)) {
+				struct dirent dirent;
+				if(hdir_read(&mem_inode_table[idx].d_inode, &file->pos, &dirent, 1) == 0)
+					return 0;
+				bcopy((char*)&dirent, buffer, read_size);
+				return read_size;
+			}
 		break;
 
 		return 0;	// Invalid type
 	}
 
 	/* Check if read will read out of file */
-	if( (mem_inode_table[idx].pos + read_size) > mem_inode_table[idx].d_inode.size )
+	if( (file->pos + read_size) > mem_inode_table[idx].d_inode.size )
 		return 0;
 
 	/* Read given size of datablock(s) */
-	helper_read_write(block_read_part, &mem_inode_table[idx].d_inode, mem_inode_table[idx].pos, read_size, buffer);
-	mem_inode_table[idx].pos += read_size;	// Update position
+	read_data(&mem_inode_table[idx].d_inode, file->pos, buffer, read_size);
+	if(mem_inode_table[idx].d_inode.type == INTYPE_FILE)
+		readahead(file, file->pos, read_size);
+	file->pos += read_size;	// Update position
 
 	return read_size;
 }
 
-int fs_write(int fd, char *buffer, int size) {
+static int fs_write_locked(int fd, char *buffer, int size) {
 
-	/* Index into global memory inode table */
-	int idx = current_running->filedes[fd].idx;
+	/* Open file of the descriptor, and its index into global memory inode table */
+	struct open_file *file = fd_file(fd);
+	if(file == NULL)
+		return FSE_INVALIDHANDLE;
+	int idx = file->idx;
 
 	/* Check if caller have permission to write */
-	int mode_bit = current_running->filedes[fd].mode & MODE_WRONLY;
+	int mode_bit = file->mode & MODE_WRONLY;
 	if(mode_bit != MODE_WRONLY)
 		return FSE_INVALIDMODE;
 
@@ -625,48 +1575,252 @@ int fs_write(int fd, char *buffer, int size) {
 	if(mem_inode_table[idx].d_inode.type != INTYPE_FILE)
 		return FSE_INVALIDMODE;
 
-	/* Check if write will write out of file */
-	int ret = acquire_datablock(&mem_inode_table[idx].d_inode, mem_inode_table[idx].inode_num, strlen(buffer));
-	if(ret < 0)
+	int len = size;
+	int ret = 0;
+
+	if(len <= 0)
+		return 0;
+
+	struct wbuf *wb = wbuf_find(idx);
+
+	/* Blocks are allocated when the data is flushed, but refuse a
+	 * write that can not fit in the file or on the disk now */
+	int cur_size = mem_inode_table[idx].d_inode.size;
+	int end = file->pos + len;
+	if(wb != NULL && wb->pos + wb->len > end)
+		end = wb->pos + wb->len;
+	if(cur_size > end)
+		end = cur_size;
+	int end_blk = end / BLOCK_SIZE;
+	if(end_blk >= INODE_MAXBLOCKS ||
+	   end_blk - cur_size / BLOCK_SIZE > (mem_superblock.d_super.nblocks - mem_superblock.d_super.first_group) - mem_superblock.d_super.ndata_blks) {
 		return FSE_FULL;
+	}
+
+	/* Only a write that continues the buffered data can join it */
+	if(wb != NULL && (file->pos != wb->pos + wb->len || wb->len + len > WBUF_SIZE)) {
+		ret = wbuf_flush(wb);
+		wb = NULL;
+	}
+
+	if(ret >= 0 && len > WBUF_SIZE) {
+		/* Too large to buffer, write it through */
+		ret = write_data(&mem_inode_table[idx], file->pos, buffer, len);
+	} else if(ret >= 0) {
+		if(wb == NULL) {
+			/* Take the next buffer round robin. A buffer of another
+			 * file that can not be written out keeps its data, and
+			 * this write fails instead. */
+			wb = &wbufs[wbuf_victim];
+			wbuf_victim = (wbuf_victim + 1) % WBUF_ENTRIES;
+			if(wb->idx != FREE_BLK && wb->len > 0 &&
+			   write_data(&mem_inode_table[wb->idx], wb->pos, wb->data, wb->len) < 0)
+				return FSE_FULL;
+			wb->idx = idx;
+			wb->len = 0;
+			wb->pos = file->pos;
+		}
+		bcopy(buffer, &wb->data[wb->len], len);
+		wb->len += len;
+
+		/* A full buffer goes out right away */
+		if(wb->len == WBUF_SIZE)
+			ret = wbuf_flush(wb);
+	}
 
-	/* Write buffer, update inode size and position */
-	helper_read_write(block_modify, &mem_inode_table[idx].d_inode, mem_inode_table[idx].pos, strlen(buffer), buffer);
-	mem_inode_table[idx].d_inode.size += strlen(buffer);
-	mem_inode_table[idx].pos += strlen(buffer);
+	/* Update position */
+	file->pos += len;
 	mem_inode_table[idx].dirty = 1;		// set dirty bit since size is changed.
 
+	return (ret < 0) ? FSE_FULL : len;
+}
+
+/*
+ * Map len bytes of an open file, from offset (a multiple of the page
+ * size), into the address space of the caller. The pages are read on
+ * first access and written back when they are replaced or by fs_sync.
+ * The file stays open while it is mapped, also after fs_close. The
+ * mapping can not grow the file. Returns the address of the mapping.
+ */
+static int fs_mmap_locked(int fd, int offset, int len) {
+#ifdef LINUX_SIM
+	/* No virtual memory in the simulator */
+	return FSE_ERROR;
+#else
+	struct open_file *file = fd_file(fd);
+	if(file == NULL)
+		return FSE_INVALIDHANDLE;
+
+	int idx = file->idx;
+	if(mem_inode_table[idx].d_inode.type != INTYPE_FILE)
+		return FSE_INVALIDMODE;
+
+	/* Pages are read straight from the blocks, buffered writes must be there */
+	wbuf_flush(wbuf_find(idx));
+
+	struct disk_inode *disk_inode = &mem_inode_table[idx].d_inode;
+	if(offset < 0 || (offset % PAGE_SIZE) != 0 || len <= 0 ||
+	   offset + len > disk_inode->size)
+		return FSE_INVALIDOFFSET;
+
+	/* fs_map_write only writes data blocks, inline data gets one first */
+	if(is_inline(disk_inode)) {
+		if(block_txn_begin(TXN_INLINE) < 0)
+			return FSE_ERROR;
+		int ret = inline_to_block(disk_inode, mem_inode_table[idx].inode_num);
+		if(ret == 0) {
+			write_inode(disk_inode, mem_inode_table[idx].inode_num);
+			write_superblock();
+		}
+		fs_txn_end(TXN_INLINE);
+		if(ret < 0)
+			return ret;
+	}
+
+	/* fs_map_write writes the blocks of the file home outside the journal */
+	if(commit_frees() < 0)
+		return FSE_ERROR;
+
+	uint32_t addr = memory_map_file(idx, offset, len);
+	if(addr == 0)
+		return FSE_ERROR;
+
+	/* The mapping holds a reference to the memory inode until the process exits */
+	mem_inode_table[idx].open_count++;
+	mem_inode_table[idx].map_count++;
+
+	return (int)addr;
+#endif /* LINUX_SIM */
+}
+
+/*
+ * Read a page of a mapped file for the pager. The part past the end
+ * of the file is zero. Runs without fs_lock, see there.
+ */
+int fs_map_read(int idx, int offset, char *page, int size) {
+	struct disk_inode *disk_inode = &mem_inode_table[idx].d_inode;
+
+	bzero(page, size);
+	if(offset >= disk_inode->size)
+		return 0;
+	if(offset + size > disk_inode->size)
+		size = disk_inode->size - offset;
+
+	return helper_read_write(block_read_part, disk_inode, offset, size, page);
+}
+
+/*
+ * Write a dirty page of a mapped file back for the pager. The blocks
+ * of the page inside the file are written through, leaving the
+ * buffers clean. Nothing but data changes, fs_mmap gave the file its
+ * blocks, so this needs neither fs_lock nor a transaction. The tail
+ * of the last block past the end of the file is written too, it is
+ * never read back.
+ */
+int fs_map_write(int idx, int offset, char *page, int size) {
+	struct disk_inode *disk_inode = &mem_inode_table[idx].d_inode;
+
+	if(offset >= disk_inode->size)
+		return 0;
+	if(offset + size > disk_inode->size)
+		size = disk_inode->size - offset;
+
+	/* Every run of blocks that is contiguous on disk in one request */
+	int lblk = offset / BLOCK_SIZE;
+	int last = (offset + size - 1) / BLOCK_SIZE;
+	while(lblk <= last) {
+		blknum_t blk = bmap(disk_inode, lblk, 0);
+		if(blk == FREE_BLK)
+			return FSE_INVALIDBLOCK;
+
+		int count = 1;
+		while(lblk + count <= last && count < BLOCK_MULTI_MAX && bmap(disk_inode, lblk + count, 0) == blk + count)
+			count++;
+
+		if(block_write_multi((os_size + 2) + blk, count, page) < 0)
+			return FSE_INVALIDBLOCK;
+		page += count * BLOCK_SIZE;
+		lblk += count;
+	}
+
 	return 1;
 }
 
+/*
+ * Read into the iovcnt buffers of iov in turn, stopping at the end of
+ * the file. Returns the number of bytes read.
+ */
+static int fs_readv_locked(int fd, struct iovec *iov, int iovcnt) {
+	int total = 0;
+
+	if(iovcnt < 0 || iovcnt > FS_IOV_MAX)
+		return FSE_ERROR;
+
+	for(int i = 0; i < iovcnt; i++) {
+		int ret = fs_read_locked(fd, iov[i].base, iov[i].len);
+		if(ret < 0)
+			return (total > 0) ? total : ret;
+		total += ret;
+		if(ret < iov[i].len)
+			break;
+	}
+
+	return total;
+}
+
+/*
+ * Write the iovcnt buffers of iov in turn. The pieces join in the
+ * write buffer of the file like one larger fs_write. Returns the number
+ * of bytes written.
+ */
+static int fs_writev_locked(int fd, struct iovec *iov, int iovcnt) {
+	int total = 0;
+
+	if(iovcnt < 0 || iovcnt > FS_IOV_MAX)
+		return FSE_ERROR;
+
+	for(int i = 0; i < iovcnt; i++) {
+		int ret = fs_write_locked(fd, iov[i].base, iov[i].len);
+		if(ret < 0)
+			return (total > 0) ? total : ret;
+		total += ret;
+	}
+
+	return total;
+}
+
 /*
  * fs_lseek:
  * This function is really incorrectly named, since neither its offset
  * argument or its return value are longs (or off_t's).
  */
-int fs_lseek(int fd, int offset, int whence) {
+static int fs_lseek_locked(int fd, int offset, int whence) {
 
-	/* Index into global memory inode table */
-	int idx = current_running->filedes[fd].idx;
+	/* Open file of the descriptor, and its index into global memory inode table */
+	struct open_file *file = fd_file(fd);
+	if(file == NULL)
+		return FSE_INVALIDHANDLE;
+	int idx = file->idx;
 
 	switch(whence) {
 		case SEEK_SET:	// Beginning of file.
-		mem_inode_table[idx].pos = offset;
+		file->pos = offset;
 		break;
 
 		case SEEK_CUR:	// Current position of the file pointer.
-		mem_inode_table[idx].pos += offset;
+		file->pos += offset;
 		break;
 
 		case SEEK_END:	// End of file.
-		mem_inode_table[idx].pos = mem_inode_table[idx].d_inode.size - offset;
+		wbuf_flush(wbuf_find(idx));
+		file->pos = mem_inode_table[idx].d_inode.size - offset;
 		break;
 	}
 
 	return 1;
 }
 
-int fs_mkdir(char *dirname) {
+static int fs_mkdir_locked(char *dirname) {
 	int ret;
 
 	/* Check if filename is valid */
@@ -674,32 +1828,50 @@ int fs_mkdir(char *dirname) {
 	if(ret < 0)
 		return ret;
 
+	/* Check if dirname exists */
+	if(path2inode(dirname) >= 0)
+		return FSE_EXIST;
+
 	/* Get current working inode */
 	struct disk_inode disk_inode;
 	read_inode(&disk_inode, current_running->cwd);
 
+	/* The new directory and its entry are one transaction */
+	if(hdir_make_room(&disk_inode, current_running->cwd, dirname) < 0)
+		return FSE_FULL;
+	if(block_txn_begin(TXN_CREATE) < 0)
+		return FSE_ERROR;
+
 	/* Check if current working directory need a new block for the new directory entry */
 	ret = acquire_datablock(&disk_inode, current_running->cwd, (int)sizeof(struct dirent));
-	if(ret < 0)
+	if(ret < 0) {
+		fs_txn_end(TXN_CREATE);
 		return FSE_FULL;
-
-	/* Check if dirname exists */
-	if(path2inode(dirname) >= 0)
-		return FSE_EXIST;
+	}
 
 	/* Init new directory */
 	inode_t inode = create_type(INTYPE_DIR);
+	if(inode < 0) {
+		fs_txn_end(TXN_CREATE);
+		return FSE_FULL;
+	}
 
 	/* Write new directory entry, into current working directory */
-	write_dirent(&disk_inode, inode,  dirname);
+	ret = write_dirent(&disk_inode, current_running->cwd, inode,  dirname);
 
 	/* Update current working inode, since the new entry increases size */
 	write_inode(&disk_inode, current_running->cwd);
+	if(ret < 0) {
+		destroy_type(inode);
+		fs_txn_end(TXN_CREATE);
+		return FSE_FULL;
+	}
+	fs_txn_end(TXN_CREATE);
 
 	return 0;
 }
 
-int fs_chdir(char *path) {
+static int fs_chdir_locked(char *path) {
 
 	/* Get inode of last name in path */
 	int inum = path2inode(path);
@@ -717,7 +1889,7 @@ int fs_chdir(char *path) {
 	return 0;
 }
 
-int fs_rmdir(char *dirname) {
+static int fs_rmdir_locked(char *dirname) {
 	int ret;
 
 	/* Check if filename is valid */
@@ -742,15 +1914,21 @@ int fs_rmdir(char *dirname) {
 	if( remove_inode.size != (int)(sizeof(struct dirent) * 2) ) 
 		return FSE_DNOTEMPTY;
 
+	/* Buckets a hashed directory has left go first, while the entry still refers to it */
+	ret = truncate_blocks(&remove_inode, remove_inum, dir_blocks(&remove_inode), 1);
+	if(ret < 0)
+		return ret;
+
+	/* The directory and its entry go in one transaction */
+	if(block_txn_begin(TXN_REMOVE) < 0)
+		return FSE_ERROR;
+
 	/* Remove directory */
-	free_bitmap_entry(remove_inode.direct[0], (unsigned char*)mem_superblock.dbmap);
-	free_bitmap_entry(remove_inum, (unsigned char*)mem_superblock.ibmap);
+	release_block(&remove_inode, 0);
+	inode_free(remove_inum);
 
 	/* Update superblock */
-	mem_superblock.d_super.ndata_blks--;
-	mem_superblock.d_super.ninodes--;
 	write_superblock();
-	write_bitmap();
 
 	/* ----- Clean up in current working directory ----- */
 	
@@ -759,15 +1937,16 @@ int fs_rmdir(char *dirname) {
 	read_inode(&cur_inode, current_running->cwd);
 
 	/* Remove directory entry from current working directory */
-	remove_dirent(&cur_inode, dirname);
+	remove_dirent(&cur_inode, current_running->cwd, dirname);
 
 	/* Write updated current working inode */
 	write_inode(&cur_inode, current_running->cwd);
+	fs_txn_end(TXN_REMOVE);
 
 	return 1;
 }
 
-int fs_link(char *linkname, char *filename) {
+static int fs_link_locked(char *linkname, char *filename) {
 	int ret;
 
 	/* Check if filename is valid */
@@ -790,13 +1969,26 @@ int fs_link(char *linkname, char *filename) {
 	struct disk_inode dir_inode;
 	read_inode(&dir_inode, current_running->cwd);
 
+	/* The entry and the link count are one transaction */
+	if(hdir_make_room(&dir_inode, current_running->cwd, filename) < 0)
+		return FSE_FULL;
+	if(block_txn_begin(TXN_CREATE) < 0)
+		return FSE_ERROR;
+
 	/* Check if current working direcotry need a new block for the new directory entry */
 	ret = acquire_datablock(&dir_inode, current_running->cwd, sizeof(struct dirent));
-	if(ret < 0)
+	if(ret < 0) {
+		fs_txn_end(TXN_CREATE);
 		return ret;
+	}
 
 	/* Write link/copy entry into current working direcotry */
-	write_dirent(&dir_inode, file_inum, filename);
+	ret = write_dirent(&dir_inode, current_running->cwd, file_inum, filename);
+	if(ret < 0) {
+		write_inode(&dir_inode, current_running->cwd);
+		fs_txn_end(TXN_CREATE);
+		return FSE_FULL;
+	}
 
 	/* Increment number of links */
 	file_inode.nlinks++;
@@ -804,11 +1996,12 @@ int fs_link(char *linkname, char *filename) {
 	/* Write updated directory inode and file inode */
 	write_inode(&dir_inode, current_running->cwd);
 	write_inode(&file_inode, file_inum);
+	fs_txn_end(TXN_CREATE);
 
 	return 1;
 }
 
-int fs_unlink(char *linkname) {
+static int fs_unlink_locked(char *linkname) {
 	int ret;
 
 	/* Check if filename is valid */
@@ -821,37 +2014,56 @@ int fs_unlink(char *linkname) {
 	if(file_inum < 0)
 		return FSE_NOTEXIST;
 
+	/* Flush writes still buffered for the file, so its size is final */
+	for(int i = 0; i < WBUF_ENTRIES; i++)
+		if(wbufs[i].idx != FREE_BLK && mem_inode_table[wbufs[i].idx].inode_num == file_inum)
+			wbuf_flush(&wbufs[i]);
+
 	/* Check if filename is of type file */
 	struct disk_inode file_inode;
 	read_inode(&file_inode, file_inum);
 	if(file_inode.type != INTYPE_FILE)
 		return FSE_INVALIDNAME;
 
+	/* The blocks of a mapped file stay, fs_map_write writes them without fs_lock */
+	short *chain = &inode_hash[file_inum & (INODE_HASH_BUCKETS - 1)];
+	for(int i = *chain; i != FREE_BLK && file_inode.nlinks == 0; i = mem_inode_table[i].hnext)
+		if(mem_inode_table[i].inode_num == file_inum && mem_inode_table[i].map_count > 0)
+			return FSE_FILEOPEN;
+
+	/* The last entry removes the file. Its blocks past the first
+	 * FREE_CHUNK go first, while the entry still refers to it. */
+	if(file_inode.nlinks == 0) {
+		ret = truncate_blocks(&file_inode, file_inum, file_inode.size / BLOCK_SIZE + 1, FREE_CHUNK);
+		if(ret < 0)
+			return ret;
+	}
+
+	/* The entry, and the rest of the file, go in one transaction */
+	if(block_txn_begin(TXN_REMOVE) < 0)
+		return FSE_ERROR;
+
 	/* Get current working directory */
 	struct disk_inode dir_inode;
 	read_inode(&dir_inode, current_running->cwd);
 
 	/* Remove file entry from current working direcotry */
-	remove_dirent(&dir_inode, linkname);
+	remove_dirent(&dir_inode, current_running->cwd, linkname);
 
 	file_inode.nlinks--;
 	/* Check if file can be removed. */
 	if(file_inode.nlinks < 0) {
 
-		/* Remove datablocks */
-		for(int i = 0; i < INODE_NDIRECT; i++)
-			if(file_inode.direct[i] != FREE_BLK) {
-				free_bitmap_entry(file_inode.direct[i], (unsigned char*)mem_superblock.dbmap);
-				mem_superblock.d_super.ndata_blks--;
-			}
+		/* Remove datablocks, last block first so indirect blocks are freed as they empty */
+		for(int i = file_inode.size / BLOCK_SIZE; i >= 0; i--)
+			release_block(&file_inode, i);
 
 		/* Remove inode */
-		free_bitmap_entry(file_inum, (unsigned char*)mem_superblock.ibmap);
-		mem_superblock.d_super.ninodes--;
+		rsv_drop(file_inum);
+		inode_free(file_inum);
 
 		/* Update superblock */
 		write_superblock();
-		write_bitmap();
 	} else {
 		/* Write updated file inode if it is not removed */
 		write_inode(&file_inode, file_inum);
@@ -859,190 +2071,1456 @@ int fs_unlink(char *linkname) {
 
 	/* Write updated directory inode */
 	write_inode(&dir_inode, current_running->cwd);
+	fs_txn_end(TXN_REMOVE);
 
 	return 1;
 }
 
-int fs_stat(int fd, char *buffer) {
+/*
+ * Read as many directory entries as fit in size bytes of buffer from
+ * the directory open as fd. Returns the number of bytes filled in
+ * (whole struct dirents), 0 at the end of the directory.
+ */
+static int fs_getdents_locked(int fd, char *buffer, int size) {
 
-	/* Index into global memory inode table */
-	int idx = current_running->filedes[fd].idx;
+	/* Open file of the descriptor, and its index into global memory inode table */
+	struct open_file *file = fd_file(fd);
+	if(file == NULL)
+		return FSE_INVALIDHANDLE;
+	int idx = file->idx;
+	struct mem_inode *mem_inode = &mem_inode_table[idx];
 
 	/* Check if caller have permission to read */
-	int mode_bit = current_running->filedes[fd].mode & MODE_RDONLY;
+	int mode_bit = file->mode & MODE_RDONLY;
 	if(mode_bit != MODE_RDONLY)
+		return FSE_INVALIDMODE;
+	if(mem_inode->d_inode.type != INTYPE_DIR)
+		return FSE_DIRISFILE;
+
+	int count = size / sizeof(struct dirent);
+
+	/* Hashed directories skip the free slots in every bucket */
+	if(is_hashed(&mem_inode->d_inode))
+		return hdir_read(&mem_inode->d_inode, &file->pos, (struct dirent*)buffer, count) * sizeof(struct dirent);
+
+	/* Entries left in a linear directory */
+	int left = (mem_inode->d_inode.size - file->pos) / sizeof(struct dirent);
+	if(count > left)
+		count = left;
+	if(count <= 0)
 		return 0;
 
-	/* Copy meta data into given buffer */
-	bcopy((char*)&mem_inode_table[idx].d_inode.type, &buffer[0], (int)sizeof(mem_inode_table[idx].d_inode.type));		// Type	
-	bcopy((char*)&mem_inode_table[idx].d_inode.nlinks, &buffer[1], (int)sizeof(mem_inode_table[idx].d_inode.nlinks));	// Links
-	bcopy((char*)&mem_inode_table[idx].d_inode.size, &buffer[2], (int)sizeof(mem_inode_table[idx].d_inode.size));		// Size
+	int ret = read_data(&mem_inode->d_inode, file->pos, buffer, count * sizeof(struct dirent));
+	if(ret < 0)
+		return ret;
+	file->pos += count * sizeof(struct dirent);
 
-	return 1;
+	return count * sizeof(struct dirent);
 }
 
 /*
- * Helper functions for the system calls
- */
-
-/*
- * get_free_entry:
- *
- * Search the given bitmap for the first zero bit.  If an entry is
- * found it is set to one and the entry number is returned.  Returns
- * -1 if all entrys in the bitmap are set.
+ * fsck_scan:
+ * One pass over the inode table of every group, IO_BLOCKS blocks at
+ * a time. Every inode in use has its blocks marked. With count set,
+ * its type and nlinks are kept and the entries of directories are
+ * counted too.
  */
-static int get_free_entry(unsigned char *bitmap) {
-	int i;
-
-	/* Seach for a free entry */
-	for (i = 0; i < BITMAP_ENTRIES / 8; i++) {
-		if (bitmap[i] == 0xff) /* All taken */
-			continue;
-		if ((bitmap[i] & 0x80) == 0) { /* msb */
-			bitmap[i] |= 0x80;
-			return i * 8;
-		}
-		else if ((bitmap[i] & 0x40) == 0) {
-			bitmap[i] |= 0x40;
-			return i * 8 + 1;
-		}
-		else if ((bitmap[i] & 0x20) == 0) {
-			bitmap[i] |= 0x20;
-			return i * 8 + 2;
-		}
-		else if ((bitmap[i] & 0x10) == 0) {
-			bitmap[i] |= 0x10;
-			return i * 8 + 3;
-		}
-		else if ((bitmap[i] & 0x08) == 0) {
-			bitmap[i] |= 0x08;
-			return i * 8 + 4;
-		}
-		else if ((bitmap[i] & 0x04) == 0) {
-			bitmap[i] |= 0x04;
-			return i * 8 + 5;
-		}
-		else if ((bitmap[i] & 0x02) == 0) {
-			bitmap[i] |= 0x02;
-			return i * 8 + 6;
-		}
-		else if ((bitmap[i] & 0x01) == 0) { /* lsb */
-			bitmap[i] |= 0x01;
-			return i * 8 + 7;
+static int fsck_scan(int count) {
+	struct disk_superblock *sb = &mem_superblock.d_super;
+	int itable_blocks = sb->group_inodes / INODES_PER_BLK;
+
+	for(int g = 0; g < sb->ngroups; g++) {
+		if(block_read((os_size + 2) + mem_superblock.gdt[g].inode_bmap, bmap_buf) < 0)
+			return FSE_ERROR;
+
+		for(int blk = 0; blk < itable_blocks; blk += IO_BLOCKS) {
+			int chunk = (itable_blocks - blk < IO_BLOCKS) ? itable_blocks - blk : IO_BLOCKS;
+
+			/* Skip blocks without inodes in use */
+			int used = 0;
+			for(int i = 0; i < chunk * (int)INODES_PER_BLK && !used; i++)
+				used = test_bit(bmap_buf, blk * INODES_PER_BLK + i);
+			if(!used)
+				continue;
+
+			if(block_read_multi((os_size + 2) + mem_superblock.gdt[g].inode_table + blk, chunk, io_buf.data) < 0)
+				return FSE_ERROR;
+
+			for(int i = 0; i < chunk * (int)INODES_PER_BLK; i++) {
+				struct disk_inode *d = &io_buf.inode[i];
+				if(!test_bit(bmap_buf, blk * INODES_PER_BLK + i) || (d->type != INTYPE_FILE && d->type != INTYPE_DIR))
+					continue;
+
+				fsck_walk(d, 1);
+				if(count) {
+					struct fsck_inode *fi = &fsck_inodes[g * sb->group_inodes + blk * INODES_PER_BLK + i];
+					fi->type = d->type;
+					fi->nlinks = d->nlinks;
+					if(d->type == INTYPE_DIR)
+						fsck_scan_dir(d);
+				}
+			}
 		}
 	}
-	return -1;
+	return 0;
 }
 
 /*
- * free_bitmap_entry:
- *
- * Free a bitmap entry, if the entry is not found -1 is returned, otherwise zero.
- * Note that this function does not check if the bitmap entry was used (freeing
- * an unused entry has no effect).
+ * fsck_inodes_repair:
+ * Make the inodes agree with the directory entries counted by
+ * fsck_scan: nlinks of files is set to match, files without entries
+ * are removed (their blocks unmarked), and the inode bitmaps are
+ * rebuilt (referenced inodes marked free get their blocks marked).
+ * Adds the inodes in use to *ninodes, returns the number of repairs.
  */
-static int free_bitmap_entry(int entry, unsigned char *bitmap) {
-	unsigned char *bme;
-
-	if (entry >= BITMAP_ENTRIES)
-		return -1;
-
-	bme = &bitmap[entry / 8];
+static int fsck_inodes_repair(int *ninodes) {
+	struct disk_superblock *sb = &mem_superblock.d_super;
+	struct disk_inode disk_inode;
+	int fixed = 0;
+
+	for(int g = 0; g < sb->ngroups; g++) {
+		struct group_desc *gd = &mem_superblock.gdt[g];
+		if(block_read((os_size + 2) + gd->inode_bmap, bmap_buf) < 0)
+			return FSE_ERROR;
+
+		int changed = 0;
+		for(int i = 0; i < sb->group_inodes; i++) {
+			inode_t inum = g * sb->group_inodes + i;
+			struct fsck_inode *fi = &fsck_inodes[inum];
+			int used = test_bit(bmap_buf, i);
+
+			if(used && fi->type == 0) {
+				/* Garbage inode */
+				clear_bit(bmap_buf, i);
+				changed++;
+				continue;
+			}
+			if(!used && fi->refs > 0) {
+				/* Referenced inode marked free, if it holds a file or directory */
+				if(read_inode(&disk_inode, inum) < 0)
+					return FSE_ERROR;
+				if(disk_inode.type != INTYPE_FILE && disk_inode.type != INTYPE_DIR)
+					continue;
+				fsck_walk(&disk_inode, 1);
+				fi->type = disk_inode.type;
+				fi->nlinks = disk_inode.nlinks;
+				set_bit(bmap_buf, i);
+				changed++;
+			}
+			if(!test_bit(bmap_buf, i) || fi->type != INTYPE_FILE)
+				continue;
+
+			if(fi->refs == 0) {
+				/* File no directory refers to */
+				if(read_inode(&disk_inode, inum) < 0)
+					return FSE_ERROR;
+				fsck_walk(&disk_inode, 0);
+				write_inode((struct disk_inode *)zero_inode, inum);
+				clear_bit(bmap_buf, i);
+				changed++;
+			} else if(fi->nlinks != fi->refs - 1) {
+				/* A file starts out with nlinks 0 for its first entry */
+				if(read_inode(&disk_inode, inum) < 0)
+					return FSE_ERROR;
+				disk_inode.nlinks = fi->refs - 1;
+				write_inode(&disk_inode, inum);
+				fixed++;
+			}
+		}
 
-	switch (entry % 8) {
-	case 0:
-		*bme &= ~0x80;
-		break;
-	case 1:
-		*bme &= ~0x40;
-		break;
-	case 2:
-		*bme &= ~0x20;
-		break;
-	case 3:
-		*bme &= ~0x10;
-		break;
-	case 4:
-		*bme &= ~0x08;
-		break;
-	case 5:
-		*bme &= ~0x04;
-		break;
-	case 6:
-		*bme &= ~0x02;
-		break;
-	case 7:
-		*bme &= ~0x01;
-		break;
+		int free_inodes = sb->group_inodes - count_bits(bmap_buf, sb->group_inodes);
+		if(changed > 0)
+			block_write((os_size + 2) + gd->inode_bmap, bmap_buf);
+		if(changed > 0 || gd->free_inodes != free_inodes) {
+			gd->free_inodes = free_inodes;
+			write_group(g);
+		}
+		fixed += changed;
+		*ninodes += sb->group_inodes - free_inodes;
 	}
+	icache_flush();
 
-	return 0;
+	return fixed;
 }
 
 /*
- * ino2blk:
- * Returns the filesystem block (block number relative to the super
- * block) corresponding to the inode number passed.
+ * Start rebuilding the block bitmaps of n groups from group first,
+ * with the bitmaps and inode table of every group marked.
  */
-static blknum_t ino2blk(inode_t ino) {
-	int blk_num = (ino * sizeof(struct disk_inode)) / (BLOCK_SIZE + 1);
-	return (blknum_t)blk_num;
+static void fsck_blocks_begin(int first, int n) {
+	fsck_first = group_start(first);
+	fsck_span = group_start(first + n - 1) + group_size(first + n - 1) - fsck_first;
+
+	bzero((char *)fsck_bmap, n * BLOCK_SIZE);
+	for(int g = 0; g < n; g++)
+		for(int i = 0; i < 2 + mem_superblock.d_super.group_inodes / (int)INODES_PER_BLK; i++)
+			set_bit(&fsck_bmap[g * BLOCK_SIZE], i);
 }
 
 /*
- * idx2blk:
- * Returns the filesystem block (block number relative to the super
- * block) corresponding to the data block index passed.
+ * Write the block bitmaps rebuilt for n groups from group first.
+ * Adds the blocks in use to *ndata_blks, returns the number of
+ * repairs.
  */
-static blknum_t idx2blk(int index) {
-	return (blknum_t)(index + (os_size + 2));
+static int fsck_blocks_repair(int first, int n, int *ndata_blks) {
+	int fixed = 0;
+
+	for(int g = first; g < first + n; g++) {
+		struct group_desc *gd = &mem_superblock.gdt[g];
+		unsigned char *bmap = &fsck_bmap[(g - first) * BLOCK_SIZE];
+		int span = group_size(g);
+
+		if(block_read((os_size + 2) + gd->block_bmap, bmap_buf) < 0)
+			return FSE_ERROR;
+
+		int changed = 0;
+		for(int i = 0; i < span; i++)
+			if(test_bit(bmap_buf, i) != test_bit(bmap, i))
+				changed++;
+
+		int free_blocks = span - count_bits(bmap, span);
+		if(changed > 0)
+			block_write((os_size + 2) + gd->block_bmap, bmap);
+		if(changed > 0 || gd->free_blocks != free_blocks) {
+			gd->free_blocks = free_blocks;
+			write_group(g);
+		}
+		fixed += changed;
+		*ndata_blks += span - free_blocks;
+	}
+
+	return fixed;
 }
 
 /*
- * path2inode:
- * Parses a file name and returns the corresponding inode number. If
- * the file cannot be found, -1 is returned.
+ * Check the file system and repair what can be repaired. One pass
+ * over the inode tables counts the directory entries referring to
+ * every inode and marks the blocks every inode in use refers to.
+ * Then the inodes are repaired: nlinks of files is set to match the
+ * entries, files without entries are removed, and the inode bitmaps
+ * are rebuilt. The block bitmaps are rebuilt from the marks, and the
+ * free counts of the groups and the superblock counts follow from the
+ * bitmaps. The marks are kept for as many groups as memory allows,
+ * the blocks of any other groups are marked by another pass each,
+ * made after the inodes are repaired. Returns the number of repairs
+ * made.
  */
-static inode_t path2inode(char *path) {
+static int fs_fsck_locked(void) {
+	struct disk_superblock *sb = &mem_superblock.d_super;
+	int ninodes = 0;
+	int ndata_blks = 0;
+	int fixed = 0;
+
+	/* Check what is on disk */
+	fs_flush();
+	icache_init();
+
+	fsck_ninodes = sb->ngroups * sb->group_inodes;
+	fsck_inodes = kzalloc(fsck_ninodes * sizeof(struct fsck_inode));
+	if(fsck_inodes == NULL)
+		return FSE_ERROR;
+
+	/* A block bitmap for as many groups as there is memory for */
+	int batch = sb->ngroups;
+	while((fsck_bmap = kzalloc(batch * BLOCK_SIZE)) == NULL && batch > 1)
+		batch /= 2;
+	if(fsck_bmap == NULL) {
+		kfree(fsck_inodes);
+		return FSE_ERROR;
+	}
 
-	/* Copy path */
-	char copy[SIZEX];
-	strcpy(copy, path);
+	int ret;
+	fsck_blocks_begin(0, batch);
+	if((ret = fsck_scan(1)) < 0 || (ret = fsck_inodes_repair(&ninodes)) < 0)
+		goto out;
+	fixed += ret;
+
+	for(int g = 0; g < sb->ngroups; g += batch) {
+		int n = (sb->ngroups - g < batch) ? sb->ngroups - g : batch;
+		if(g > 0) {
+			fsck_blocks_begin(g, n);
+			if((ret = fsck_scan(0)) < 0)
+				goto out;
+		}
+		if((ret = fsck_blocks_repair(g, n, &ndata_blks)) < 0)
+			goto out;
+		fixed += ret;
+	}
 
-	/* Parse path */
-	char *parsed[SIZEX];
-	int num = parse_path(copy, parsed);
+	if(ninodes != sb->ninodes || ndata_blks != sb->ndata_blks)
+		fixed++;
+	sb->ninodes = ninodes;
+	sb->ndata_blks = ndata_blks;
 
-	int i = 0;
-	struct dirent dirent;
-	/* Check if absolute path, so it skips search for "/" */
-	if(path[0] == '/') {
-		i++;
-		dirent.inode = 0;
-	} else
-		dirent.inode = current_running->cwd;
+	/* Cached lookups and reservations may refer to what was removed */
+	dcache_init();
+	rsv_init();
 
-	struct disk_inode disk_inode;
-	/* Iterate through each name in path */
-	for(; i < num; i++) {
+	write_superblock();
+	fs_flush();
+	ret = fixed;
 
-		int offset = 0;
-		read_inode(&disk_inode, dirent.inode);
+out:
+	kfree(fsck_bmap);
+	kfree(fsck_inodes);
+	fsck_bmap = NULL;
+	fsck_inodes = NULL;
 
-		/* Iterate through each entry in current inode */
-		while (1) {
+	return ret;
+}
 
-			/* Get directory entry */
-			helper_read_write(block_read_part, &disk_inode, offset, sizeof(struct dirent), (char*)&dirent);
-			
-			if(same_string(dirent.name, parsed[i]))	// If string is same, HIT!
-				break;
-			offset += sizeof(struct dirent);
-			if(offset > disk_inode.size)			// If offset is larger than size, MISS!
-				return FSE_DENOTFOUND;
-		}
-	}
-	
-	return dirent.inode;
+static int fs_stat_locked(int fd, char *buffer) {
+
+	/* Open file of the descriptor, and its index into global memory inode table */
+	struct open_file *file = fd_file(fd);
+	if(file == NULL)
+		return FSE_INVALIDHANDLE;
+	int idx = file->idx;
+
+	/* Check if caller have permission to read */
+	int mode_bit = file->mode & MODE_RDONLY;
+	if(mode_bit != MODE_RDONLY)
+		return 0;
+
+	/* The size includes buffered writes */
+	wbuf_flush(wbuf_find(idx));
+
+	/* Copy meta data into given buffer */
+	bcopy((char*)&mem_inode_table[idx].d_inode.type, &buffer[0], (int)sizeof(mem_inode_table[idx].d_inode.type));		// Type	
+	bcopy((char*)&mem_inode_table[idx].d_inode.nlinks, &buffer[1], (int)sizeof(mem_inode_table[idx].d_inode.nlinks));	// Links
+	bcopy((char*)&mem_inode_table[idx].d_inode.size, &buffer[2], (int)sizeof(mem_inode_table[idx].d_inode.size));		// Size
+
+	return 1;
+}
+
+#ifdef LINUX_SIM
+/*
+ * Count the data blocks of the file or directory open as fd into
+ * *blocks, and return the number of runs of them that are contiguous
+ * on disk. Used by p6fs-dump to show fragmentation.
+ */
+static int fs_extents_locked(int fd, int *blocks) {
+	struct open_file *file = fd_file(fd);
+	if(file == NULL)
+		return FSE_INVALIDHANDLE;
+	struct disk_inode *disk_inode = &mem_inode_table[file->idx].d_inode;
+
+	/* Buffered writes have no blocks yet */
+	wbuf_flush(wbuf_find(file->idx));
+
+	*blocks = 0;
+	if(is_inline(disk_inode) || disk_inode->size == 0)
+		return 0;
+
+	int nblks = (disk_inode->type == INTYPE_DIR) ? dir_blocks(disk_inode) : (disk_inode->size - 1) / BLOCK_SIZE + 1;
+	int extents = 0;
+	blknum_t prev = FREE_BLK;
+	for(int lblk = 0; lblk < nblks; lblk++) {
+		blknum_t blk = bmap(disk_inode, lblk, 0);
+		if(blk == FREE_BLK)
+			continue;
+		if(prev == FREE_BLK || blk != prev + 1)
+			extents++;
+		prev = blk;
+		(*blocks)++;
+	}
+
+	return extents;
+}
+#endif /* LINUX_SIM */
+
+/*
+ * Entry points, each runs its body with fs_lock held.
+ */
+void fs_init(void) {
+	lock_acquire(&fs_lock);
+	fs_init_locked();
+	lock_release(&fs_lock);
+}
+
+int fs_mkfs(int dir_format, int nblocks) {
+	lock_acquire(&fs_lock);
+	int ret = fs_mkfs_locked(dir_format, nblocks);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_open(const char *path, int mode) {
+	lock_acquire(&fs_lock);
+	int ret = fs_open_locked(path, mode);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_close(int fd) {
+	lock_acquire(&fs_lock);
+	int ret = fs_close_locked(fd);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+void fs_exit(void) {
+#ifndef LINUX_SIM
+	/* Pages changed through fs_mmap */
+	memory_unmap_files();
+#endif /* LINUX_SIM */
+
+	lock_acquire(&fs_lock);
+	fs_exit_locked();
+	lock_release(&fs_lock);
+}
+
+int fs_read(int fd, char *buffer, int size) {
+	lock_acquire(&fs_lock);
+	int ret = fs_read_locked(fd, buffer, size);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_write(int fd, char *buffer, int size) {
+	lock_acquire(&fs_lock);
+	int ret = fs_write_locked(fd, buffer, size);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_readv(int fd, struct iovec *iov, int iovcnt) {
+	lock_acquire(&fs_lock);
+	int ret = fs_readv_locked(fd, iov, iovcnt);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_writev(int fd, struct iovec *iov, int iovcnt) {
+	lock_acquire(&fs_lock);
+	int ret = fs_writev_locked(fd, iov, iovcnt);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_mmap(int fd, int offset, int len) {
+	lock_acquire(&fs_lock);
+	int ret = fs_mmap_locked(fd, offset, len);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_lseek(int fd, int offset, int whence) {
+	lock_acquire(&fs_lock);
+	int ret = fs_lseek_locked(fd, offset, whence);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_mkdir(char *dirname) {
+	lock_acquire(&fs_lock);
+	int ret = fs_mkdir_locked(dirname);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_chdir(char *path) {
+	lock_acquire(&fs_lock);
+	int ret = fs_chdir_locked(path);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_rmdir(char *dirname) {
+	lock_acquire(&fs_lock);
+	int ret = fs_rmdir_locked(dirname);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_link(char *linkname, char *filename) {
+	lock_acquire(&fs_lock);
+	int ret = fs_link_locked(linkname, filename);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_unlink(char *linkname) {
+	lock_acquire(&fs_lock);
+	int ret = fs_unlink_locked(linkname);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_getdents(int fd, char *buffer, int size) {
+	lock_acquire(&fs_lock);
+	int ret = fs_getdents_locked(fd, buffer, size);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_fsck(void) {
+	lock_acquire(&fs_lock);
+	int ret = fs_fsck_locked();
+	lock_release(&fs_lock);
+	return ret;
+}
+
+int fs_stat(int fd, char *buffer) {
+	lock_acquire(&fs_lock);
+	int ret = fs_stat_locked(fd, buffer);
+	lock_release(&fs_lock);
+	return ret;
+}
+
+#ifdef LINUX_SIM
+int fs_extents(int fd, int *blocks) {
+	lock_acquire(&fs_lock);
+	int ret = fs_extents_locked(fd, blocks);
+	lock_release(&fs_lock);
+	return ret;
+}
+#endif /* LINUX_SIM */
+
+/*
+ * Helper functions for the system calls
+ */
+
+/* Mask for an entry within its byte, entry 0 is the msb of the first byte */
+#define BIT_MASK(entry) (0x80 >> ((entry) % 8))
+
+static int test_bit(unsigned char *bitmap, int entry) {
+	return (bitmap[entry / 8] & BIT_MASK(entry)) != 0;
+}
+
+static void set_bit(unsigned char *bitmap, int entry) {
+	bitmap[entry / 8] |= BIT_MASK(entry);
+}
+
+static void clear_bit(unsigned char *bitmap, int entry) {
+	bitmap[entry / 8] &= ~BIT_MASK(entry);
+}
+
+/* Entries 32 * i to 32 * i + 31 of the bitmap, the first one in the msb */
+static uint32_t bitmap_word(unsigned char *bitmap, int i) {
+	unsigned char *b = &bitmap[i * 4];
+	return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+/*
+ * find_zero_from:
+ *
+ * Returns the first entry at or after from that is zero in bitmap,
+ * and in mask if mask is given. The bitmaps are scanned a word at a
+ * time. Returns -1 if there is no such entry below nbits.
+ */
+static int find_zero_from(unsigned char *bitmap, unsigned char *mask, int nbits, int from) {
+	for (int i = from / 32; i * 32 < nbits; i++) {
+		uint32_t used = bitmap_word(bitmap, i);
+		if (mask != NULL)
+			used |= bitmap_word(mask, i);
+
+		/* Ignore entries before from and entries past the end */
+		if (i == from / 32)
+			used |= ~(0xffffffffu >> (from % 32));
+		if (nbits - i * 32 < 32)
+			used |= 0xffffffffu >> (nbits - i * 32);
+
+		if (used != 0xffffffffu)
+			return i * 32 + __builtin_clz(~used);
+	}
+	return -1;
+}
+
+/* Like find_zero_from, but wraps around to the start of the bitmap */
+static int find_zero_bit(unsigned char *bitmap, unsigned char *mask, int nbits, int goal) {
+	int entry = find_zero_from(bitmap, mask, nbits, goal);
+	if (entry < 0 && goal > 0)
+		entry = find_zero_from(bitmap, mask, nbits, 0);
+	return entry;
+}
+
+/*
+ * find_zero_run:
+ *
+ * Returns the first entry at or after goal (wrapping around) that
+ * starts a run of len entries which are zero in both bitmap and mask.
+ * Returns -1 if there is no such run.
+ */
+static int find_zero_run(unsigned char *bitmap, unsigned char *mask, int nbits, int goal, int len) {
+	int from = goal;
+
+	for (int lap = 0; lap < 2; lap++) {
+		int entry = find_zero_from(bitmap, mask, nbits, from);
+		while (entry >= 0 && entry + len <= nbits && (lap == 0 || entry < goal)) {
+			int n = 1;
+			while (n < len && !test_bit(bitmap, entry + n) && !test_bit(mask, entry + n))
+				n++;
+			if (n == len)
+				return entry;
+			entry = find_zero_from(bitmap, mask, nbits, entry + n);
+		}
+		from = 0;
+	}
+	return -1;
+}
+
+/*
+ * get_free_entry:
+ *
+ * Search the first nbits entries of the given bitmap for the first
+ * zero bit.  If an entry is found it is set to one and the entry
+ * number is returned.  Returns -1 if all entrys in the bitmap are set.
+ */
+static int get_free_entry(unsigned char *bitmap, int nbits) {
+	int entry = find_zero_from(bitmap, NULL, nbits, 0);
+	if (entry >= 0)
+		set_bit(bitmap, entry);
+	return entry;
+}
+
+/*
+ * free_bitmap_entry:
+ *
+ * Free a bitmap entry, if the entry is not found -1 is returned, otherwise zero.
+ * Note that this function does not check if the bitmap entry was used (freeing
+ * an unused entry has no effect).
+ */
+static int free_bitmap_entry(int entry, unsigned char *bitmap, int nbits) {
+	if (entry < 0 || entry >= nbits)
+		return -1;
+
+	clear_bit(bitmap, entry);
+	return 0;
+}
+
+/*
+ * bitmap_update:
+ *
+ * Set (set true) or clear an entry of the bitmap in block bmap_blk,
+ * through the buffer cache. Returns the previous value of the entry,
+ * or -1 on a read error.
+ */
+static int bitmap_update(blknum_t bmap_blk, int entry, int set) {
+	unsigned char byte;
+
+	if (block_read_part((os_size + 2) + bmap_blk, entry / 8, 1, &byte) < 0)
+		return -1;
+
+	int old = (byte & BIT_MASK(entry)) != 0;
+	if (old != (set != 0)) {
+		byte ^= BIT_MASK(entry);
+		block_modify((os_size + 2) + bmap_blk, entry / 8, 1, &byte);
+	}
+	return old;
+}
+
+/* Read the bitmap block bmap_blk into bmap_buf */
+static int load_bitmap(blknum_t bmap_blk) {
+	return block_read((os_size + 2) + bmap_blk, bmap_buf);
+}
+
+/*
+ * inode_alloc:
+ *
+ * Take a free inode in the group of inode near, or if that group is
+ * full in the next group with a free inode. Only the inode bitmap of
+ * that group is searched. Returns the inode number, or -1 if every
+ * inode is in use. The caller must write the superblock.
+ */
+static inode_t inode_alloc(inode_t near) {
+	struct disk_superblock *sb = &mem_superblock.d_super;
+	int first = (near >= 0 && near < sb->ngroups * sb->group_inodes) ? near / sb->group_inodes : 0;
+
+	for (int i = 0; i < sb->ngroups; i++) {
+		int g = (first + i) % sb->ngroups;
+		struct group_desc *gd = &mem_superblock.gdt[g];
+
+		if (gd->free_inodes == 0 || load_bitmap(gd->inode_bmap) < 0)
+			continue;
+		int entry = find_zero_from(bmap_buf, NULL, sb->group_inodes, 0);
+		if (entry < 0 || bitmap_update(gd->inode_bmap, entry, 1) != 0)
+			continue;
+
+		gd->free_inodes--;
+		write_group(g);
+		sb->ninodes++;
+		return g * sb->group_inodes + entry;
+	}
+	return -1;
+}
+
+/* Give an inode back to the bitmap of its group. The caller must write the superblock. */
+static void inode_free(inode_t inode) {
+	struct disk_superblock *sb = &mem_superblock.d_super;
+	if (inode < 0 || inode >= sb->ngroups * sb->group_inodes)
+		return;
+
+	int g = inode / sb->group_inodes;
+	if (bitmap_update(mem_superblock.gdt[g].inode_bmap, inode % sb->group_inodes, 0) == 1) {
+		mem_superblock.gdt[g].free_inodes++;
+		write_group(g);
+		sb->ninodes--;
+	}
+}
+
+/* Drop a reservation window, its unused blocks are free for anyone again */
+static void rsv_release(struct rsv_window *w) {
+	w->inode = FREE_BLK;
+}
+
+/* Drop the reservation window of an inode, if it has one */
+static void rsv_drop(inode_t inode) {
+	for (int i = 0; i < RSV_WINDOWS; i++)
+		if (rsv_table[i].inode == inode)
+			rsv_release(&rsv_table[i]);
+}
+
+static void rsv_init(void) {
+	for (int i = 0; i < RSV_WINDOWS; i++)
+		rsv_table[i].inode = FREE_BLK;
+	rsv_victim = 0;
+}
+
+/* Fill rsv_mask with the unused blocks of the windows in a group */
+static unsigned char *rsv_group_mask(int group) {
+	blknum_t start = group_start(group);
+
+	bzero((char *)rsv_mask, sizeof(rsv_mask));
+	for (int i = 0; i < RSV_WINDOWS; i++) {
+		struct rsv_window *w = &rsv_table[i];
+		if (w->inode == FREE_BLK || block_group(w->next) != group)
+			continue;
+		for (int b = w->next; b < w->end; b++)
+			set_bit(rsv_mask, b - start);
+	}
+	return rsv_mask;
+}
+
+/* Take entry of the block bitmap of a group, returns the block number */
+static int take_block(int group, int entry) {
+	if (bitmap_update(mem_superblock.gdt[group].block_bmap, entry, 1) != 0)
+		return -1;
+	mem_superblock.gdt[group].free_blocks--;
+	write_group(group);
+	return group_start(group) + entry;
+}
+
+/*
+ * get_data_block:
+ *
+ * Take a free block, as close after goal as possible. The group of
+ * goal is searched first, then the following groups; groups without
+ * enough free blocks are skipped by their free count, so only the
+ * bitmaps of groups with room are read. A file that is growing
+ * (alloc_inode) first gets a reservation window of RSV_BLOCKS free
+ * blocks, and the following blocks for that file come from the
+ * window. Other allocations skip blocks reserved in windows as long
+ * as there are other free blocks, so files written at the same time
+ * stay contiguous.
+ */
+static int get_data_block(int goal) {
+	struct disk_superblock *sb = &mem_superblock.d_super;
+	struct rsv_window *w = NULL;
+	int entry;
+
+	/* Continue in the window of the growing file */
+	for (int i = 0; i < RSV_WINDOWS && alloc_inode != FREE_BLK; i++)
+		if (rsv_table[i].inode == alloc_inode)
+			w = &rsv_table[i];
+	if (w != NULL) {
+		int g = block_group(w->next);
+		if (load_bitmap(mem_superblock.gdt[g].block_bmap) < 0)
+			return -1;
+		while (w->next < w->end && test_bit(bmap_buf, w->next - group_start(g)))
+			w->next++;
+		if (w->next < w->end) {
+			entry = w->next++;
+			return take_block(g, entry - group_start(g));
+		}
+		rsv_release(w);
+	}
+
+	if (goal < sb->first_group || goal >= sb->nblocks)
+		goal = sb->first_group;
+	int first = block_group(goal);
+
+	/* Open a new window for the growing file */
+	for (int i = 0; i < sb->ngroups && alloc_inode != FREE_BLK; i++) {
+		int g = (first + i) % sb->ngroups;
+		int from = (g == first) ? goal - group_start(g) : 0;
+
+		if (mem_superblock.gdt[g].free_blocks < RSV_BLOCKS || load_bitmap(mem_superblock.gdt[g].block_bmap) < 0)
+			continue;
+		entry = find_zero_run(bmap_buf, rsv_group_mask(g), group_size(g), from, RSV_BLOCKS);
+		if (entry < 0)
+			continue;
+
+		w = &rsv_table[rsv_victim];
+		rsv_victim = (rsv_victim + 1) % RSV_WINDOWS;
+		w->inode = alloc_inode;
+		w->next = group_start(g) + entry + 1;
+		w->end = group_start(g) + entry + RSV_BLOCKS;
+		return take_block(g, entry);
+	}
+
+	/* Any unreserved free block, and as a last resort a reserved one */
+	for (int reserved = 0; reserved < 2; reserved++) {
+		for (int i = 0; i < sb->ngroups; i++) {
+			int g = (first + i) % sb->ngroups;
+			int from = (g == first) ? goal - group_start(g) : 0;
+
+			if (mem_superblock.gdt[g].free_blocks == 0 || load_bitmap(mem_superblock.gdt[g].block_bmap) < 0)
+				continue;
+			entry = find_zero_bit(bmap_buf, reserved ? NULL : rsv_group_mask(g), group_size(g), from);
+			if (entry >= 0)
+				return take_block(g, entry);
+		}
+	}
+	return -1;
+}
+
+/*
+ * ino2blk:
+ * Returns the filesystem block (block number relative to the super
+ * block) corresponding to the inode number passed.
+ */
+static blknum_t ino2blk(inode_t ino) {
+	int blk_num = (ino * sizeof(struct disk_inode)) / (BLOCK_SIZE + 1);
+	return (blknum_t)blk_num;
+}
+
+/*
+ * idx2blk:
+ * Returns the filesystem block (block number relative to the super
+ * block) corresponding to the data block index passed.
+ */
+static blknum_t idx2blk(int index) {
+	return (blknum_t)(index + (os_size + 2));
+}
+
+/*
+ * alloc_block:
+ * Take a free data block from the bitmaps, close after goal, and
+ * initialize it with the BLOCK_SIZE bytes in fill. Returns the block
+ * number, or FREE_BLK if the disk is full. The caller must write the
+ * superblock.
+ */
+static blknum_t alloc_block(char *fill, int goal) {
+	int entry = get_data_block(goal);
+	if(entry < 0)
+		return FREE_BLK;
+
+	block_write((os_size + 2) + entry, fill);
+	mem_superblock.d_super.ndata_blks++;
+
+	return (blknum_t)entry;
+}
+
+/*
+ * indirect_lookup:
+ * Returns entry idx of the indirect block *ind. If alloc is set, a
+ * missing indirect block (*ind is updated) or missing entry is
+ * acquired close after goal; new entries are initialized with fill.
+ */
+static blknum_t indirect_lookup(blknum_t *ind, int idx, int alloc, char *fill, int goal) {
+	blknum_t blk;
+
+	if(*ind == FREE_BLK) {
+		if(!alloc)
+			return FREE_BLK;
+		*ind = alloc_block((char *)free_ind_block, goal);
+		if(*ind == FREE_BLK)
+			return FREE_BLK;
+	}
+
+	if(block_read_part((os_size + 2) + *ind, idx * sizeof(blknum_t), sizeof(blknum_t), &blk) < 0)
+		return FREE_BLK;
+
+	if(blk == FREE_BLK && alloc) {
+		blk = alloc_block(fill, (*ind) + 1);
+		if(blk != FREE_BLK)
+			block_modify((os_size + 2) + *ind, idx * sizeof(blknum_t), sizeof(blknum_t), &blk);
+	}
+
+	return blk;
+}
+
+/*
+ * bmap:
+ * Returns the filesystem block holding logical block lblk of the
+ * inode, or FREE_BLK if there is none. If alloc is set, missing data
+ * and indirect blocks are acquired on the way, placed right after the
+ * previous block of the file when possible.
+ */
+static blknum_t bmap(struct disk_inode *disk_inode, int lblk, int alloc) {
+	int goal = 0;
+
+	/* Inline data has no blocks, acquire_datablock moves it out first */
+	if(is_inline(disk_inode))
+		return FREE_BLK;
+
+	/* Aim for the block following the previous block of the file */
+	if(alloc && lblk > 0) {
+		blknum_t prev = bmap(disk_inode, lblk - 1, 0);
+		if(prev != FREE_BLK)
+			goal = prev + 1;
+	}
+
+	/* Direct blocks */
+	if(lblk < INODE_NDIRECT) {
+		if(disk_inode->direct[lblk] == FREE_BLK && alloc)
+			disk_inode->direct[lblk] = alloc_block(zero_block, goal);
+		return disk_inode->direct[lblk];
+	}
+
+	/* Single indirect block */
+	lblk -= INODE_NDIRECT;
+	if(lblk < INODE_NINDIRECT)
+		return indirect_lookup(&disk_inode->indirect, lblk, alloc, zero_block, goal);
+
+	/* Double indirect block */
+	lblk -= INODE_NINDIRECT;
+	if(lblk >= INODE_NINDIRECT * INODE_NINDIRECT)
+		return FREE_BLK;
+
+	blknum_t ind = indirect_lookup(&disk_inode->dindirect, lblk / INODE_NINDIRECT, alloc, (char *)free_ind_block, goal);
+	if(ind == FREE_BLK)
+		return FREE_BLK;
+	return indirect_lookup(&ind, lblk % INODE_NINDIRECT, alloc, zero_block, goal);
+}
+
+/* Give a block back to the bitmap of its group */
+static void free_block(blknum_t blk) {
+	if(blk < mem_superblock.d_super.first_group || blk >= mem_superblock.d_super.nblocks)
+		return;
+
+	int g = block_group(blk);
+	if(bitmap_update(mem_superblock.gdt[g].block_bmap, blk - group_start(g), 0) == 1) {
+		mem_superblock.gdt[g].free_blocks++;
+		write_group(g);
+		mem_superblock.d_super.ndata_blks--;
+		blocks_freed = 1;
+	}
+}
+
+/*
+ * release_block:
+ * Free logical block lblk of the inode. Files only shrink from the
+ * end, so an indirect block is freed together with its first entry.
+ * The caller must write the inode and superblock.
+ */
+static void release_block(struct disk_inode *disk_inode, int lblk) {
+	blknum_t blk = bmap(disk_inode, lblk, 0);
+	blknum_t free_blk = FREE_BLK;
+
+	if(blk == FREE_BLK)
+		return;
+	free_block(blk);
+
+	/* Direct block */
+	if(lblk < INODE_NDIRECT) {
+		disk_inode->direct[lblk] = FREE_BLK;
+		return;
+	}
+
+	/* Single indirect block */
+	lblk -= INODE_NDIRECT;
+	if(lblk < INODE_NINDIRECT) {
+		block_modify((os_size + 2) + disk_inode->indirect, lblk * sizeof(blknum_t), sizeof(blknum_t), &free_blk);
+		if(lblk == 0) {
+			free_block(disk_inode->indirect);
+			disk_inode->indirect = FREE_BLK;
+		}
+		return;
+	}
+
+	/* Double indirect block */
+	lblk -= INODE_NINDIRECT;
+	blknum_t ind = indirect_lookup(&disk_inode->dindirect, lblk / INODE_NINDIRECT, 0, NULL, 0);
+	block_modify((os_size + 2) + ind, (lblk % INODE_NINDIRECT) * sizeof(blknum_t), sizeof(blknum_t), &free_blk);
+	if(lblk % INODE_NINDIRECT == 0) {
+		free_block(ind);
+		block_modify((os_size + 2) + disk_inode->dindirect, (lblk / INODE_NINDIRECT) * sizeof(blknum_t), sizeof(blknum_t), &free_blk);
+	}
+	if(lblk == 0) {
+		free_block(disk_inode->dindirect);
+		disk_inode->dindirect = FREE_BLK;
+	}
+}
+
+/* Hash of a directory entry key */
+static int dcache_bucket(inode_t dir, char *name) {
+	unsigned int h = dir;
+	while(*name != '\0')
+		h = h * 31 + (unsigned char)*name++;
+	return h & (DCACHE_BUCKETS - 1);
+}
+
+static struct dcache_entry *dcache_find(inode_t dir, char *name) {
+	struct dcache_entry *e;
+	for(e = dcache_hash[dcache_bucket(dir, name)]; e != NULL; e = e->hnext)
+		if(e->dir == dir && same_string(e->name, name))
+			return e;
+	return NULL;
+}
+
+static void dcache_unhash(struct dcache_entry *e) {
+	struct dcache_entry **p = &dcache_hash[dcache_bucket(e->dir, e->name)];
+	while(*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+	e->dir = FREE_BLK;
+}
+
+static void dcache_init(void) {
+	for(int i = 0; i < DCACHE_BUCKETS; i++)
+		dcache_hash[i] = NULL;
+	for(int i = 0; i < DCACHE_ENTRIES; i++)
+		dcache[i].dir = FREE_BLK;
+	dcache_victim = 0;
+	dcache_hits = 0;
+	dcache_misses = 0;
+}
+
+/*
+ * dcache_set:
+ * Record that name in directory dir refers to inode (FSE_DENOTFOUND
+ * if the name does not exist). Names too long to be stored are not
+ * cached.
+ */
+static void dcache_set(inode_t dir, char *name, inode_t inode) {
+	if(strlen(name) >= MAX_FILENAME_LEN)
+		return;
+
+	struct dcache_entry *e = dcache_find(dir, name);
+	if(e == NULL) {
+		e = &dcache[dcache_victim];
+		dcache_victim = (dcache_victim + 1) % DCACHE_ENTRIES;
+		if(e->dir != FREE_BLK)
+			dcache_unhash(e);
+
+		e->dir = dir;
+		strcpy(e->name, name);
+		e->hnext = dcache_hash[dcache_bucket(dir, name)];
+		dcache_hash[dcache_bucket(dir, name)] = e;
+	}
+	e->inode = inode;
+}
+
+/* Drop every entry of directory dir, used when its inode is reused */
+static void dcache_purge(inode_t dir) {
+	for(int i = 0; i < DCACHE_ENTRIES; i++)
+		if(dcache[i].dir == dir)
+			dcache_unhash(&dcache[i]);
+}
+
+/* Number of path components resolved from the cache and from disk */
+void fs_dcache_stat(int *hits, int *misses) {
+	*hits = dcache_hits;
+	*misses = dcache_misses;
+}
+
+/*
+ * dir_lookup:
+ * Returns the inode that name refers to in directory dir, or
+ * FSE_DENOTFOUND. The directory is only read on a cache miss.
+ */
+static inode_t dir_lookup(inode_t dir, char *name) {
+
+	struct dcache_entry *e = dcache_find(dir, name);
+	if(e != NULL) {
+		dcache_hits++;
+		return e->inode;
+	}
+	dcache_misses++;
+
+	int offset = 0;
+	struct dirent dirent;
+	struct disk_inode disk_inode;
+	read_inode(&disk_inode, dir);
+
+	/* Hashed directories only look in one bucket */
+	if(is_hashed(&disk_inode)) {
+		inode_t inode = FSE_DENOTFOUND;
+		if(hdir_find(&disk_inode, name, &dirent) >= 0)
+			inode = dirent.inode;
+		dcache_set(dir, name, inode);
+		return inode;
+	}
+
+	/* Iterate through each entry in the directory */
+	while (1) {
+
+		/* Get directory entry */
+		helper_read_write(block_read_part, &disk_inode, offset, sizeof(struct dirent), (char*)&dirent);
+
+		if(same_string(dirent.name, name))		// If string is same, HIT!
+			break;
+		offset += sizeof(struct dirent);
+		if(offset > disk_inode.size) {			// If offset is larger than size, MISS!
+			dcache_set(dir, name, FSE_DENOTFOUND);
+			return FSE_DENOTFOUND;
+		}
+	}
+
+	dcache_set(dir, name, dirent.inode);
+	return dirent.inode;
+}
+
+/*
+ * path2inode:
+ * Parses a file name and returns the corresponding inode number. If
+ * the file cannot be found, -1 is returned.
+ */
+static inode_t path2inode(char *path) {
+
+	/* Copy path */
+	char copy[SIZEX];
+	strcpy(copy, path);
+
+	/* Parse path */
+	char *parsed[SIZEX];
+	int num = parse_path(copy, parsed);
+
+	int i = 0;
+	inode_t inode;
+	/* Check if absolute path, so it skips search for "/" */
+	if(path[0] == '/') {
+		i++;
+		inode = 0;
+	} else
+		inode = current_running->cwd;
+
+	/* Iterate through each name in path */
+	for(; i < num; i++) {
+		inode = dir_lookup(inode, parsed[i]);
+		if(inode < 0)
+			return inode;
+	}
+
+	return inode;
+}
+
+/*
+ * Hashed directories. Every block of the directory is a bucket of
+ * DIRENTS_PER_BLK slots, and an empty name marks a free slot. Buckets
+ * are added one at a time with linear hashing: with n buckets and l
+ * the largest power of two not above n, a name with hash h lives in
+ * bucket h % (2 * l), or in bucket h % l if that bucket does not exist
+ * yet. Adding bucket n splits bucket n - l. The size of the inode
+ * counts the entries in use, as for linear directories.
+ */
+union dir_block {
+	char data[BLOCK_SIZE];
+	struct dirent dirent[DIRENTS_PER_BLK];
+};
+
+/* Buckets used while splitting, kept off the kernel stack */
+static union dir_block split_old;
+static union dir_block split_new;
+
+static int is_hashed(struct disk_inode *disk_inode) {
+	return disk_inode->type == INTYPE_DIR && mem_superblock.d_super.dir_format == FS_DIR_HASHED;
+}
+
+static int is_inline(struct disk_inode *disk_inode) {
+	return disk_inode->type == INTYPE_FILE && (disk_inode->flags & INFLAG_INLINE);
+}
+
+/* Number of data blocks a directory holds */
+static int dir_blocks(struct disk_inode *disk_inode) {
+	if(is_hashed(disk_inode))
+		return disk_inode->nbuckets;
+	return (disk_inode->size - 1) / BLOCK_SIZE + 1;
+}
+
+static unsigned int dir_hash(char *name) {
+	unsigned int h = 2166136261u;
+	while(*name != '\0') {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int dir_bucket(unsigned int h, int nbuckets) {
+	unsigned int level = 1;
+	while(level * 2 <= (unsigned int)nbuckets)
+		level *= 2;
+
+	unsigned int bucket = h % (level * 2);
+	if(bucket >= (unsigned int)nbuckets)
+		bucket = h % level;
+	return bucket;
+}
+
+static int read_bucket(struct disk_inode *disk_inode, int bucket, union dir_block *buf) {
+	blknum_t blk = bmap(disk_inode, bucket, 0);
+	if(blk == FREE_BLK)
+		return FSE_INVALIDBLOCK;
+	return block_read((os_size + 2) + blk, buf->data);
+}
+
+/*
+ * hdir_find:
+ * Look up name in its bucket and copy the entry into dirent. Returns
+ * the slot number of the entry, or FSE_DENOTFOUND.
+ */
+static int hdir_find(struct disk_inode *disk_inode, char *name, struct dirent *dirent) {
+	union dir_block buf;
+	int bucket = dir_bucket(dir_hash(name), disk_inode->nbuckets);
+
+	if(read_bucket(disk_inode, bucket, &buf) < 0)
+		return FSE_DENOTFOUND;
+
+	for(int i = 0; i < (int)DIRENTS_PER_BLK; i++)
+		if(buf.dirent[i].name[0] != '\0' && same_string(buf.dirent[i].name, name)) {
+			bcopy((char*)&buf.dirent[i], (char*)dirent, sizeof(struct dirent));
+			return bucket * DIRENTS_PER_BLK + i;
+		}
+	return FSE_DENOTFOUND;
+}
+
+/* Add a bucket to a hashed directory by splitting bucket n - l */
+static int hdir_split(struct disk_inode *disk_inode) {
+	int n = disk_inode->nbuckets;
+	int level = 1;
+	while(level * 2 <= n)
+		level *= 2;
+
+	if(n >= INODE_MAXBLOCKS)
+		return FSE_FULL;
+
+	blknum_t new_blk = bmap(disk_inode, n, 1);
+	write_superblock();
+	if(new_blk == FREE_BLK)
+		return FSE_FULL;
+
+	if(read_bucket(disk_inode, n - level, &split_old) < 0)
+		return FSE_INVALIDBLOCK;
+	bzero(split_new.data, BLOCK_SIZE);
+
+	/* Move the entries that now hash to the new bucket */
+	int moved = 0;
+	for(int i = 0; i < (int)DIRENTS_PER_BLK; i++) {
+		struct dirent *dirent = &split_old.dirent[i];
+		if(dirent->name[0] == '\0' || dir_hash(dirent->name) % (level * 2) != (unsigned int)n)
+			continue;
+		bcopy((char*)dirent, (char*)&split_new.dirent[moved++], sizeof(struct dirent));
+		bzero((char*)dirent, sizeof(struct dirent));
+	}
+
+	block_write((os_size + 2) + bmap(disk_inode, n - level, 0), split_old.data);
+	block_write((os_size + 2) + new_blk, split_new.data);
+	disk_inode->nbuckets++;
+
+	return 1;
+}
+
+/* Free slot in the bucket of name, FSE_FULL if the bucket is full */
+static int hdir_free_slot(struct disk_inode *disk_inode, char *name, int *bucket) {
+	union dir_block buf;
+
+	*bucket = dir_bucket(dir_hash(name), disk_inode->nbuckets);
+	if(read_bucket(disk_inode, *bucket, &buf) < 0)
+		return FSE_INVALIDBLOCK;
+
+	for(int i = 0; i < (int)DIRENTS_PER_BLK; i++)
+		if(buf.dirent[i].name[0] == '\0')
+			return i;
+	return FSE_FULL;
+}
+
+/*
+ * hdir_make_room:
+ * Split buckets of directory dir until the bucket of name has a free
+ * slot. Every split is a transaction of its own and leaves a valid
+ * directory, so the call adding the entry does not split. Does
+ * nothing for linear directories.
+ */
+static int hdir_make_room(struct disk_inode *disk_inode, inode_t dir, char *name) {
+	int bucket;
+	int ret;
+
+	if(!is_hashed(disk_inode))
+		return 0;
+
+	while((ret = hdir_free_slot(disk_inode, name, &bucket)) == FSE_FULL) {
+		if(block_txn_begin(TXN_SPLIT) < 0)
+			return FSE_ERROR;
+		ret = hdir_split(disk_inode);
+		write_inode(disk_inode, dir);
+		fs_txn_end(TXN_SPLIT);
+		if(ret < 0)
+			return ret;
+	}
+	return ret;
+}
+
+/*
+ * hdir_add:
+ * Put a new entry in a free slot of its bucket, which hdir_make_room
+ * made sure there is. Updates the size of the inode.
+ */
+static int hdir_add(struct disk_inode *disk_inode, inode_t inode, char *name) {
+	int bucket;
+	int slot = hdir_free_slot(disk_inode, name, &bucket);
+	if(slot < 0)
+		return slot;
+
+	struct dirent dirent;
+	strcpy(dirent.name, name);
+	dirent.inode = inode;
+	block_modify((os_size + 2) + bmap(disk_inode, bucket, 0), slot * sizeof(struct dirent), sizeof(struct dirent), &dirent);
+	disk_inode->size += sizeof(struct dirent);
+	return 1;
+}
+
+/*
+ * Remove the last bucket of a hashed directory if its entries fit in
+ * the bucket it was split from, undoing hdir_split.
+ */
+static void hdir_merge(struct disk_inode *disk_inode) {
+	int n = disk_inode->nbuckets - 1;
+	int level = 1;
+	while(level * 2 <= n)
+		level *= 2;
+
+	if(n == 0)
+		return;
+	if(read_bucket(disk_inode, n - level, &split_old) < 0 || read_bucket(disk_inode, n, &split_new) < 0)
+		return;
+
+	/* Move entries of the last bucket into free slots of its buddy */
+	int free_slot = 0;
+	for(int i = 0; i < (int)DIRENTS_PER_BLK; i++) {
+		if(split_new.dirent[i].name[0] == '\0')
+			continue;
+		while(free_slot < (int)DIRENTS_PER_BLK && split_old.dirent[free_slot].name[0] != '\0')
+			free_slot++;
+		if(free_slot == DIRENTS_PER_BLK)
+			return;
+		bcopy((char*)&split_new.dirent[i], (char*)&split_old.dirent[free_slot], sizeof(struct dirent));
+	}
+
+	block_write((os_size + 2) + bmap(disk_inode, n - level, 0), split_old.data);
+	release_block(disk_inode, n);
+	disk_inode->nbuckets--;
+	write_superblock();
+}
+
+/* Clear the slot of name in its bucket, and shrink the directory when possible */
+static int hdir_remove(struct disk_inode *disk_inode, char *name) {
+	struct dirent dirent;
+	int slot = hdir_find(disk_inode, name, &dirent);
+	if(slot < 0)
+		return slot;
+
+	blknum_t blk = bmap(disk_inode, slot / DIRENTS_PER_BLK, 0);
+	int ret = block_modify((os_size + 2) + blk, (slot % DIRENTS_PER_BLK) * sizeof(struct dirent), sizeof(struct dirent), zero_dirent);
+	if(ret < 0)
+		return ret;
+
+	hdir_merge(disk_inode);
+	return 0;
+}
+
+/*
+ * hdir_read:
+ * Copy up to count entries in use, starting at the slot at byte
+ * offset *pos, into dirents and move *pos past the last one. Every
+ * bucket is read once. Returns the number of entries copied, 0 at
+ * the end of the directory.
+ */
+static int hdir_read(struct disk_inode *disk_inode, int *pos, struct dirent *dirents, int count) {
+	union dir_block buf;
+	int slot = *pos / sizeof(struct dirent);
+	int n = 0;
+
+	for(int bucket = slot / DIRENTS_PER_BLK; bucket < disk_inode->nbuckets && n < count; bucket++) {
+		if(read_bucket(disk_inode, bucket, &buf) < 0)
+			break;
+
+		for(int i = slot % DIRENTS_PER_BLK; i < (int)DIRENTS_PER_BLK && n < count; i++)
+			if(buf.dirent[i].name[0] != '\0') {
+				bcopy((char*)&buf.dirent[i], (char*)&dirents[n++], sizeof(struct dirent));
+				*pos = (bucket * DIRENTS_PER_BLK + i + 1) * sizeof(struct dirent);
+			}
+		slot = 0;
+	}
+	return n;
+}
+
+static int count_bits(unsigned char *bitmap, int nbits) {
+	int n = 0;
+	for(int i = 0; i < nbits; i++)
+		n += test_bit(bitmap, i);
+	return n;
+}
+
+/* Set (mark set) or clear a block in fsck_bmap if it is in the groups
+ * being checked. Returns 0 for invalid block numbers. */
+static int fsck_mark(blknum_t blk, int mark) {
+	if(blk < mem_superblock.d_super.first_group || blk >= mem_superblock.d_super.nblocks)
+		return 0;
+	if(blk >= fsck_first && blk < fsck_first + fsck_span) {
+		if(mark)
+			set_bit(fsck_bmap, blk - fsck_first);
+		else
+			clear_bit(fsck_bmap, blk - fsck_first);
+	}
+	return 1;
+}
+
+/* Mark (or unmark) every data and indirect block of an inode */
+static void fsck_walk(struct disk_inode *disk_inode, int mark) {
+	if(is_inline(disk_inode))
+		return;
+
+	for(int i = 0; i < INODE_NDIRECT; i++)
+		fsck_mark(disk_inode->direct[i], mark);
+
+	if(fsck_mark(disk_inode->indirect, mark)) {
+		block_read((os_size + 2) + disk_inode->indirect, fsck_ind[0]);
+		for(int i = 0; i < INODE_NINDIRECT; i++)
+			fsck_mark(fsck_ind[0][i], mark);
+	}
+
+	if(fsck_mark(disk_inode->dindirect, mark)) {
+		block_read((os_size + 2) + disk_inode->dindirect, fsck_ind[0]);
+		for(int i = 0; i < INODE_NINDIRECT; i++) {
+			if(!fsck_mark(fsck_ind[0][i], mark))
+				continue;
+			block_read((os_size + 2) + fsck_ind[0][i], fsck_ind[1]);
+			for(int j = 0; j < INODE_NINDIRECT; j++)
+				fsck_mark(fsck_ind[1][j], mark);
+		}
+	}
+}
+
+static void fsck_count(struct dirent *dirents, int n) {
+	for(int i = 0; i < n; i++) {
+		if(same_string(dirents[i].name, ".") || same_string(dirents[i].name, ".."))
+			continue;
+		if(dirents[i].inode >= 0 && dirents[i].inode < fsck_ninodes)
+			fsck_inodes[dirents[i].inode].refs++;
+	}
+}
+
+/* Count the entries of a directory, a block of entries at a time */
+static void fsck_scan_dir(struct disk_inode *disk_inode) {
+	union dir_block buf;
+	int n;
+
+	if(is_hashed(disk_inode)) {
+		int pos = 0;
+		while((n = hdir_read(disk_inode, &pos, buf.dirent, DIRENTS_PER_BLK)) > 0)
+			fsck_count(buf.dirent, n);
+		return;
+	}
+
+	for(int pos = 0; pos < disk_inode->size; pos += n * sizeof(struct dirent)) {
+		n = (disk_inode->size - pos) / sizeof(struct dirent);
+		if(n > (int)DIRENTS_PER_BLK)
+			n = DIRENTS_PER_BLK;
+		if(n <= 0 || helper_read_write(block_read_part, disk_inode, pos, n * sizeof(struct dirent), buf.data) < 0)
+			return;
+		fsck_count(buf.dirent, n);
+	}
 }
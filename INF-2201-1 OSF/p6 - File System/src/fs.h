@@ -2,6 +2,7 @@
 #define FS_H
 
 #include "block.h"
+#include "fslayout.h"
 #include "fstypes.h"
 #include "inode.h"
 
@@ -13,11 +14,10 @@
 
 #endif /* LINUX_SIM */
 
-/* Number of file system blocks.
- *
- * If you decide to change this, you must probably change the number
- * of blocks reserved for the filesystem in createimage.c as well.*/
-#define FS_BLOCKS (512 + 2)
+/* Block groups. A group is covered by one bitmap block, and the group
+ * descriptor table has room for FS_MAX_GROUPS groups (256MB). */
+#define FS_GROUP_BLOCKS (BLOCK_SIZE * 8)
+#define FS_MAX_GROUPS 128
 
 #define MASK(v) (1 << (v))
 
@@ -64,6 +64,22 @@ struct dirent {
 
 #define DIRENTS_PER_BLK (BLOCK_SIZE / sizeof(struct dirent))
 
+/* One buffer of a fs_readv/fs_writev call */
+struct iovec {
+	char *base;
+	int len;
+};
+
+#define FS_IOV_MAX 16 /* largest number of buffers per fs_readv/fs_writev */
+
+/*
+ * Directory formats for fs_mkfs. Linear directories are an array of
+ * directory entries. Hashed directories keep the entries in buckets
+ * of one block each, found by hashing the name.
+ */
+#define FS_DIR_LINEAR 0
+#define FS_DIR_HASHED 1
+
 #ifndef SEEK_SET
 enum
 {
@@ -93,16 +109,17 @@ static int write_superblock(void);
 static int read_superblock(void);
 
 /**
- * @brief Write inode-bitmap and datablock-bitmap to disk.
+ * @brief Write the descriptor of a block group to disk.
+ * @param group Group number.
  * @returns Return 0 if successfully writes to disk, else -1.
  */
-static int write_bitmap(void);
+static int write_group(int group);
 
 /**
- * @brief Read inode-bitmap and datablock-bitmap from disk.
+ * @brief Read the group descriptor table from disk.
  * @returns Return 0 if successfully reads from disk, else -1.
  */
-static int read_bitmap(void);
+static int read_groups(void);
 
 /**
  * @brief Write inode into inode-table on disk.
@@ -123,39 +140,72 @@ static int read_inode(struct disk_inode *disk_inode, inode_t inode_num);
 /**
  * @brief Write a directory entry into given memory inode. (Will update inode size)
  * @param disk_inode Inode which the directory entry should be written to.
+ * @param dir Inode index of disk_inode, used to update the directory entry cache.
  * @param inode Inode which the directory entry should point to (usually parent).
  * @param name Name for directory entry.
  * @returns Return 1 if successfully writes to disk, else -1.
  */
-static int write_dirent(struct disk_inode *disk_inode, inode_t inode, char *name);
+static int write_dirent(struct disk_inode *disk_inode, inode_t dir, inode_t inode, char *name);
 
 /**
  * @brief Remove a directory entry. Will move last entry into slot
  		  where the removed entry resided. (Will update inode size)
  * @param disk_inode Inode which the directory entry should be removed from.
+ * @param dir Inode index of disk_inode, used to update the directory entry cache.
  * @param name Name for directory entry that should be removed.
  * @returns Return 1 if successfully removes, else -1.
  */
-static int remove_dirent(struct disk_inode *disk_inode, char *remove_name);
+static int remove_dirent(struct disk_inode *disk_inode, inode_t dir, char *remove_name);
 
 /**
  * @brief Open an inode and put it into global memory inode table
  * @param inode_num Inode index which should be open.
- * @returns Return index into global memory inode table if successfully opens, else -1.
+ * @returns Return index into global memory inode table if successfully opens,
+ 	   else FSE_INODETABLEFULL or FSE_INVALIDINODE.
  */
 static int open_inode(inode_t inode_num);
 
 /**
  * @brief Close an inode and remove it from the global memory inode table
  * @param entry Index into global memory inode table.
- * @returns Return 0 if successfully closes, else -1.
+ * @returns Return 0 if the inode was removed, FSE_COUNT if it is still open.
  */
 static int close_inode(int entry);
 
+/**
+ * @brief Empty the memory inode table and the open file table.
+ */
+static void file_table_init(void);
+
+/**
+ * @brief Make an entry in the open file table.
+ * @param idx Index into global memory inode table of the opened file.
+ * @param mode Mode bits the file was opened with.
+ * @param pos Position the first read/write starts at.
+ * @returns Return index into the open file table, else FSE_NOMOREFDTE.
+ */
+static int file_open(int idx, unsigned int mode, int pos);
+
+/**
+ * @brief Remove an entry from the open file table and close its inode.
+ * @param file Index into the open file table.
+ * @returns Return 0 if the buffered writes of the file were written, else < 0.
+ */
+static int file_close(int file);
+
+/**
+ * @brief Give an open file a descriptor of the running process.
+ 	  Grows the descriptor table when it is full.
+ * @param file Index into the open file table.
+ * @returns Return the lowest free descriptor, else FSE_NOMOREFDTE.
+ */
+static int fd_alloc(int file);
+
 /**
  * @brief Read/write data from/to a datablock no disk.
  	Handle reading/writing to unspecified number of datablocks,
-	but datablocks must be acquired.
+	but datablocks must be acquired. Whole blocks that are contiguous
+	on disk are moved with one block_read_multi/block_write_multi.
  * @param operation Operation that should be done, SHOULD ONLY BE block_modify or block_read_part
  * @param disk_inode Inode which should be read/written.
  * @param offset Offset, where to start read/write.
@@ -183,19 +233,63 @@ static int acquire_datablock(struct disk_inode *disk_inode, inode_t inode, int s
  */
 static inode_t create_type(int type);
 
+/* Entry of the open file table (fs.c) */
+struct open_file;
+
+/**
+ * @brief Update the readahead state of an open file after a read, and
+ 	  queue the blocks a sequential reader will want next.
+ * @param file Open file that was read.
+ * @param pos Offset the read started at.
+ * @param size Bytes read.
+ */
+static void readahead(struct open_file *file, int pos, int size);
+
+/**
+ * @brief Look up a descriptor of the running process.
+ * @param fd File descriptor.
+ * @returns Return the open file of the descriptor, NULL if it is not open.
+ */
+static struct open_file *fd_file(int fd);
+
+/**
+ * @brief Undo create_type, releasing the inode and its datablocks.
+ * @param inode_num Inode-entry index returned by create_type.
+ */
+static void destroy_type(inode_t inode_num);
+
 void fs_init(void);
-void fs_mkfs(void);
+int fs_mkfs(int dir_format, int nblocks);
 int fs_open(const char *filename, int mode);
 int fs_close(int fd);
 int fs_read(int fd, char *buffer, int size);
 int fs_write(int fd, char *buffer, int size);
+int fs_readv(int fd, struct iovec *iov, int iovcnt);
+int fs_writev(int fd, struct iovec *iov, int iovcnt);
+int fs_mmap(int fd, int offset, int len);
 int fs_lseek(int fd, int offset, int whence);
 int fs_link(char *linkname, char *filename);
 int fs_unlink(char *linkname);
 int fs_stat(int fd, char *buffer);
+int fs_getdents(int fd, char *buffer, int size);
+int fs_fsck(void);
+int fs_sync(void);
 
 int fs_mkdir(char *dir_name);
 int fs_chdir(char *path);
 int fs_rmdir(char *path);
 
+void fs_dcache_stat(int *hits, int *misses);
+#ifdef LINUX_SIM
+int fs_extents(int fd, int *blocks);
+#endif /* LINUX_SIM */
+
+void fs_static_init(void);
+void fs_exit(void);
+void fs_readahead(void);
+
+/* Used by the pager (memory.c) for pages of files mapped by fs_mmap */
+int fs_map_read(int idx, int offset, char *page, int size);
+int fs_map_write(int idx, int offset, char *page, int size);
+
 #endif
@@ -61,7 +61,9 @@ struct fse et[] = {
     /* Invalid block */
     {FSE_INVALIDBLOCK, "Inode contains invalid block pointer"},
     /* Tried to delete a file that was opened by another program */
-    {FSE_FILEOPEN, "File to delete is used by another program"}};
+    {FSE_FILEOPEN, "File to delete is used by another program"},
+    /* File system size out of range */
+    {FSE_INVALIDSIZE, "Invalid file system size"}};
 
 #ifdef LINUX_SIM
 
@@ -50,7 +50,9 @@ enum
 	FSE_INVALIDBLOCK = -22,
 	/* Tried to delete a file that was opened by another program */
 	FSE_FILEOPEN = -23,
-	FSE_COUNT = -24
+	/* File system size out of range */
+	FSE_INVALIDSIZE = -24,
+	FSE_COUNT = -25
 };
 
 enum
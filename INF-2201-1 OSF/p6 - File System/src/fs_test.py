@@ -12,7 +12,7 @@ import os, subprocess
 # import sys, string, time
 
 # Legacy variables that will simply be left as false
-fsck_implemented = False
+fsck_implemented = True
 flush_implemented = False
 
 # INSERT NAME OF SIMULATION EXECUTABLE HERE
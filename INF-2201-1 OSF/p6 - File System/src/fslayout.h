@@ -0,0 +1,21 @@
+#ifndef FSLAYOUT_H
+#define FSLAYOUT_H
+
+/*
+ * Where the file system lives in the image. Shared by the kernel
+ * (fs.h) and createimage, which reserves the blocks, so it only uses
+ * the preprocessor.
+ */
+
+/* Number of file system blocks made by fs_init when there is no file
+ * system, and by fs_mkfs when no size is given. createimage reserves
+ * this many blocks after the kernel. */
+#define FS_BLOCKS (512 + 2)
+
+/* Write-ahead journal, placed right after the superblock so it can be
+ * replayed before anything else is read. createimage leaves it
+ * zeroed, which is an empty journal. */
+#define FS_JOURNAL_START 1
+#define FS_JOURNAL_BLOCKS 64
+
+#endif /* FSLAYOUT_H */
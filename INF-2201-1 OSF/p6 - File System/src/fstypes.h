@@ -1,17 +1,25 @@
 #ifndef FSTYPES_H
 #define FSTYPES_H
 
-typedef short blknum_t; /* type for disk block number */
+typedef int blknum_t; /* type for disk block number */
 
 typedef int inode_t; /* type for index node number */
 
-/* filedescriptor entry */
-struct fd_entry {
-	int idx;           /* index into the memory inode_table */
-	unsigned int mode; /* mode bits (see MODE_XXX enum vals in fs.h) */
+/*
+ * Per-process file descriptor table. A descriptor is an index into
+ * file, which holds an index into the open file table of fs.c, or -1
+ * if the descriptor is unused. The table starts with FD_TABLE_MIN
+ * descriptors and doubles when they are all in use.
+ */
+struct fd_table {
+	int size;   /* number of descriptors in file */
+	int file[]; /* open file table index of each descriptor */
 };
 
+/* descriptors in a new table */
+#define FD_TABLE_MIN 8
+
 /* per-process maximum open file count */
-#define MAX_OPEN_FILES 10
+#define MAX_OPEN_FILES 256
 
 #endif /* FSTYPES_H */
@@ -7,28 +7,46 @@
  * that have this file as an entry. This can be used to
  * consistency-check the filesystem (the number of references made in all
  * directories should equal nlinks). The first NDIRECT blocks of the
- * file are located in the direct blocks. The rest are located in the
- * blocks listed in disk block given in indirect. The member type
+ * file are located in the direct blocks. The next NINDIRECT blocks
+ * are listed in the disk block given in indirect, and the rest are
+ * reached through the NINDIRECT indirect blocks listed in the disk
+ * block given in dindirect (double indirect). The member type
  * describes the type of file this is (regular, directory). The size
  * member must be used to determine which direct and indirect entries
- * hold actual file data.
+ * hold actual file data. In a hashed directory every block is a
+ * bucket of directory entries, and nbuckets is the number of blocks.
+ * A file of at most INODE_INLINE_MAX bytes has INFLAG_INLINE set in
+ * flags and keeps its data in place of the direct blocks, it gets
+ * blocks once it grows past that.
  */
 
+#include "block.h"
 #include "fstypes.h"
 
-#define INODE_NDIRECT 8 /* number of direct disk blocks in an inode */
+#define INODE_NDIRECT 11 /* number of direct disk blocks in an inode */
+/* number of block numbers in an indirect block */
+#define INODE_NINDIRECT ((int)(BLOCK_SIZE / sizeof(blknum_t)))
+/* largest number of blocks a file can have */
+#define INODE_MAXBLOCKS (INODE_NDIRECT + INODE_NINDIRECT + INODE_NINDIRECT * INODE_NINDIRECT)
+
+/* bytes of file data an inode can hold in place of the direct blocks */
+#define INODE_INLINE_MAX ((int)(INODE_NDIRECT * sizeof(blknum_t)))
 
 #define INTYPE_FILE 1
 #define INTYPE_DIR 2
 
+#define INFLAG_INLINE 1 /* file data is kept in the inode */
+
 struct disk_inode {
 	short type;   /* file type */
-	int size;     /* file size in bytes */
 	short nlinks; /* number of directory entries referring to this file */
+	int size;     /* file size in bytes */
 	/* pointers to the first NDIRECT blocks */
 	blknum_t direct[INODE_NDIRECT];
-	/*      blknum_t indirect; /\* The rest of the blocks *\/ */
-	int padding; /* padding so strcut is sector aligned (32 bytes) */
+	blknum_t indirect;  /* block listing the next NINDIRECT blocks */
+	blknum_t dindirect; /* block listing indirect blocks for the rest */
+	short nbuckets; /* blocks of a hashed directory, else unused */
+	short flags;    /* INFLAG_ bits (keeps struct at 64 bytes) */
 };
 
 #define INODE_BLK_SIZE 1
@@ -39,14 +57,17 @@ struct disk_inode {
  * open_count: The number of opens done on this file.
  * inode_num: its inode_number.
  * dirty: True if the inode needs to be updated on disk.
- * pos: The current read/write position (if we implement fork(), then
- * we can't have this field here anymore).
+ * hnext: Next entry in the same hash chain of the memory inode
+ * table, or in its free list.
+ * The read/write position is kept in the open file table of fs.c,
+ * so every open of a file has its own.
  */
 
 struct mem_inode {
 	struct disk_inode d_inode;
 	short open_count;
-	int pos;
+	short map_count; /* mappings by fs_mmap, part of open_count */
+	short hnext;
 	inode_t inode_num;
 	char dirty;
 };
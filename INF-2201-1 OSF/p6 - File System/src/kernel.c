@@ -55,6 +55,9 @@ static func_t start_addr[] = {
     (func_t) loader_thread, /* Loads shell */
     (func_t) clock_thread,  /* Running indefinitely */
     (func_t) usb_thread,    /* Scans USB hub port */
+    (func_t) io_thread,     /* Serves queued disk requests */
+    (func_t) readahead_thread, /* Reads file blocks ahead of use */
+    (func_t) flusher_thread, /* Writes buffered file data periodically */
     (func_t) thread2,       /* Test thread */
     (func_t) thread3        /* Test thread */
 };
@@ -70,6 +73,7 @@ static handler_t exception_handler[NUM_EXCEPTIONS] = {exception_0, exception_1,
 /* This is the entry point for the kernel */
 void kernel_start(int) __attribute__((alias("_start")));
 void _start(int load_size) {
+	extern char _end[]; /* end of the kernel bss, set by the linker */
 	int i, numthreads;
 
 	CLI(); /* just in case the interrupts are not disabled */
@@ -78,6 +82,8 @@ void _start(int load_size) {
 
 	clear_screen(0, 0, 80, 25);
 
+	ASSERT2((uint32_t) _end <= STACK_MIN, "Kernel overlaps the kernel stacks");
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-function-type"
 
@@ -96,6 +102,7 @@ void _start(int load_size) {
 	init_syscall(SYSCALL_GETCHAR, (syscall_t)getchar);
 	init_syscall(SYSCALL_READDIR, (syscall_t)readdir);
 	init_syscall(SYSCALL_LOADPROC, (syscall_t)loadproc);
+	init_syscall(SYSCALL_FS_FSCK, (syscall_t)fs_fsck);
 	init_syscall(SYSCALL_FS_MKFS, (syscall_t)fs_mkfs);
 	init_syscall(SYSCALL_FS_OPEN, (syscall_t)fs_open);
 	init_syscall(SYSCALL_FS_CLOSE, (syscall_t)fs_close);
@@ -108,6 +115,11 @@ void _start(int load_size) {
 	init_syscall(SYSCALL_FS_MKDIR, (syscall_t)fs_mkdir);
 	init_syscall(SYSCALL_FS_CHDIR, (syscall_t)fs_chdir);
 	init_syscall(SYSCALL_FS_RMDIR, (syscall_t)fs_rmdir);
+	init_syscall(SYSCALL_FS_GETDENTS, (syscall_t)fs_getdents);
+	init_syscall(SYSCALL_FS_SYNC, (syscall_t)fs_sync);
+	init_syscall(SYSCALL_FS_READV, (syscall_t)fs_readv);
+	init_syscall(SYSCALL_FS_WRITEV, (syscall_t)fs_writev);
+	init_syscall(SYSCALL_FS_MMAP, (syscall_t)fs_mmap);
 
 #pragma GCC diagnostic pop
 
@@ -123,6 +135,7 @@ void _start(int load_size) {
 	keyboard_init();
 	scsi_static_init();
 	usb_static_init();
+	fs_static_init();
 
 	numthreads = sizeof(start_addr) / sizeof(func_t);
 	/* Create the threads */
@@ -505,6 +518,7 @@ static int create_thread(int i) {
 	p->yield_count = 0;
 	/* Enable keyboard, timer, fake_irq7, and PCI interrupts */
 	p->int_controller_mask = 0xf1d8;
+	p->filedes = NULL; /* made by the first fs_open */
 
 	p->user_stack = 0; /* threads don't have a user stack */
 
@@ -559,6 +573,7 @@ static int create_process(uint32_t location, uint32_t size) {
 	p->yield_count = 0;
 	/* Enable keyboard, timer, fake_irq7, and PCI interrupts */
 	p->int_controller_mask = 0xf1d8;
+	p->filedes = NULL; /* made by the first fs_open */
 
 	/* setup user stack */
 	p->user_stack = PROCESS_STACK;
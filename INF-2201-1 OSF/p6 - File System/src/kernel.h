@@ -51,9 +51,12 @@ enum
 	/* Number of pcbs the OS supports */
 	PCB_TABLE_SIZE = 128,
 
-	/* kernel stack allocator constants */
-	STACK_MIN = 0x40000,
-	STACK_MAX = 0x80000,
+	/* Files a process can have mapped with fs_mmap */
+	MAX_MMAPS = 4,
+
+	/* kernel stack allocator constants, the kernel image must end below STACK_MIN */
+	STACK_MIN = 0x4C000,
+	STACK_MAX = 0x8C000,
 	STACK_OFFSET = 0x1FFC,
 	STACK_SIZE = 0x2000,
 
@@ -71,6 +74,14 @@ enum
 
 #ifndef LINUX_SIM
 
+/* A file mapped into the address space of a process by fs_mmap */
+struct mmap_region {
+	uint32_t vaddr; /* first page of the mapping, 0 if unused */
+	uint32_t len;   /* length in bytes, rounded up to whole pages */
+	int idx;        /* memory inode table entry of the file */
+	int offset;     /* file offset mapped at vaddr */
+};
+
 /*
  * The process control block is used for storing various information
  * about a thread or process
@@ -123,7 +134,9 @@ struct pcb {
 
 	/* filesystem stuff */
 	inode_t cwd;
-	struct fd_entry filedes[MAX_OPEN_FILES];
+	struct fd_table *filedes; /* NULL until the first fs_open */
+	struct mmap_region mmaps[MAX_MMAPS];
+	uint32_t mmap_next; /* virtual address of the next mapping */
 
 	struct pcb *next;     /* Used when job is in the ready queue */
 	struct pcb *previous; /* Used when job is in the ready queue */
@@ -136,7 +149,7 @@ struct pcb {
  */
 struct pcb {
 	inode_t cwd;
-	struct fd_entry filedes[MAX_OPEN_FILES];
+	struct fd_table *filedes;
 };
 #endif /* !LINUX_SIM */
 
@@ -9,10 +9,19 @@
  * same image without screwing up the running. It also means the
  * disk image is read once. And that we cannot use the program disk.
  *
+ * Pages of files mapped with fs_mmap are read and written through
+ * the file system (fs_map_read/fs_map_write) instead, which takes the
+ * buffer cache lock. A page is written back with page_map_lock
+ * dropped: the page is pinned meanwhile, and faults wait until the
+ * write is done (page_writebacks). The file system never touches a
+ * user buffer while it holds the buffer cache lock, so a fault taken
+ * in the middle of a file system call can always be handled.
+ *
  * Best viewed with tabs set to 4 spaces.
  */
 
 #include "common.h"
+#include "fs.h"
 #include "interrupt.h"
 #include "kernel.h"
 #include "memory.h"
@@ -47,6 +56,9 @@ static void page_swap_out(int pageno);
 /* return the disk_sector of the given page */
 static uint32_t page_disk_sector(page_map_entry_t *page);
 
+/* return the mapped file region of current_running holding vaddr */
+static struct mmap_region *mmap_lookup(uint32_t vaddr);
+
 /* Static global variables */
 /* the page map */
 static page_map_entry_t page_map[PAGEABLE_PAGES];
@@ -54,6 +66,10 @@ static page_map_entry_t page_map[PAGEABLE_PAGES];
 /* lock to control the access to the page map */
 static lock_t page_map_lock;
 
+/* pages page_swap_out is writing back, faults wait for writeback_done */
+static int page_writebacks;
+static condition_t writeback_done;
+
 /* address of the kernel page directory (shared by all kernel threads) */
 static uint32_t *kernel_pdir;
 
@@ -149,6 +165,8 @@ void init_memory(void) {
 
 	/* initialize the lock to access the page map */
 	lock_init(&page_map_lock);
+	condition_init(&writeback_done);
+	page_writebacks = 0;
 
 	/* allocate the kernel page directory */
 	p = page_alloc(TRUE);
@@ -218,6 +236,12 @@ void setup_page_table(pcb_t *p) {
 			dir_ins_table(pde, PTABLE_SPAN * i, kernel_pts[i], PE_P | PE_RW | PE_US);
 		}
 
+		/* and the page tables of memory_map_device */
+		for (i = N_KERNEL_PTS; i < PAGE_N_ENTRIES; i++) {
+			if (kernel_pdir[i] & PE_P)
+				pde[i] = kernel_pdir[i];
+		}
+
 		/* map process page table into process page directory */
 		dir_ins_table(pde, PROCESS_START, page_addr(ptbl), PE_P | PE_RW | PE_US);
 
@@ -239,6 +263,11 @@ void setup_page_table(pcb_t *p) {
 		/* map two stack pages into stack page table */
 		table_map_page(pte, PROCESS_STACK, (uint32_t)page_addr(stkp1), PE_P | PE_RW | PE_US);
 		table_map_page(pte, PROCESS_STACK - PAGE_SIZE, (uint32_t)page_addr(stkp2), PE_P | PE_RW | PE_US);
+
+		/* no mapped files yet */
+		for (i = 0; i < MAX_MMAPS; i++)
+			p->mmaps[i].vaddr = 0;
+		p->mmap_next = MMAP_START;
 	}
 
 	lock_release(&page_map_lock);
@@ -290,6 +319,10 @@ void page_fault_handler(void) {
 	current_running->page_fault_count++;
 	lock_acquire(&page_map_lock);
 
+	/* the page may be the one being written back, wait for the write */
+	while (page_writebacks > 0)
+		condition_wait(&page_map_lock, &writeback_done);
+
 	pdi = get_directory_index(current_running->fault_addr);
 	pde = current_running->page_directory[pdi];
 
@@ -332,6 +365,7 @@ void page_fault_handler(void) {
 		page->vaddr = current_running->fault_addr & PE_BASE_ADDR_MASK;
 		page->entry = &pta[pti];
 		page->pinned = FALSE;
+		page->mmap = mmap_lookup(page->vaddr);
 
 		page_swap_in(pidx);
 	}
@@ -370,6 +404,7 @@ static int page_alloc(int pinned) {
 	page_map[page].vaddr = 0;
 	page_map[page].entry = NULL;
 	page_map[page].pinned = pinned;
+	page_map[page].mmap = NULL;
 
 	/* Zero out page before returning  */
 	p = page_addr(page);
@@ -425,6 +460,13 @@ static void page_swap_in(int pageno) {
 
 	scrprintf(23, 50, "pid %-3d rding page %-3d", current_running->pid, pageno);
 
+	if (page->mmap != NULL) {
+		/* page of a mapped file, read it through its block map */
+		fs_map_read(page->mmap->idx, page->mmap->offset + (page->vaddr - page->mmap->vaddr), (char *)addr, PAGE_SIZE);
+		*page->entry = PE_P | PE_RW | PE_US | PE_A | addr;
+		return;
+	}
+
 	if ((sector + SECTORS_PER_PAGE) > (page->swap_loc + page->swap_size)) {
 		/*
 		 * if the final sector is past the end of the image
@@ -475,6 +517,25 @@ static void page_swap_out(int pageno) {
 
 	scrprintf(24, 71, "0");
 
+	/*
+	 * dirty page of a mapped file, write it back to the file without
+	 * holding page_map_lock. The page stays pinned until page_alloc
+	 * hands it out.
+	 */
+	if (page->mmap != NULL) {
+		if ((*page->entry & PE_D) != 0) {
+			page->pinned = TRUE;
+			page_writebacks++;
+			lock_release(&page_map_lock);
+			fs_map_write(page->mmap->idx, page->mmap->offset + (page->vaddr - page->mmap->vaddr), (char *)page_addr(pageno), PAGE_SIZE);
+			lock_acquire(&page_map_lock);
+			page_writebacks--;
+			condition_broadcast(&writeback_done);
+		}
+		scrprintf(24, 71, "x");
+		return;
+	}
+
 	/* if page is dirty */
 	if ((*page->entry & PE_D) != 0) {
 		uint32_t sector, nsectors, addr;
@@ -501,3 +562,157 @@ static void page_swap_out(int pageno) {
 static uint32_t page_disk_sector(page_map_entry_t *page) {
 	return page->swap_loc + ((page->vaddr - PROCESS_START) / PAGE_SIZE) * SECTORS_PER_PAGE;
 }
+
+/* Get the mapped file region of current_running that holds vaddr */
+static struct mmap_region *mmap_lookup(uint32_t vaddr) {
+	struct mmap_region *r;
+	int i;
+
+	if (current_running->is_thread)
+		return NULL;
+
+	for (i = 0; i < MAX_MMAPS; i++) {
+		r = &current_running->mmaps[i];
+		if (r->vaddr != 0 && vaddr >= r->vaddr && vaddr < r->vaddr + r->len)
+			return r;
+	}
+	return NULL;
+}
+
+/*
+ * Reserve virtual addresses for a file mapping in current_running. The
+ * pages are left not present, so they are read on the first access by
+ * page_fault_handler().
+ */
+uint32_t memory_map_file(int idx, int offset, int len) {
+	struct mmap_region *r = NULL;
+	uint32_t *pta, vaddr;
+	int i;
+
+	lock_acquire(&page_map_lock);
+
+	for (i = 0; i < MAX_MMAPS && r == NULL; i++)
+		if (current_running->mmaps[i].vaddr == 0)
+			r = &current_running->mmaps[i];
+
+	/* round up to whole pages */
+	len = (len + PAGE_SIZE - 1) & ~PAGE_MASK;
+	if (r == NULL || current_running->mmap_next + len > MMAP_END) {
+		lock_release(&page_map_lock);
+		return 0;
+	}
+
+	r->vaddr = current_running->mmap_next;
+	r->len = len;
+	r->idx = idx;
+	r->offset = offset;
+	current_running->mmap_next += len;
+
+	/* the process page table covers the mmap area */
+	pta = (uint32_t *)(current_running->page_directory[get_directory_index(r->vaddr)] & PE_BASE_ADDR_MASK);
+	for (vaddr = r->vaddr; vaddr < r->vaddr + r->len; vaddr += PAGE_SIZE)
+		table_map_page(pta, vaddr, 0, PE_RW | PE_US);
+
+	lock_release(&page_map_lock);
+	return r->vaddr;
+}
+
+/*
+ * Write every dirty page of a mapped file back through the file
+ * system, and mark it clean. Each page is marked clean before it is
+ * written, so a store made during the write dirties it again, and is
+ * pinned while page_map_lock is dropped for the write.
+ */
+void memory_sync_files(void) {
+	page_map_entry_t *page;
+	int i;
+
+	lock_acquire(&page_map_lock);
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		page = &page_map[i];
+		if (page->mmap == NULL || (*page->entry & (PE_P | PE_D)) != (PE_P | PE_D))
+			continue;
+
+		*page->entry &= ~PE_D;
+		invalidate_page((uint32_t *)page->vaddr);
+
+		page->pinned = TRUE;
+		lock_release(&page_map_lock);
+		fs_map_write(page->mmap->idx, page->mmap->offset + (page->vaddr - page->mmap->vaddr), (char *)page_addr(i), PAGE_SIZE);
+		lock_acquire(&page_map_lock);
+		page->pinned = FALSE;
+	}
+	lock_release(&page_map_lock);
+}
+
+/*
+ * Write the dirty pages of the files current_running has mapped back,
+ * and detach its pages from the files, called when it exits. A
+ * detached page is left clean and not present, so it is never written
+ * anywhere when page_alloc later takes it. Writes other processes
+ * started on the pages are waited for, after this the file system can
+ * drop the references of the mappings.
+ */
+void memory_unmap_files(void) {
+	page_map_entry_t *page;
+	int i;
+
+	if (current_running->is_thread)
+		return;
+
+	lock_acquire(&page_map_lock);
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		page = &page_map[i];
+		if (page->owner != current_running || page->mmap == NULL ||
+		    (*page->entry & (PE_P | PE_D)) != (PE_P | PE_D))
+			continue;
+
+		*page->entry &= ~PE_D;
+		invalidate_page((uint32_t *)page->vaddr);
+
+		page->pinned = TRUE;
+		lock_release(&page_map_lock);
+		fs_map_write(page->mmap->idx, page->mmap->offset + (page->vaddr - page->mmap->vaddr), (char *)page_addr(i), PAGE_SIZE);
+		lock_acquire(&page_map_lock);
+		page->pinned = FALSE;
+	}
+
+	while (page_writebacks > 0)
+		condition_wait(&page_map_lock, &writeback_done);
+
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		page = &page_map[i];
+		if (page->owner != current_running || page->mmap == NULL)
+			continue;
+
+		*page->entry = 0;
+		invalidate_page((uint32_t *)page->vaddr);
+		page->mmap = NULL;
+	}
+	lock_release(&page_map_lock);
+}
+
+/*
+ * Identity map the pages holding size bytes of device registers at
+ * paddr, with caching off. Each 4MB region gets its own pinned page
+ * table, which setup_page_table also shares with the processes, so
+ * interrupt handlers reach the registers in any address space.
+ *
+ * Only called while the kernel initialises, before paging is enabled
+ * and before any process exists.
+ */
+void memory_map_device(uint32_t paddr, int size) {
+	uint32_t *table;
+	uint32_t vaddr;
+	int i, n_pages;
+
+	n_pages = ((paddr & PAGE_MASK) + size + PAGE_SIZE - 1) / PAGE_SIZE;
+	vaddr = paddr & PE_BASE_ADDR_MASK;
+	for (i = 0; i < n_pages; i++, vaddr += PAGE_SIZE) {
+		if ((kernel_pdir[get_directory_index(vaddr)] & PE_P) == 0)
+			dir_ins_table(kernel_pdir, vaddr, page_addr(page_alloc(TRUE)), PE_P | PE_RW);
+
+		table = (uint32_t *)(kernel_pdir[get_directory_index(vaddr)] & PE_BASE_ADDR_MASK);
+		table_map_page(table, vaddr, vaddr, PE_P | PE_RW | PE_PCD | PE_PWT);
+	}
+}
@@ -39,7 +39,11 @@ enum
 	/* used to extract the 10 lsb of a page directory entry */
 	MODE_MASK = 0x000003ff,
 
-	PAGE_TABLE_SIZE = (1024 * 4096 - 1) /* size of a page table in bytes */
+	PAGE_TABLE_SIZE = (1024 * 4096 - 1), /* size of a page table in bytes */
+
+	/* fs_mmap places files in the upper half of the process page table */
+	MMAP_START = (PROCESS_START + PTABLE_SPAN / 2),
+	MMAP_END = (PROCESS_START + PTABLE_SPAN)
 };
 
 /* structure of an entry in the page map */
@@ -50,6 +54,8 @@ typedef struct {
 	uint32_t vaddr;  /* page-aligned virtual address of this page */
 	uint32_t *entry; /* entry that points to this page */
 	bool_t pinned;   /* is this page pinned? */
+	/* mapped file this page belongs to, NULL for the process image */
+	struct mmap_region *mmap;
 } page_map_entry_t;
 
 /* Prototypes */
@@ -68,4 +74,26 @@ void setup_page_table(pcb_t *p);
  */
 void page_fault_handler(void);
 
+/*
+ * Map len bytes of the file in memory inode table entry idx, from
+ * offset, into the address space of current_running. Returns the
+ * virtual address of the mapping, or 0 on failure. Called by fs_mmap.
+ */
+uint32_t memory_map_file(int idx, int offset, int len);
+
+/* Write the dirty pages of mapped files back, called by fs_sync */
+void memory_sync_files(void);
+
+/*
+ * Write back and detach the pages of the files current_running has
+ * mapped, called by fs_exit before the mappings are dropped.
+ */
+void memory_unmap_files(void);
+
+/*
+ * Identity map size bytes of device registers at physical address
+ * paddr, uncached. Called by PCI drivers before paging is enabled.
+ */
+void memory_map_device(uint32_t paddr, int size);
+
 #endif /* !MEMORY_H */
@@ -0,0 +1,341 @@
+/*
+ * File system micro-benchmarks for the simulator (LINUX_SIM) build:
+ *
+ *   p6bench [-h] [-n count] [-s kbytes] [-b blocks] [benchmark ...]
+ *
+ * Every benchmark gets a new file system in bench_image (hashed
+ * directories with -h). What it needs is made first, then the file
+ * system is remounted so the buffer cache is cold, and the timed part
+ * ends with fs_sync so all writes are counted. For each benchmark
+ * the number of operations, operations per second and the device
+ * requests and blocks per operation are printed. The I/O counts come
+ * from block_sim.c and do not depend on the host, so they show when
+ * a change makes an operation take more I/O.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "block.h"
+#include "fs.h"
+#include "fs_error.h"
+#include "kernel.h"
+
+#define BENCH_IMAGE "bench_image"
+#define BENCH_COUNT 1000      /* default files, lookups and random I/Os */
+#define BENCH_KBYTES 1024     /* default size of the file read and written */
+#define BENCH_BLOCKS 20000    /* default file system size */
+#define BENCH_CHUNK (8 * BLOCK_SIZE) /* bytes per sequential fs_read/fs_write */
+#define BENCH_DEPTH 8         /* directories in the lookup path */
+#define BENCH_LISTINGS 20     /* times the directory is listed */
+
+struct pcb fake_pcb;
+struct pcb *current_running = &fake_pcb;
+
+int os_size = 0;
+
+/*
+ * A benchmark. setup makes what run needs, and is not measured. run
+ * returns the number of operations done.
+ */
+struct bench {
+	char *name;
+	void (*setup)(void);
+	int (*run)(void);
+};
+
+static void setup_none(void);
+static void setup_files(void);
+static void setup_path(void);
+static void setup_file(void);
+
+static int run_create(void);
+static int run_unlink(void);
+static int run_lookup(void);
+static int run_seqwrite(void);
+static int run_seqread(void);
+static int run_randwrite(void);
+static int run_randread(void);
+static int run_listdir(void);
+
+static struct bench benches[] = {
+	{"create", setup_none, run_create},
+	{"unlink", setup_files, run_unlink},
+	{"lookup", setup_path, run_lookup},
+	{"seqwrite", setup_none, run_seqwrite},
+	{"seqread", setup_file, run_seqread},
+	{"randwrite", setup_file, run_randwrite},
+	{"randread", setup_file, run_randread},
+	{"listdir", setup_files, run_listdir},
+};
+#define NBENCHES ((int)(sizeof(benches) / sizeof(benches[0])))
+
+static void run_bench(struct bench *b);
+static void make_files(int n);
+static int next_random(void);
+static void check(int ev, char *what);
+static double elapsed(struct timeval *start);
+
+/* Options */
+static int count = BENCH_COUNT;
+static int kbytes = BENCH_KBYTES;
+static int blocks = BENCH_BLOCKS;
+static int dir_format = FS_DIR_LINEAR;
+
+static char buf[BENCH_CHUNK];
+static unsigned int seed;
+
+int main(int argc, char *argv[]) {
+	FILE *fp;
+	int i, first, ran = 0;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-h") == 0)
+			dir_format = FS_DIR_HASHED;
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			count = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			kbytes = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			blocks = atoi(argv[++i]);
+		else {
+			fprintf(stderr, "Usage: %s [-h] [-n count] [-s kbytes] [-b blocks] [benchmark ...]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	first = i;
+
+	/* An image large enough for fs_init, fs_mkfs sizes the file system */
+	if ((fp = fopen(BENCH_IMAGE, "w")) == NULL) {
+		perror(BENCH_IMAGE);
+		return EXIT_FAILURE;
+	}
+	fseek(fp, (long)(2 + (blocks > FS_BLOCKS ? blocks : FS_BLOCKS)) * BLOCK_SIZE - 1, SEEK_SET);
+	fputc(0, fp);
+	fclose(fp);
+	block_image = BENCH_IMAGE;
+	fs_init();
+
+	for (i = 0; i < BENCH_CHUNK; i++)
+		buf[i] = 'a' + i % 26;
+
+	printf("%-10s %7s %10s %9s %9s %10s %10s\n", "benchmark", "ops", "ops/sec", "reads/op", "writes/op",
+	       "blkrd/op", "blkwr/op");
+	for (int b = 0; b < NBENCHES; b++) {
+		int wanted = (first == argc);
+		for (int j = first; j < argc; j++)
+			if (strcmp(argv[j], benches[b].name) == 0)
+				wanted = 1;
+		if (wanted) {
+			run_bench(&benches[b]);
+			ran++;
+		}
+	}
+
+	block_destruct();
+	if (ran == 0) {
+		fprintf(stderr, "benchmarks:");
+		for (int b = 0; b < NBENCHES; b++)
+			fprintf(stderr, " %s", benches[b].name);
+		fprintf(stderr, "\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static void run_bench(struct bench *b) {
+	int r0, w0, br0, bw0, r1, w1, br1, bw1, ops;
+	struct timeval start;
+	double secs;
+
+	check(fs_mkfs(dir_format, blocks), "fs_mkfs");
+	seed = 1;
+	b->setup();
+
+	/* Remount, so the benchmark starts with nothing cached */
+	check(fs_sync(), "fs_sync");
+	block_destruct();
+	fs_init();
+
+	block_dev_stat(&r0, &w0, &br0, &bw0);
+	gettimeofday(&start, NULL);
+	ops = b->run();
+	check(fs_sync(), "fs_sync");
+	secs = elapsed(&start);
+	block_dev_stat(&r1, &w1, &br1, &bw1);
+
+	if (ops <= 0)
+		ops = 1;
+	printf("%-10s %7d %10.0f %9.2f %9.2f %10.2f %10.2f\n", b->name, ops, ops / secs, (double)(r1 - r0) / ops,
+	       (double)(w1 - w0) / ops, (double)(br1 - br0) / ops, (double)(bw1 - bw0) / ops);
+}
+
+static void setup_none(void) {
+}
+
+/* count empty files in directory "d" */
+static void setup_files(void) {
+	check(fs_mkdir("d"), "fs_mkdir");
+	check(fs_chdir("d"), "fs_chdir");
+	make_files(count);
+	check(fs_chdir(".."), "fs_chdir");
+}
+
+/* File "f" at the end of a path of BENCH_DEPTH directories */
+static void setup_path(void) {
+	char name[MAX_FILENAME_LEN];
+
+	for (int i = 0; i < BENCH_DEPTH; i++) {
+		sprintf(name, "d%d", i);
+		check(fs_mkdir(name), "fs_mkdir");
+		check(fs_chdir(name), "fs_chdir");
+	}
+	make_files(1);
+}
+
+/* File "f" of kbytes KB */
+static void setup_file(void) {
+	run_seqwrite();
+}
+
+static int run_create(void) {
+	check(fs_mkdir("d"), "fs_mkdir");
+	check(fs_chdir("d"), "fs_chdir");
+	make_files(count);
+	return count;
+}
+
+static int run_unlink(void) {
+	char name[MAX_FILENAME_LEN];
+
+	check(fs_chdir("d"), "fs_chdir");
+	for (int i = 0; i < count; i++) {
+		sprintf(name, "f%d", i);
+		check(fs_unlink(name), "fs_unlink");
+	}
+	return count;
+}
+
+static int run_lookup(void) {
+	char path[MAX_PATH_LEN];
+	int fd;
+
+	path[0] = '\0';
+	for (int i = 0; i < BENCH_DEPTH; i++)
+		sprintf(path + strlen(path), "/d%d", i);
+	strcat(path, "/f0");
+
+	for (int i = 0; i < count; i++) {
+		check(fd = fs_open(path, MODE_RDONLY), "fs_open");
+		check(fs_close(fd), "fs_close");
+	}
+	return count;
+}
+
+static int run_seqwrite(void) {
+	int fd, ops = 0;
+
+	check(fd = fs_open("f", MODE_WRONLY | MODE_CREAT), "fs_open");
+	for (int total = 0; total < kbytes * 1024; total += BENCH_CHUNK, ops++)
+		check(fs_write(fd, buf, BENCH_CHUNK), "fs_write");
+	check(fs_close(fd), "fs_close");
+	return ops;
+}
+
+static int run_seqread(void) {
+	int fd, ev, ops = 0;
+
+	check(fd = fs_open("f", MODE_RDONLY), "fs_open");
+	while ((ev = fs_read(fd, buf, BENCH_CHUNK)) > 0)
+		ops++;
+	check(ev, "fs_read");
+	check(fs_close(fd), "fs_close");
+	return ops;
+}
+
+/* Writes of one block at random block offsets of the file, which overwrite it */
+static int run_randwrite(void) {
+	char st[STAT_SIZE];
+	int fd, size, nblks = kbytes * 1024 / BLOCK_SIZE;
+
+	check(fd = fs_open("f", MODE_WRONLY | MODE_CREAT), "fs_open");
+	for (int i = 0; i < count; i++) {
+		fs_lseek(fd, (next_random() % nblks) * BLOCK_SIZE, SEEK_SET);
+		check(fs_write(fd, buf, BLOCK_SIZE), "fs_write");
+	}
+	check(fs_close(fd), "fs_close");
+
+	/* Otherwise the blocks written count allocation as well */
+	check(fd = fs_open("f", MODE_RDONLY), "fs_open");
+	check(fs_stat(fd, st), "fs_stat");
+	check(fs_close(fd), "fs_close");
+	memcpy(&size, &st[2], sizeof(size));
+	if (size != nblks * BLOCK_SIZE) {
+		printf("randwrite: file grew from %d to %d bytes\n", nblks * BLOCK_SIZE, size);
+		exit(EXIT_FAILURE);
+	}
+	return count;
+}
+
+static int run_randread(void) {
+	int fd, nblks = kbytes * 1024 / BLOCK_SIZE;
+
+	check(fd = fs_open("f", MODE_RDONLY), "fs_open");
+	for (int i = 0; i < count; i++) {
+		fs_lseek(fd, (next_random() % nblks) * BLOCK_SIZE, SEEK_SET);
+		check(fs_read(fd, buf, BLOCK_SIZE), "fs_read");
+	}
+	check(fs_close(fd), "fs_close");
+	return count;
+}
+
+/* Read every entry of directory "d", BENCH_LISTINGS times */
+static int run_listdir(void) {
+	struct dirent de[DIRENTS_PER_BLK];
+	int fd, ev;
+
+	for (int i = 0; i < BENCH_LISTINGS; i++) {
+		check(fd = fs_open("d", MODE_RDONLY), "fs_open");
+		while ((ev = fs_getdents(fd, (char *)de, sizeof(de))) > 0)
+			;
+		check(ev, "fs_getdents");
+		check(fs_close(fd), "fs_close");
+	}
+	return BENCH_LISTINGS;
+}
+
+/* Empty files f0 .. f<n - 1> in the current directory */
+static void make_files(int n) {
+	char name[MAX_FILENAME_LEN];
+	int fd;
+
+	for (int i = 0; i < n; i++) {
+		sprintf(name, "f%d", i);
+		check(fd = fs_open(name, MODE_WRONLY | MODE_CREAT), "fs_open");
+		check(fs_close(fd), "fs_close");
+	}
+}
+
+/* Same sequence on every host, from the seed set by run_bench */
+static int next_random(void) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+static void check(int ev, char *what) {
+	if (ev < 0) {
+		printf("%s: ", what);
+		print_fse(ev);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Seconds elapsed since start */
+static double elapsed(struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
@@ -0,0 +1,438 @@
+/*
+ * Host tools for file system images, built from the same fs.c as the
+ * simulator shell (p6sh):
+ *
+ *   mkfs.p6 [-h] <image> [blocks]    make a new file system
+ *   p6fs-import <image> <directory>  copy a host directory tree into /
+ *   p6fs-dump [-l] <image>           print the layout and fragmentation
+ *
+ * The tool is picked by the name the program is run as, the Makefile
+ * links one binary per name. An image made by createimage starts with
+ * the boot block, and its file system follows the kernel (os_size is
+ * read from the boot block, the file system may be at most FS_BLOCKS
+ * blocks). Any other file holds a file system only, like image_sim.
+ */
+
+#define _XOPEN_SOURCE 700 /* nftw and truncate, but not syscall() of unistd.h */
+#include <errno.h>
+#include <ftw.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "fs.h"
+#include "fs_error.h"
+#include "kernel.h"
+#include "superblock.h"
+
+#define OS_SIZE_LOC 2      /* os_size in the boot block */
+#define IMPORT_CHUNK (BLOCK_MULTI_MAX * BLOCK_SIZE) /* bytes per fs_write */
+#define IMPORT_FDS 32      /* host directories nftw keeps open */
+
+struct pcb fake_pcb;
+struct pcb *current_running = &fake_pcb;
+
+int os_size = 0;
+
+/* Open the image for the file system code, returns TRUE for boot images */
+static int open_image(char *image);
+/* Read the superblock and group descriptor 'group' of the image */
+static void read_super(struct disk_superblock *sb);
+static void read_group(struct disk_superblock *sb, int group, struct group_desc *gd);
+
+/* The tools */
+static int mkfs(int argc, char *argv[]);
+static int import(int argc, char *argv[]);
+static int dump(int argc, char *argv[]);
+
+/* p6fs-import: nftw callback, and copy of one host file into the cwd of the image */
+static int import_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+static void import_file(const char *path, char *name);
+
+/* p6fs-dump: walk the cwd of the image, and count free runs of a group */
+static void dump_dir(char *path, int list);
+static void dump_free(struct disk_superblock *sb, int group, int *runs, int *largest);
+
+static void usage(char *tool, char *args);
+static void error(char *fmt, ...);
+
+/* Directory of the image the import is in, and a skipped directory, as nftw levels */
+static int import_level;
+static int skip_level = -1;
+
+/* Totals of p6fs-import and p6fs-dump */
+static int nfiles, ndirs, nskipped;
+static long long nbytes;
+static int nblocks, nextents, nfragmented, nmapped;
+
+int main(int argc, char *argv[]) {
+	char *tool = strrchr(argv[0], '/');
+
+	tool = (tool == NULL) ? argv[0] : tool + 1;
+	if (strcmp(tool, "mkfs.p6") == 0)
+		return mkfs(argc, argv);
+	if (strcmp(tool, "p6fs-import") == 0)
+		return import(argc, argv);
+	if (strcmp(tool, "p6fs-dump") == 0)
+		return dump(argc, argv);
+
+	fprintf(stderr, "%s: run as mkfs.p6, p6fs-import or p6fs-dump\n", tool);
+	return EXIT_FAILURE;
+}
+
+/*
+ * mkfs.p6 [-h] <image> [blocks]
+ * The image is made if it does not exist. Without a boot block it is
+ * cut to the size of the new file system.
+ */
+static int mkfs(int argc, char *argv[]) {
+	struct disk_superblock sb;
+	struct stat st;
+	off_t size;
+	int hashed = 0, blocks, boot, ev;
+
+	if (argc > 1 && strcmp(argv[1], "-h") == 0) {
+		hashed = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 2 || argc > 3) {
+		usage(argv[0], "[-h] <image> [blocks]");
+		return EXIT_FAILURE;
+	}
+	blocks = (argc == 3) ? atoi(argv[2]) : FS_BLOCKS;
+
+	boot = open_image(argv[1]);
+	if (boot && blocks > FS_BLOCKS)
+		error("%s: a boot image has room for %d blocks\n", argv[1], FS_BLOCKS);
+
+	/* fs_init makes a default file system in an empty image first */
+	size = (off_t)(os_size + 2 + (blocks > FS_BLOCKS ? blocks : FS_BLOCKS)) * BLOCK_SIZE;
+	if (stat(argv[1], &st) < 0 || (st.st_size < size && truncate(argv[1], size) < 0))
+		error("%s: could not size image: ", argv[1]);
+
+	fs_init();
+	if ((ev = fs_mkfs(hashed ? FS_DIR_HASHED : FS_DIR_LINEAR, blocks)) < 0) {
+		printf("mkfs.p6: ");
+		print_fse(ev);
+		return EXIT_FAILURE;
+	}
+	read_super(&sb);
+	block_destruct();
+
+	if (!boot && truncate(argv[1], (off_t)(2 + blocks) * BLOCK_SIZE) < 0)
+		error("%s: could not size image: ", argv[1]);
+
+	printf("%s: %d blocks, %d groups, %d inodes, %s directories\n", argv[1], sb.nblocks, sb.ngroups,
+	       sb.ngroups * sb.group_inodes, hashed ? "hashed" : "linear");
+	return EXIT_SUCCESS;
+}
+
+/*
+ * p6fs-import <image> <directory>
+ * Files are written IMPORT_CHUNK bytes at a time, so the allocator
+ * sees large sequential writes. A file already in the image is
+ * replaced. Names the file system can not hold are skipped.
+ */
+static int import(int argc, char *argv[]) {
+	struct timeval start, now;
+	double secs;
+
+	if (argc != 3) {
+		usage(argv[0], "<image> <directory>");
+		return EXIT_FAILURE;
+	}
+
+	open_image(argv[1]);
+	fs_init();
+
+	gettimeofday(&start, NULL);
+	if (nftw(argv[2], import_entry, IMPORT_FDS, 0) < 0)
+		error("%s: ", argv[2]);
+	fs_sync();
+	block_destruct();
+	gettimeofday(&now, NULL);
+	secs = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1e6;
+
+	printf("%d files, %d directories, %lld KB in %.3f s", nfiles, ndirs, nbytes / 1024, secs);
+	if (nskipped > 0)
+		printf(", %d skipped", nskipped);
+	printf("\n");
+	return nskipped > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Called by nftw for every entry of the host tree, a directory before
+ * what is in it. Level 0 is the directory given, it is the root of
+ * the image.
+ */
+static int import_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	char *name = (char *)path + ftw->base;
+	int ev;
+
+	if (ftw->level == 0)
+		return 0;
+
+	/* Leave out what is below a skipped directory */
+	if (skip_level >= 0 && ftw->level > skip_level)
+		return 0;
+	skip_level = -1;
+
+	/* Go back up to the directory of this entry */
+	while (import_level > ftw->level - 1) {
+		fs_chdir("..");
+		import_level--;
+	}
+
+	if (strlen(name) >= MAX_FILENAME_LEN) {
+		printf("%s: name too long, skipped\n", path);
+		nskipped++;
+		skip_level = ftw->level;
+		return 0;
+	}
+
+	if (flag == FTW_D) {
+		/* An existing directory is merged with */
+		ev = fs_mkdir(name);
+		if (fs_chdir(name) < 0) {
+			printf("%s: ", path);
+			print_fse(ev);
+			nskipped++;
+			skip_level = ftw->level;
+			return 0;
+		}
+		import_level = ftw->level;
+		ndirs++;
+	}
+	else if (flag == FTW_F && S_ISREG(st->st_mode))
+		import_file(path, name);
+	else {
+		printf("%s: not a file or directory, skipped\n", path);
+		nskipped++;
+	}
+	return 0;
+}
+
+static void import_file(const char *path, char *name) {
+	static char buf[IMPORT_CHUNK];
+	FILE *fp;
+	size_t n;
+	int fd, ev = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		error("%s: ", path);
+
+	fs_unlink(name);
+	if ((fd = fs_open(name, MODE_WRONLY | MODE_CREAT)) < 0) {
+		printf("%s: ", path);
+		print_fse(fd);
+		nskipped++;
+		fclose(fp);
+		return;
+	}
+
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		if ((ev = fs_write(fd, buf, (int)n)) < 0)
+			break;
+		nbytes += n;
+	}
+	if (ev >= 0)
+		ev = fs_close(fd);
+	else
+		fs_close(fd);
+	fclose(fp);
+
+	if (ev < 0) {
+		printf("%s: ", path);
+		print_fse(ev);
+		nskipped++;
+	}
+	else
+		nfiles++;
+}
+
+/*
+ * p6fs-dump [-l] <image>
+ * Prints the superblock, every group with its free space and how
+ * broken up that is, and how many extents (runs of blocks that are
+ * contiguous on disk) files have. -l lists every file as well.
+ */
+static int dump(int argc, char *argv[]) {
+	struct disk_superblock sb;
+	struct group_desc gd;
+	int list = 0, runs, largest, total_runs = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-l") == 0) {
+		list = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 2) {
+		usage(argv[0], "[-l] <image>");
+		return EXIT_FAILURE;
+	}
+
+	if (open_image(argv[1]))
+		printf("boot image, kernel: %d sectors\n", os_size);
+	fs_init();
+	read_super(&sb);
+
+	printf("file system: %d blocks from block %d, %s directories\n", sb.nblocks, os_size + 2,
+	       sb.dir_format == FS_DIR_HASHED ? "hashed" : "linear");
+	printf("journal: %d blocks from block %d\n", sb.journal_len, sb.journal_blk);
+	printf("inodes: %d of %d used\n", sb.ninodes, sb.ngroups * sb.group_inodes);
+	printf("data blocks: %d of %d used\n", sb.ndata_blks, sb.nblocks - sb.first_group);
+	printf("groups: %d of %d blocks and %d inodes, descriptors in block %d\n\n", sb.ngroups,
+	       sb.group_blocks, sb.group_inodes, sb.gdt_blk);
+
+	printf("group   start  bbmap  ibmap itable  free blocks  free inodes  free runs  largest\n");
+	for (int g = 0; g < sb.ngroups; g++) {
+		read_group(&sb, g, &gd);
+		dump_free(&sb, g, &runs, &largest);
+		total_runs += runs;
+		printf("%5d %7d %6d %6d %6d %12d %12d %10d %8d\n", g, sb.first_group + g * sb.group_blocks,
+		       gd.block_bmap, gd.inode_bmap, gd.inode_table, gd.free_blocks, gd.free_inodes, runs, largest);
+	}
+
+	if (list)
+		printf("\n%6s %8s %7s %7s  %s\n", "inode", "size", "blocks", "extents", "name");
+	dump_dir("", list);
+	block_destruct();
+
+	printf("\n%d files, %d directories, %lld KB in %d data blocks\n", nfiles, ndirs, nbytes / 1024, nblocks);
+	printf("%d extents, %.2f per file or directory with blocks, %d fragmented (more than one extent)\n",
+	       nextents, (nmapped > 0) ? (double)nextents / nmapped : 0.0, nfragmented);
+	printf("%d runs of free blocks\n", total_runs);
+	return EXIT_SUCCESS;
+}
+
+/* Directories are walked with fs_chdir, path is only used for printing */
+static void dump_dir(char *path, int list) {
+	struct dirent de[DIRENTS_PER_BLK];
+	char sub[MAX_PATH_LEN], buf[STAT_SIZE];
+	int dirfd, fd, ev, size, blocks, extents;
+
+	if ((dirfd = fs_open(".", MODE_RDONLY)) < 0) {
+		printf("%s/: ", path);
+		print_fse(dirfd);
+		return;
+	}
+
+	while ((ev = fs_getdents(dirfd, (char *)de, sizeof(de))) > 0) {
+		for (int i = 0; i < ev / (int)sizeof(struct dirent); i++) {
+			if (strcmp(de[i].name, ".") == 0 || strcmp(de[i].name, "..") == 0)
+				continue;
+			snprintf(sub, sizeof(sub), "%s/%s", path, de[i].name);
+			if ((fd = fs_open(de[i].name, MODE_RDONLY)) < 0) {
+				printf("%s: ", sub);
+				print_fse(fd);
+				continue;
+			}
+			fs_stat(fd, buf);
+			memcpy(&size, &buf[2], sizeof(int));
+			extents = fs_extents(fd, &blocks);
+			fs_close(fd);
+
+			nblocks += blocks;
+			nextents += extents;
+			if (extents > 0)
+				nmapped++;
+			if (extents > 1)
+				nfragmented++;
+			if (list)
+				printf("%6d %8d %7d %7d  %s%s\n", de[i].inode, size, blocks, extents, sub,
+				       buf[0] == INTYPE_DIR ? "/" : "");
+
+			if (buf[0] == INTYPE_DIR) {
+				ndirs++;
+				fs_chdir(de[i].name);
+				dump_dir(sub, list);
+				fs_chdir("..");
+			}
+			else {
+				nfiles++;
+				nbytes += size;
+			}
+		}
+	}
+	if (ev < 0) {
+		printf("%s/: ", path);
+		print_fse(ev);
+	}
+	fs_close(dirfd);
+}
+
+/* Runs of free blocks in the block bitmap of a group, and the longest */
+static void dump_free(struct disk_superblock *sb, int group, int *runs, int *largest) {
+	unsigned char bmap[BLOCK_SIZE];
+	struct group_desc gd;
+	int size, run = 0;
+
+	read_group(sb, group, &gd);
+	block_read((os_size + 2) + gd.block_bmap, bmap);
+	size = sb->nblocks - (sb->first_group + group * sb->group_blocks);
+	if (size > sb->group_blocks)
+		size = sb->group_blocks;
+
+	*runs = 0;
+	*largest = 0;
+	for (int i = 0; i < size; i++) {
+		if (bmap[i / 8] & (0x80 >> (i % 8))) {
+			run = 0;
+			continue;
+		}
+		if (run++ == 0)
+			(*runs)++;
+		if (run > *largest)
+			*largest = run;
+	}
+}
+
+static int open_image(char *image) {
+	unsigned char boot[BLOCK_SIZE];
+	FILE *fp;
+	int is_boot = 0;
+
+	if ((fp = fopen(image, "r")) == NULL && (fp = fopen(image, "w")) == NULL)
+		error("%s: ", image);
+	if (fread(boot, BLOCK_SIZE, 1, fp) == 1 && boot[510] == 0x55 && boot[511] == 0xaa) {
+		os_size = boot[OS_SIZE_LOC] | (boot[OS_SIZE_LOC + 1] << 8);
+		is_boot = 1;
+	}
+	fclose(fp);
+
+	block_image = image;
+	return is_boot;
+}
+
+static void read_super(struct disk_superblock *sb) {
+	block_read_part(os_size + 2, 0, sizeof(*sb), sb);
+}
+
+static void read_group(struct disk_superblock *sb, int group, struct group_desc *gd) {
+	int per_blk = BLOCK_SIZE / sizeof(*gd);
+
+	block_read_part((os_size + 2) + sb->gdt_blk + group / per_blk, (group % per_blk) * sizeof(*gd), sizeof(*gd), gd);
+}
+
+static void usage(char *tool, char *args) {
+	fprintf(stderr, "Usage: %s %s\n", tool, args);
+}
+
+/* print an error message and exit */
+static void error(char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	if (errno != 0) {
+		perror(NULL);
+	}
+	exit(EXIT_FAILURE);
+}
@@ -1,3 +1,4 @@
+#include "fs.h"
 #include "interrupt.h"
 #include "kernel.h"
 #include "scheduler.h"
@@ -106,6 +107,9 @@ void setup_current_running(void) {
  * not be scheduled in the future
  */
 void exit(void) {
+	/* Close the files the process left open */
+	fs_exit();
+
 	enter_critical();
 	current_running->status = EXITED;
 	/* Removes job from ready queue, and dispatchs next job to run */
@@ -273,6 +273,28 @@ int main(void) {
 				continue;
 			}
 		}
+		else if (same_string("sync", argv[0])) {
+			if (argc == 1) {
+				if ((ev = fs_sync()) < 0)
+					shprintf(" : error occured.\n");
+			}
+			else {
+				shprintf("usage: %s\n", argv[0]);
+				continue;
+			}
+		}
+		else if (same_string("fsck", argv[0])) {
+			if (argc == 1) {
+				if ((ev = fs_fsck()) < 0)
+					shprintf(" : error occured.\n");
+				else if (ev > 0)
+					shprintf("fsck: %d problems repaired\n", ev);
+			}
+			else {
+				shprintf("usage: %s\n", argv[0]);
+				continue;
+			}
+		}
 		else {
 			shprintf("%s : Command not found.\n", argv[0]);
 		}
@@ -423,8 +445,8 @@ static void change_cwd(char *cwd, char *path) {
  * TODO: sort files.
  */
 static void ls(char *cwd) {
-	int fd, ev;
-	struct dirent de;
+	int fd, ev, i;
+	struct dirent de[DIRENTS_PER_BLK];
 
 	if ((fd = fs_open(cwd, MODE_RDONLY)) < 0) {
 		shprintf("ls: Could not open directory\n");
@@ -432,13 +454,15 @@ static void ls(char *cwd) {
 	}
 
 	while (1) {
-		ev = fs_read(fd, (char *)&de, sizeof(struct dirent));
-		if (ev < 0)
+		ev = fs_getdents(fd, (char *)de, sizeof(de));
+		if (ev < 0) {
 			shprintf(" : error occured.\n");
+			break;
+		}
 		else if (ev == 0)
 			break;
-		else
-			shprintf("%s %d\n", de.name, de.inode);
+		for (i = 0; i < ev / (int)sizeof(struct dirent); i++)
+			shprintf("%s %d\n", de[i].name, de[i].inode);
 	}
 
 	if ((ev = fs_close(fd)) < 0)
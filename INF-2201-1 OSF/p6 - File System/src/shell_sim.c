@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "block.h"
 #include "fs.h"
@@ -13,6 +14,8 @@
 #include "util.h"
 
 #define SIZEX 50
+#define BENCH_CHUNK (8 * BLOCK_SIZE) /* bytes per fs_write/fs_read in bench */
+#define DIRTEST_ENTRIES 10000        /* default number of entries made by dirtest */
 
 struct pcb fake_pcb;
 struct pcb *current_running = &fake_pcb;
@@ -32,6 +35,8 @@ static void ls(char *path);
 static void cat(char *filename);
 static void more(char *filename);
 static void stat(char *filename);
+static void bench(int kbytes);
+static void dirtest(int entries);
 
 int os_size = 0;
 
@@ -59,7 +64,21 @@ int main(void) {
 			continue;
 		}
 
-		if (same_string("mkdir", argv[0])) {
+		if (same_string("mkfs", argv[0])) {
+			int hashed = (argc >= 2 && same_string("hashed", argv[1]));
+			if (argc <= 2 + hashed) {
+				int blocks = (argc == 2 + hashed) ? atoi(argv[1 + hashed]) : 0;
+				if ((ev = fs_mkfs(hashed ? FS_DIR_HASHED : FS_DIR_LINEAR, blocks)) < 0)
+					print_fse(ev);
+				else
+					strcpy(cwd, "/");
+			}
+			else {
+				usage(argv[0], " ['hashed'] [blocks]");
+				continue;
+			}
+		}
+		else if (same_string("mkdir", argv[0])) {
 			if (argc == 2) {
 				if ((ev = fs_mkdir(argv[1])) < 0)
 					print_fse(ev);
@@ -156,6 +175,63 @@ int main(void) {
 				continue;
 			}
 		}
+		else if (same_string("bench", argv[0])) {
+			if (argc == 2) {
+				bench(atoi(argv[1]));
+			}
+			else {
+				usage(argv[0], " 'size in KB'");
+			}
+		}
+		else if (same_string("sync", argv[0])) {
+			if (argc == 1) {
+				if ((ev = fs_sync()) < 0)
+					print_fse(ev);
+			}
+			else {
+				usage(argv[0], "");
+			}
+		}
+		else if (same_string("fsck", argv[0])) {
+			if (argc == 1) {
+				if ((ev = fs_fsck()) < 0)
+					print_fse(ev);
+				else if (ev > 0)
+					printf("fsck: %d problems repaired\n", ev);
+			}
+			else {
+				usage(argv[0], "");
+			}
+		}
+		else if (same_string("dirtest", argv[0])) {
+			if (argc <= 2) {
+				dirtest(argc == 2 ? atoi(argv[1]) : DIRTEST_ENTRIES);
+			}
+			else {
+				usage(argv[0], " ['number of entries']");
+			}
+		}
+		else if (same_string("bcache", argv[0])) {
+			if (argc == 1) {
+				int hits, misses;
+				block_cache_stat(&hits, &misses);
+				printf("buffer cache: %d hits, %d misses\n", hits, misses);
+			}
+			else {
+				usage(argv[0], "");
+			}
+		}
+		else if (same_string("dcache", argv[0])) {
+			if (argc == 1) {
+				int hits, misses;
+				fs_dcache_stat(&hits, &misses);
+				printf("directory cache: %d hits, %d misses (%d%% hit rate)\n", hits, misses,
+				       (hits + misses > 0) ? 100 * hits / (hits + misses) : 0);
+			}
+			else {
+				usage(argv[0], "");
+			}
+		}
 		else if (same_string("exit", argv[0])) {
 			if (argc == 1) {
 				block_destruct();
@@ -292,8 +368,8 @@ static void change_cwd(char *cwd, char *path) {
  * TODO: sort files.
  */
 static void ls(char *cwd) {
-	int fd, ev;
-	struct dirent de;
+	int fd, ev, i;
+	struct dirent de[DIRENTS_PER_BLK];
 
 	if ((fd = fs_open(cwd, MODE_RDONLY)) < 0) {
 		printf("ls: Could not open directory\n");
@@ -302,13 +378,15 @@ static void ls(char *cwd) {
 	}
 
 	while (1) {
-		ev = fs_read(fd, (char *)&de, sizeof(struct dirent));
-		if (ev < 0)
+		ev = fs_getdents(fd, (char *)de, sizeof(de));
+		if (ev < 0) {
 			print_fse(ev);
+			break;
+		}
 		else if (ev == 0)
 			break;
-		else
-			printf("\t%d %s\n", de.inode, de.name);
+		for (i = 0; i < ev / (int)sizeof(struct dirent); i++)
+			printf("\t%d %s\n", de[i].inode, de[i].name);
 	}
 
 	if ((ev = fs_close(fd)) < 0)
@@ -392,6 +470,127 @@ static void stat(char *filename) {
 		print_fse(ev);
 }
 
+/* Seconds elapsed since start */
+static double elapsed(struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/* bench - stream a file of 'kbytes' KB through fs_write and fs_read */
+static void bench(int kbytes) {
+	int fd, ev, i, total, bad, hits, misses;
+	char buf[BENCH_CHUNK];
+	struct timeval start;
+	double secs;
+
+	for (i = 0; i < BENCH_CHUNK; i++)
+		buf[i] = 'a' + i % 26;
+
+	fs_unlink("bench");
+	if ((fd = fs_open("bench", MODE_WRONLY | MODE_CREAT)) < 0) {
+		printf("bench: Could not create file\n");
+		print_fse(fd);
+		return;
+	}
+
+	gettimeofday(&start, NULL);
+	for (total = 0; total < kbytes * 1024; total += BENCH_CHUNK) {
+		if ((ev = fs_write(fd, buf, BENCH_CHUNK)) < 0) {
+			printf("bench: fs_write error after %d bytes\n", total);
+			print_fse(ev);
+			break;
+		}
+	}
+	fs_close(fd);
+	secs = elapsed(&start);
+	printf("write: %d KB in %.3f s (%.1f KB/s)\n", total / 1024, secs, total / 1024 / secs);
+
+	if ((fd = fs_open("bench", MODE_RDONLY)) < 0) {
+		printf("bench: Could not open file\n");
+		print_fse(fd);
+		return;
+	}
+
+	gettimeofday(&start, NULL);
+	total = 0;
+	bad = 0;
+	while ((ev = fs_read(fd, buf, BENCH_CHUNK)) > 0) {
+		for (i = 0; i < ev; i++)
+			if (buf[i] != 'a' + ((total + i) % BENCH_CHUNK) % 26)
+				bad++;
+		total += ev;
+	}
+	fs_close(fd);
+	secs = elapsed(&start);
+	printf("read: %d KB in %.3f s (%.1f KB/s)\n", total / 1024, secs, total / 1024 / secs);
+	if (bad > 0)
+		printf("bench: %d bad bytes read back\n", bad);
+
+	block_cache_stat(&hits, &misses);
+	printf("buffer cache: %d hits, %d misses\n", hits, misses);
+
+	fs_unlink("bench");
+}
+
+/*
+ * dirtest - add 'entries' links to one file in the current directory,
+ * look every one of them up and remove them again
+ */
+static void dirtest(int entries) {
+	int fd, ev, i, made, bad, hits, misses, reads;
+	char name[MAX_FILENAME_LEN];
+	struct timeval start;
+	double secs;
+
+	if ((fd = fs_open("dirtest", MODE_WRONLY | MODE_CREAT)) < 0) {
+		printf("dirtest: Could not create file\n");
+		print_fse(fd);
+		return;
+	}
+	fs_close(fd);
+
+	block_cache_stat(&hits, &reads);
+	gettimeofday(&start, NULL);
+	for (made = 0; made < entries; made++) {
+		snprintf(name, sizeof(name), "d%d", made);
+		if ((ev = fs_link("dirtest", name)) < 0) {
+			printf("dirtest: fs_link failed after %d entries\n", made);
+			print_fse(ev);
+			break;
+		}
+	}
+	secs = elapsed(&start);
+	block_cache_stat(&hits, &misses);
+	printf("create: %d entries in %.3f s, %d block reads\n", made, secs, misses - reads);
+
+	reads = misses;
+	bad = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < made; i++) {
+		snprintf(name, sizeof(name), "d%d", i);
+		if ((fd = fs_open(name, MODE_RDONLY)) < 0)
+			bad++;
+		else
+			fs_close(fd);
+	}
+	secs = elapsed(&start);
+	block_cache_stat(&hits, &misses);
+	printf("lookup: %d entries in %.3f s, %d block reads\n", made, secs, misses - reads);
+	if (bad > 0)
+		printf("dirtest: %d entries not found\n", bad);
+
+	for (i = 0; i < made; i++) {
+		snprintf(name, sizeof(name), "d%d", i);
+		if ((ev = fs_unlink(name)) < 0) {
+			printf("dirtest: fs_unlink failed on %s\n", name);
+			print_fse(ev);
+		}
+	}
+	fs_unlink("dirtest");
+}
+
 /* Print file system error value */
 static void print_fse(int ev) {
 	printf("File system error value: %d\n", ev);
@@ -6,45 +6,75 @@
  *
  * The filesystem layout looks like this:
  *
- * +-------------+-----------------------------+-/
- * | Super block |  Inode & data bitmap block  |
- * +-------------+-----------------------------+-/
+ * +-------------+---------+--------------+---------+-//-+---------+
+ * | Super block | Journal | Group desc.  | Group 0 |    | Group n |
+ * +-------------+---------+--------------+---------+-//-+---------+
  *
- * <------ Inode area ----> <-------- Data block area -------->
- * /--------+-//-+---------+--------------+-//-+--------------+
- *  Inode 1 |    | Inode n | Data block 1 |    | Data block n |
- * /--------+-//-+---------+--------------+-//-+--------------+
+ * Every block group looks like this:
+ *
+ * +--------------+--------------+-------------+------------------+
+ * | Block bitmap | Inode bitmap | Inode table | Data blocks ...  |
+ * +--------------+--------------+-------------+------------------+
+ *
+ * A group has group_blocks blocks (the last one may be smaller) and
+ * group_inodes inodes, inode n lives in group n / group_inodes. The
+ * block bitmap covers every block of its group, the group's own
+ * bitmaps and inode table included. The group descriptor table
+ * (gdt_blk) holds where the bitmaps and inode table of each group
+ * are, and how many blocks and inodes are free in it, so allocation
+ * only looks at the bitmaps of groups with room.
  *
  * The member max_filesize is:
- * BLOCK_SIZE * (NDIRECT + (BLOCK_SIZE / sizeof(blknum_t))) = 1056KB
- * at present.
+ * BLOCK_SIZE * (NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT)
+ * = 512 * (11 + 128 + 16384) bytes, about 8.5MB, at present, where
+ * NINDIRECT = BLOCK_SIZE / sizeof(blknum_t).
+ *
+ * The root directory is inode 0.
+ *
+ * The dir_format member is the layout of every directory, chosen
+ * when the filesystem is made (FS_DIR_LINEAR or FS_DIR_HASHED).
  *
- * The root_inode member gives the block number on disk where the
- * inode for the root directory of this filesystem resides.
+ * Metadata changes are written to the journal (journal_len blocks
+ * from block journal_blk) before they are written in place.
  */
 
 #include "fstypes.h"
 
 struct disk_superblock {
 	short magic;		 /* magic number, use to check if filestem exists */
-	short ninodes;       /* number of index nodes in the filesystem */
-	short ndata_blks;    /* number of data blocks */
-	blknum_t root_inode; /* block number of inode for the root dir */
-	blknum_t root_bmap;	 /* block number of bmap */
-	short max_filesize;  /* the size of the largest file */
+	short dir_format;    /* directory layout, see fs_mkfs */
+	int ninodes;         /* number of index nodes in use */
+	int ndata_blks;      /* number of blocks in use in the groups */
+	int nblocks;         /* size of the filesystem in blocks */
+	int ngroups;         /* number of block groups */
+	int group_blocks;    /* blocks per group */
+	int group_inodes;    /* inodes per group */
+	blknum_t gdt_blk;    /* block number of the group descriptor table */
+	blknum_t first_group; /* block number of group 0 */
+	int max_filesize;    /* the size of the largest file */
+	blknum_t journal_blk; /* block number of the journal */
+	int journal_len;      /* number of journal blocks */
 };
 
 #define SUPERBLK_SIZE 1
+
+/* An entry of the group descriptor table */
+struct group_desc {
+	blknum_t block_bmap;  /* block number of the block bitmap */
+	blknum_t inode_bmap;  /* block number of the inode bitmap */
+	blknum_t inode_table; /* block number of the first inode table block */
+	short free_blocks;    /* blocks not in use */
+	short free_inodes;    /* inodes not in use */
+};
+
 /*
  * The superblock as used in memory. The dirty member is true if
- * filesystem metadata needs to be updated (happens when one of the
- * inode bitmaps is changed).
+ * filesystem metadata needs to be updated.
  */
 
 struct mem_superblock {
 	struct disk_superblock d_super;
-	void *ibmap; /* bitmap for inodes */
-	void *dbmap; /* bitmap for data blocks */
+	struct group_desc *gdt; /* group descriptor table */
 	char dirty;
 };
 
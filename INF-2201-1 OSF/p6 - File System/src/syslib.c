@@ -82,8 +82,8 @@ void loadproc(int location, int size) {
  * File system function calls. Read fs.h for details.
  */
 
-void fs_mkfs(void) {
-	invoke_syscall(SYSCALL_FS_MKFS, IGNORE, IGNORE, IGNORE);
+int fs_mkfs(int dir_format, int nblocks) {
+	return invoke_syscall(SYSCALL_FS_MKFS, dir_format, nblocks, IGNORE);
 }
 
 int fs_open(const char *filename, int mode) {
@@ -102,6 +102,18 @@ int fs_write(int handle, char *buffer, int size) {
 	return invoke_syscall(SYSCALL_FS_WRITE, handle, (int)buffer, size);
 }
 
+int fs_readv(int handle, struct iovec *iov, int iovcnt) {
+	return invoke_syscall(SYSCALL_FS_READV, handle, (int)iov, iovcnt);
+}
+
+int fs_writev(int handle, struct iovec *iov, int iovcnt) {
+	return invoke_syscall(SYSCALL_FS_WRITEV, handle, (int)iov, iovcnt);
+}
+
+int fs_mmap(int handle, int offset, int len) {
+	return invoke_syscall(SYSCALL_FS_MMAP, handle, offset, len);
+}
+
 int fs_lseek(int handle, int offset, int origin) {
 	return invoke_syscall(SYSCALL_FS_LSEEK, handle, offset, origin);
 }
@@ -118,6 +130,18 @@ int fs_stat(int handle, char *buffer) {
 	return invoke_syscall(SYSCALL_FS_STAT, handle, (int)buffer, IGNORE);
 }
 
+int fs_getdents(int handle, char *buffer, int size) {
+	return invoke_syscall(SYSCALL_FS_GETDENTS, handle, (int)buffer, size);
+}
+
+int fs_fsck(void) {
+	return invoke_syscall(SYSCALL_FS_FSCK, IGNORE, IGNORE, IGNORE);
+}
+
+int fs_sync(void) {
+	return invoke_syscall(SYSCALL_FS_SYNC, IGNORE, IGNORE, IGNORE);
+}
+
 int fs_mkdir(char *dir_name) {
 	return invoke_syscall(SYSCALL_FS_MKDIR, (int)dir_name, IGNORE, IGNORE);
 }
@@ -8,6 +8,8 @@ enum
 	IGNORE = 0
 };
 
+struct iovec;
+
 /* Prototypes for exported system calls */
 void yield(void);
 void exit(void);
@@ -23,14 +25,20 @@ int mbox_send(int q, msg_t *m);
 int getchar(int *c);
 int readdir(unsigned char *buf);
 void loadproc(int location, int size);
-void fs_mkfs(void);
+int fs_mkfs(int dir_format, int nblocks);
 int fs_open(const char *filename, int mode);
 int fs_close(int fd);
 int fs_read(int fd, char *buffer, int size);
 int fs_write(int fd, char *buffer, int size);
+int fs_readv(int fd, struct iovec *iov, int iovcnt);
+int fs_writev(int fd, struct iovec *iov, int iovcnt);
+int fs_mmap(int fd, int offset, int len);
 int fs_lseek(int fd, int offset, int whence);
 int fs_link(char *linkname, char *filename);
 int fs_unlink(char *linkname);
 int fs_stat(int fd, char *buffer);
+int fs_getdents(int fd, char *buffer, int size);
+int fs_fsck(void);
+int fs_sync(void);
 
 #endif /* !SYSLIB_H */
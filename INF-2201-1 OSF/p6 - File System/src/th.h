@@ -10,6 +10,15 @@ void clock_thread(void);
 /* Scans USB hub ports */
 void usb_thread(void);
 
+/* Serves the queued disk requests */
+void io_thread(void);
+
+/* Reads file blocks into the buffer cache ahead of use */
+void readahead_thread(void);
+
+/* Periodically writes buffered file data to disk */
+void flusher_thread(void);
+
 /* Threads to test the condition variables and locks */
 void thread2(void);
 void thread3(void);
@@ -13,6 +13,7 @@
 #include "util.h"
 
 #define MHZ 2000 /* CPU clock rate */
+#define FLUSH_INTERVAL 5000 /* ms between periodic fs_sync calls */
 
 /*
  * This thread is started to load the user shell, which is the first
@@ -65,3 +66,31 @@ void usb_thread(void) {
 		usb_hub_scan_ports();
 	}
 }
+
+/*
+ * This thread sends the requests queued by scsi_read, scsi_write and
+ * scsi_submit to the USB stick.
+ */
+void io_thread(void) {
+	while (1)
+		scsi_serve();
+}
+
+/*
+ * This thread serves the readahead requests queued by fs_read.
+ */
+void readahead_thread(void) {
+	while (1)
+		fs_readahead();
+}
+
+/*
+ * This thread writes data buffered by fs_write to disk every
+ * FLUSH_INTERVAL ms, so it does not wait for fs_close.
+ */
+void flusher_thread(void) {
+	while (1) {
+		msleep(FLUSH_INTERVAL);
+		fs_sync();
+	}
+}
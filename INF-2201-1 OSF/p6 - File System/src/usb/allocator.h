@@ -1,8 +1,9 @@
 #ifndef ALLOCATOR_H
 #define ALLOCATOR_H
 
-#define KERNEL_ALLOC_START 0x030000     /* Mem page top value    */
-#define KERNEL_ALLOC_STOP  0x040000
+/* Above the kernel thread stacks (STACK_MAX), below the BIOS data */
+#define KERNEL_ALLOC_START 0x08C000     /* Mem page top value    */
+#define KERNEL_ALLOC_STOP  0x09C000
   
 void *kzalloc(int size);
 void *kzalloc_align(int size, int alignment);
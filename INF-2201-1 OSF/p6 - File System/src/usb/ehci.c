@@ -1,12 +1,428 @@
+#include "../util.h"
+#include "../scheduler.h"
+#include "../interrupt.h"
 #include "ehci.h"
+#include "usb.h"
 #include "usb_hub.h"
+#include "allocator.h"
+#include "error.h"
 #include "debug.h"
 
-#undef DEBUG_NAME
-#define DEBUG_NAME "EHCI"
+DEBUG_NAME("EHCI");
 
-int ehci_read_write() {
+/* Most data one qTD carries (a page aligned buffer) */
+#define EHCI_QTD_MAX_SIZE (EHCI_TD_PAGES * 4096)
 
+/*
+ * Build a queue element transfer descriptor for size bytes of data,
+ * which must lie within five pages (EHCI spec. 3.5)
+ */
+static struct ehci_queue_transfer_descriptor *
+qtd_build(struct usb_pipe *pipe, int pid, int size, char *data) {
+  struct ehci_queue_transfer_descriptor *qtd;
+  uint32_t page;
+  int i;
+
+  /* The EHCI wants qTDs 32 byte aligned (EHCI spec. 3.5) */
+  qtd = kzalloc_align(sizeof(struct ehci_queue_transfer_descriptor), 32);
+  if (qtd == NULL)
+    return NULL;
+
+  qtd->next_qtd = EHCI_LP_TERMINATE;
+  /* A short packet ends an IN transfer, see qtd_chain_status */
+  if (pid == EHCI_PID_IN)
+    qtd->alternate_qtd = (uint32_t)((struct ehci *)pipe->udev->hc)->stop_qtd;
+  else
+    qtd->alternate_qtd = EHCI_LP_TERMINATE;
+
+  qtd->token =
+    pipe->toggle_bit << EHCI_TD_DATA_TOGGLE_OFF | /* Toggle bit        */
+    size << EHCI_TD_TOTAL_SIZE_OFF |              /* Transfer size     */
+    3 << EHCI_TD_CERR_OFF |                       /* Allow up to three errors */
+    pid << EHCI_TD_PID_OFF |                      /* SETUP, IN, or OUT */
+    EHCI_STATUS_ACTIVE;
+
+  /* The first pointer keeps the offset, the others are page aligned */
+  qtd->buffer_pointer[0] = (uint32_t)data;
+  page = (uint32_t)data & EHCI_TD_BPOINTER_MASK;
+  for (i = 1; i < EHCI_TD_PAGES; i++)
+    qtd->buffer_pointer[i] = page + i * 4096;
+
+  return qtd;
+}
+
+static void qtd_free_chain(struct ehci_queue_transfer_descriptor *qtd) {
+  struct ehci_queue_transfer_descriptor *next;
+
+  while (qtd != NULL) {
+    next = (qtd->next_qtd & EHCI_LP_TERMINATE) ? NULL :
+      (struct ehci_queue_transfer_descriptor *)qtd->next_qtd;
+    kfree(qtd);
+    qtd = next;
+  }
+}
+
+/*
+ * Returns the cumulative status of a qTD chain and, in left, the bytes
+ * the controller has not transferred. A qTD that is done with bytes
+ * left (a short packet or a halt) ends the chain: after a short packet
+ * the controller goes on to stop_qtd, so the qTDs behind it never run.
+ */
+static uint32_t qtd_chain_status(struct ehci_queue_transfer_descriptor *qtd,
+                                 int *left) {
+  uint32_t status = 0;
+  int stopped = 0;
+  int bytes;
+
+  *left = 0;
+  while (1) {
+    bytes = (qtd->token >> EHCI_TD_TOTAL_SIZE_OFF) & EHCI_TD_TOTAL_SIZE_MASK;
+    *left += bytes;
+    if (!stopped) {
+      status |= qtd->token;
+      stopped = (qtd->token & EHCI_STATUS_ACTIVE) == 0 && bytes > 0;
+    }
+    if (qtd->next_qtd & EHCI_LP_TERMINATE)
+      break;
+    qtd = (struct ehci_queue_transfer_descriptor *)qtd->next_qtd;
+  }
+
+  return status & EHCI_TD_STATUS_MASK;
+}
+
+/*
+ * Every pipe gets its own QH on the asynchronous schedule the first
+ * time it is used, and keeps it. Between transfers the QH has no
+ * active qTD, so the controller only passes over it.
+ */
+static struct ehci_queue_head *qh_get(struct ehci *eh, struct usb_pipe *pipe) {
+  struct ehci_queue_head *qh = pipe->xfer;
+
+  if (qh != NULL)
+    return qh;
+
+  /* 128 byte alignment keeps the QH within a page */
+  qh = kzalloc_align(sizeof(struct ehci_queue_head), 128);
+  if (qh == NULL)
+    return NULL;
+
+  qh->ep_cap = 1 << EHCI_QH_MULT_OFF;
+  qh->overlay.next_qtd = EHCI_LP_TERMINATE;
+  qh->overlay.alternate_qtd = EHCI_LP_TERMINATE;
+  /* Skipped by the controller until the first transfer */
+  qh->overlay.token = EHCI_STATUS_HALTED;
+
+  /* Put it on the schedule right after the head, with a single write */
+  spinlock_acquire(&eh->xfer_qh_lock);
+  qh->horiz_lp = eh->async_qh->horiz_lp;
+  eh->async_qh->horiz_lp = (uint32_t)qh | EHCI_LP_QH;
+  spinlock_release(&eh->xfer_qh_lock);
+
+  pipe->xfer = qh;
+
+  return qh;
+}
+
+/*
+ * Read/write operation over USB pipes
+ *
+ * The transfer is split into qTDs of up to 20kB that are chained on
+ * the pipe QH. The controller splits each qTD into packets. On bulk
+ * pipes the QH keeps the data toggle from packet to packet (DTC=0),
+ * it is loaded from the pipe before and read back after the transfer,
+ * so it follows the packets that really went, also after a short
+ * packet or a halt. Control transfers set the toggle of each stage,
+ * so their qTDs carry it (DTC=1). The qTDs of all n buffers form one
+ * chain.
+ */
+static int ehci_read_write(struct usb_pipe *pipe, int pid,
+                           int n, struct usb_buffer *bufs) {
+  struct ehci_queue_transfer_descriptor *qtd, *first = NULL, *last = NULL;
+  struct ehci_queue_head *qh;
+  struct ehci *eh;
+  uint32_t status;
+  int remaining_size, size = 0;
+  int qtd_size, packets, left;
+  int bulk = pipe->attributes == USB_PIPE_DATA_BULK;
+  char *data;
+  int err = 0;
+  int i;
+
+  eh = (struct ehci *)pipe->udev->hc;
+
+  /*
+   * SETUP packet always sets the toggle bit to 0
+   * for host controller and device
+   */
+  if (pid == EHCI_PID_SETUP)
+    pipe->toggle_bit = 0;
+
+  if ((qh = qh_get(eh, pipe)) == NULL)
+    return ERR_NO_MEM;
+
+  for (i = 0; i < n; i++) {
+    remaining_size = bufs[i].size;
+    data = bufs[i].data;
+    size += remaining_size;
+
+    /* Transfers must also handle packets with size 0 */
+    do {
+      /* All but the last qTD of a buffer carry whole packets */
+      qtd_size = EHCI_QTD_MAX_SIZE - ((uint32_t)data & ~EHCI_TD_BPOINTER_MASK);
+      if (remaining_size <= qtd_size)
+        qtd_size = remaining_size;
+      else
+        qtd_size -= qtd_size % pipe->max_packet_size;
+      remaining_size -= qtd_size;
+
+      qtd = qtd_build(pipe, pid, qtd_size, data);
+      data += qtd_size;
+
+      if (qtd == NULL) {
+        err = ERR_NO_MEM;
+        goto error_ehci_rw;
+      }
+
+      /* The toggle of the next qTD, bulk QHs keep their own */
+      packets = qtd_size == 0 ? 1 :
+        (qtd_size + pipe->max_packet_size - 1) / pipe->max_packet_size;
+      if (!bulk && (packets & 1))
+        pipe->toggle_bit = 1 - pipe->toggle_bit;
+
+      if (first == NULL)
+        first = qtd;
+      else
+        last->next_qtd = (uint32_t)qtd;
+      last = qtd;
+    } while (remaining_size > 0);
+  }
+
+  /* Nothing to put on the schedule (n == 0) */
+  if (last == NULL) {
+    err = ERR_PROTO;
+    goto error_ehci_rw;
+  }
+
+  /* The last qTD interrupts on completion, see the wait below */
+  last->token |= 1 << EHCI_TD_IOC_OFF;
+
+  /*
+   * The QH is idle, so it can be updated: the address and the packet
+   * size change while the device is enumerated, and a halt cleared on
+   * the device restarts the toggle of a bulk pipe.
+   */
+  qh->ep_char =
+    pipe->max_packet_size << EHCI_QH_MAX_PACKET_LEN_OFF |
+    (bulk ? 0 : 1) << EHCI_QH_DTC_OFF |
+    EHCI_QH_EPS_HS << EHCI_QH_EPS_OFF |
+    pipe->ep_address << EHCI_QH_ENDPT_OFF |
+    pipe->udev->address;
+  qh->overlay.next_qtd = (uint32_t)first;
+  qh->overlay.alternate_qtd = EHCI_LP_TERMINATE;
+  /*
+   * Clearing the token also clears a halt left by an earlier transfer,
+   * and with no bytes left the controller takes next_qtd rather than
+   * the alternate pointer of a qTD that ended short
+   */
+  qh->overlay.token = bulk ? pipe->toggle_bit << EHCI_TD_DATA_TOGGLE_OFF : 0;
+
+  /*
+   * Wait until all qTDs are executed. The last qTD raises an interrupt
+   * on completion and an error raises one at once, so ehci_interrupt
+   * wakes us when there is something to check. Interrupts stay off
+   * from the status check until we are blocked, so the wakeup cannot
+   * be lost.
+   */
+  enter_critical();
+  while (((status = qtd_chain_status(first, &left)) & EHCI_STATUS_ACTIVE) != 0 &&
+         (status & EHCI_STATUS_HALTED) == 0)
+    block(&eh->xfer_waiting, NULL);
+  leave_critical();
+
+  if (bulk)
+    pipe->toggle_bit = (qh->overlay.token >> EHCI_TD_DATA_TOGGLE_OFF) & 1;
+
+  /*
+   * A halt without other error bits is a STALL handshake. Otherwise
+   * we return the number of transmitted bytes.
+   */
+  if ((status & EHCI_STATUS_HALTED) != 0)
+    err = (status & (EHCI_STATUS_DATA_BUFFER | EHCI_STATUS_BABBLE |
+                     EHCI_STATUS_XACTERR)) ? ERR_XFER : ERR_DEV_STALLED;
+  else
+    err = size - left;
+
+  DEBUG("qTD status %02x, %d bytes", status, size - left);
+
+error_ehci_rw:
+  qtd_free_chain(first);
+
+  return err;
+}
+
+/* Standard read write EHCI functions */
+static int ehci_read(struct usb_pipe *pipe, int size, char *data) {
+  struct usb_buffer buf = {size, data};
+
+  return ehci_read_write(pipe, EHCI_PID_IN, 1, &buf);
+}
+
+static int ehci_write(struct usb_pipe *pipe, int size, char *data) {
+  struct usb_buffer buf = {size, data};
+
+  return ehci_read_write(pipe, EHCI_PID_OUT, 1, &buf);
+}
+
+static int ehci_transfer(struct usb_pipe *pipe, int n, struct usb_buffer *bufs) {
+  return ehci_read_write(pipe, pipe->direction == USB_PIPE_DIR_IN ?
+                         EHCI_PID_IN : EHCI_PID_OUT, n, bufs);
+}
+
+static int ehci_setup(struct usb_pipe *pipe, struct usb_dev_setup_request *data) {
+  struct usb_buffer buf = {8, (char *)data};  /* Setup packet size is always 8B */
+
+  return ehci_read_write(pipe, EHCI_PID_SETUP, 1, &buf);
+}
+
+static uint8_t ehci_get_next_address(struct usb_dev *udev) {
+  struct ehci *eh = (struct ehci *)udev->hc;
+  uint8_t address;
+
+  address = eh->next_address;
+  eh->next_address++;
+
+  return address;
+}
+
+/*
+ * Interrupt transfers need the periodic schedule, which this driver
+ * does not set up. Keyboards are low or full speed devices, and those
+ * are handed to the companion UHCI (see ehci_port_status).
+ */
+static int ehci_register_interrupt_h(struct usb_interrupt *ui) {
+  return ERR_PROTO;
+}
+
+static int ehci_remove_interrupt_h(struct usb_interrupt *ui) {
+  return 0;
+}
+
+/*
+ * This function gets called when the EHCI issues an interrupt
+ */
+void ehci_interrupt(struct ehci *eh) {
+  uint32_t int_status;
+
+  /* The interrupt line may be shared with the companion controllers */
+  int_status = eh->opreg_base[EHCI_USBSTS] & EHCI_STS_INT_MASK;
+  if (int_status == 0)
+    return;
+
+  /* Writing the status bits back clears them */
+  eh->opreg_base[EHCI_USBSTS] = int_status;
+
+  /* A transfer has completed or failed, let its waiter check it */
+  if ((int_status & (EHCI_STS_USBINT | EHCI_STS_USBERRINT)) != 0)
+    while (eh->xfer_waiting != NULL)
+      unblock(&eh->xfer_waiting);
+}
+
+/*
+ *
+ * Implementation of hub operations
+ *
+ */
+static uint32_t ehci_port_read(struct ehci *eh, int port) {
+  return eh->opreg_base[EHCI_PORTSC + port];
+}
+
+/* Sets and clears bits without touching the write-clear change bits */
+static void ehci_port_write(struct ehci *eh, int port,
+                            uint32_t set, uint32_t clear) {
+  uint32_t status;
+
+  status = ehci_port_read(eh, port) & ~EHCI_PORTSC_CHANGE_MASK;
+  eh->opreg_base[EHCI_PORTSC + port] = (status | set) & ~clear;
+}
+
+void ehci_port_command(struct usb_hub *uhub, int port,
+                       enum uhub_port_command_e command) {
+  struct ehci *eh = (struct ehci *)uhub->hc;
+  int i;
+
+  switch(command) {
+    case USB_PORT_RESET:
+      /* The port must be disabled when the reset starts */
+      ehci_port_write(eh, port, EHCI_PORTSC_RESET, EHCI_PORTSC_ENABLE);
+      break;
+    case USB_PORT_CLEAR_RESET:
+      /* The controller ends the reset within 2ms */
+      ehci_port_write(eh, port, 0, EHCI_PORTSC_RESET);
+      for (i = 0; i < 10 && (ehci_port_read(eh, port) & EHCI_PORTSC_RESET); i++)
+        ms_delay(1);
+      break;
+    case USB_PORT_ENABLE:
+      /* The controller enables a high speed port at the end of reset */
+      break;
+    case USB_PORT_DISABLE:
+      ehci_port_write(eh, port, 0, EHCI_PORTSC_ENABLE);
+      break;
+    case USB_PORT_CLEAR_SUSPEND:
+      if (ehci_port_read(eh, port) & EHCI_PORTSC_SUSPEND) {
+        ehci_port_write(eh, port, EHCI_PORTSC_RESUME, 0);
+        ms_delay(20);
+        ehci_port_write(eh, port, 0, EHCI_PORTSC_RESUME);
+      }
+      break;
+    default:
+      break;
+  }
+  return;
+}
+
+/*
+ * A new connection is kept by this controller if the device is high
+ * speed, and handed to the companion UHCI otherwise, which then sees
+ * it as its own connection. A low speed device shows as a K state on
+ * the idle line, a full speed device as a port that stays disabled
+ * after reset (EHCI spec. 4.2.2).
+ */
+enum port_status_e ehci_port_status(struct usb_hub *uhub, int port) {
+  struct ehci *eh = (struct ehci *)uhub->hc;
+  uint32_t status;
+
+  status = ehci_port_read(eh, port);
+  if ((status & (EHCI_PORTSC_CONNECT_CHANGE | EHCI_PORTSC_OWNER)) ==
+      EHCI_PORTSC_CONNECT_CHANGE) {
+    ehci_port_write(eh, port, EHCI_PORTSC_CONNECT_CHANGE, 0);
+    if ((status & EHCI_PORTSC_CONNECT) != 0) {
+      if ((status & EHCI_PORTSC_LINE_STATUS) != EHCI_PORTSC_LINE_K) {
+        ehci_port_command(uhub, port, USB_PORT_RESET);
+        ms_delay(50);
+        ehci_port_command(uhub, port, USB_PORT_CLEAR_RESET);
+      }
+      status = ehci_port_read(eh, port);
+      if ((status & EHCI_PORTSC_ENABLE) == 0) {
+        DEBUG("Port %d handed to the companion controller", port);
+        ehci_port_write(eh, port, EHCI_PORTSC_OWNER, 0);
+        return USB_PORT_DISCONNECTED;
+      }
+    }
+  }
+
+  if ((status & (EHCI_PORTSC_CONNECT | EHCI_PORTSC_OWNER)) != EHCI_PORTSC_CONNECT)
+    return USB_PORT_DISCONNECTED;
+  if ((status & EHCI_PORTSC_ENABLE) == 0)
+    return USB_PORT_DISABLED;
+  if ((status & EHCI_PORTSC_SUSPEND) != 0)
+    return USB_PORT_SUSPENDED;
+
+  return USB_PORT_ENABLED;
+}
+
+/* Only high speed devices stay on EHCI ports */
+enum usb_speed_class_e ehci_port_speed(struct usb_hub *uhub, int port) {
+  return USB_HS_DEV;
 }
 
 /* Hub operations */
@@ -20,25 +436,104 @@ struct usb_hub_ops ehci_hub_ops = {
 struct usb_hc_ops ehci_hc_ops = {
   .read = ehci_read,
   .write = ehci_write,
+  .transfer = ehci_transfer,
   .setup = ehci_setup,
   .get_next_addr = ehci_get_next_address,
-  .register_interrupt_h = ehci_register_interrupt_h
+  .register_interrupt_h = ehci_register_interrupt_h,
+  .remove_interrupt_h = ehci_remove_interrupt_h
 };
 
+/*
+ * Initialisation of EHCI driver
+ * EHCI performs two tasks:
+ *  1) manages high speed transmission over USB
+ *  2) acts as a root hub
+ *
+ * Before calling this function the PCI EHCI sets
+ * capreg_base to point to the memory mapped registers
+ * of this EHCI.
+ */
 int ehci_init(struct ehci *eh) {
+  volatile uint32_t *opreg;
   struct usb_hub *root_hub;
+  uint32_t hcs_params;
+  int i;
+
+  opreg = (volatile uint32_t *)(eh->capreg_base + eh->capreg_base[EHCI_CAPLENGTH]);
+  eh->opreg_base = opreg;
+  hcs_params = *(volatile uint32_t *)(eh->capreg_base + EHCI_HCSPARAMS);
+  eh->port_num = hcs_params & EHCI_HCSPARAMS_N_PORTS;
+
+  DEBUG("Initialising EHCI at %x with %d ports", eh->capreg_base, eh->port_num);
+
+  /* Stop and reset the controller */
+  opreg[EHCI_USBCMD] &= ~EHCI_CMD_RUN;
+  for (i = 0; i < 20 && (opreg[EHCI_USBSTS] & EHCI_STS_HALTED) == 0; i++)
+    ms_delay(1);
+  opreg[EHCI_USBCMD] = EHCI_CMD_HCRESET;
+  for (i = 0; i < 100 && (opreg[EHCI_USBCMD] & EHCI_CMD_HCRESET) != 0; i++)
+    ms_delay(1);
+
+  /*
+   * The head of the asynchronous schedule (H bit) never has a
+   * transfer, pipe QHs are linked in behind it by qh_get
+   */
+  eh->async_qh = kzalloc_align(sizeof(struct ehci_queue_head), 128);
+  if (eh->async_qh == NULL)
+    return ERR_NO_MEM;
+
+  eh->async_qh->horiz_lp = (uint32_t)eh->async_qh | EHCI_LP_QH;
+  eh->async_qh->ep_char =
+    1 << EHCI_QH_H_OFF | EHCI_QH_EPS_HS << EHCI_QH_EPS_OFF;
+  eh->async_qh->overlay.next_qtd = EHCI_LP_TERMINATE;
+  eh->async_qh->overlay.alternate_qtd = EHCI_LP_TERMINATE;
+  eh->async_qh->overlay.token = EHCI_STATUS_HALTED;
+
+  /* Never active, so a queue that reaches it goes idle */
+  eh->stop_qtd = kzalloc_align(sizeof(struct ehci_queue_transfer_descriptor), 32);
+  if (eh->stop_qtd == NULL)
+    return ERR_NO_MEM;
+  eh->stop_qtd->next_qtd = EHCI_LP_TERMINATE;
+  eh->stop_qtd->alternate_qtd = EHCI_LP_TERMINATE;
+
+  /* Initialise spin lock */
+  spinlock_init(&eh->xfer_qh_lock);
+
+  /* Setup address enumeration */
+  eh->next_address = 1;
+
+  /* Nobody waits for a transfer yet */
+  eh->xfer_waiting = NULL;
+
+  /* All data structures lie in the first 4GB */
+  opreg[EHCI_CTRLDSSEGMENT] = 0;
+  opreg[EHCI_ASYNCLISTADDR] = (uint32_t)eh->async_qh;
+
+  /* Enable interrupts on complete and on transfer errors */
+  opreg[EHCI_USBINTR] = EHCI_STS_USBINT | EHCI_STS_USBERRINT;
+
+  /* Run the asynchronous schedule, interrupts each micro-frame */
+  opreg[EHCI_USBCMD] = 1 << EHCI_CMD_ITC_OFF | EHCI_CMD_ASE | EHCI_CMD_RUN;
+
+  /* Route all ports to EHCI, ehci_port_status hands them back */
+  opreg[EHCI_CONFIGFLAG] = 1;
+
+  if (hcs_params & EHCI_HCSPARAMS_PPC)
+    for (i = 0; i < eh->port_num; i++)
+      ehci_port_write(eh, i, EHCI_PORTSC_POWER, 0);
+  ms_delay(20);
 
   /* Initialise root hub */
   root_hub = kzalloc(sizeof(struct usb_hub));
   if (root_hub == NULL)
     return ERR_NO_MEM;
 
-  root_hub->port_num = 2;           /* The total number of ports on this hub */
+  root_hub->port_num = eh->port_num;/* The total number of ports on this hub */
   root_hub->hc = (void *)eh;        /* Host controler of this hub */
   root_hub->hc_ops = &ehci_hc_ops;  /* Host controler operations  */
   root_hub->upstream_hub = NULL;    /* This is root hub */
   root_hub->hub_ops = &ehci_hub_ops;/* Hub operations   */
-  
+
   usb_hub_register(root_hub);
 
   return 0;
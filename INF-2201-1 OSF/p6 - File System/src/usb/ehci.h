@@ -2,20 +2,113 @@
 #define EHCI_H
 
 #include "../util.h"
+#include "../thread.h"
+#include "usb.h"
 
+/*
+ * EHCI transfer structures, laid out as in the 64-bit data structure
+ * appendix of the EHCI specification so that controllers which report
+ * 64-bit addressing read them correctly (the upper halves stay zero).
+ */
 struct ehci_queue_transfer_descriptor {
   uint32_t next_qtd;
   uint32_t alternate_qtd;
-  uint32_t control_status;
+  uint32_t token;
   uint32_t buffer_pointer[5];
+  uint32_t ext_buffer_pointer[5];
 } __attribute__((packed));
 
 struct ehci_queue_head {
-  uint32_t qh_horiz_lp;
-  uint32_t ep_cap;
+  uint32_t horiz_lp;               /* queue head horizontal link pointer */
+  uint32_t ep_char;                /* endpoint characteristics */
+  uint32_t ep_cap;                 /* endpoint capabilities */
   uint32_t current_qtd;
-}
+  /* Transfer overlay, the controller's copy of the current qTD */
+  struct ehci_queue_transfer_descriptor overlay;
+} __attribute__((packed));
+
+/* State of this EHC controller */
+struct ehci {
+  /* Capability and operational registers (memory mapped) */
+  volatile uint8_t *capreg_base;
+  volatile uint32_t *opreg_base;
+
+  /* Head of the asynchronous schedule, each pipe QH follows it */
+  struct ehci_queue_head *async_qh;
+  /* Inactive qTD that IN qTDs go on to after a short packet */
+  struct ehci_queue_transfer_descriptor *stop_qtd;
+  /* Spinlock to access the asynchronous schedule */
+  spinlock_t xfer_qh_lock;
+
+  /* Threads blocked until ehci_interrupt reports a completed transfer */
+  pcb_t *xfer_waiting;
+
+  /* Address allocator */
+  int next_address;
+
+  /* Root hub ports */
+  int port_num;
+};
+
+/* Per EHC initialisation function */
+int ehci_init(struct ehci *);
+
+void ehci_interrupt(struct ehci *);
+
+/* Host controller capability registers (offsets from capreg_base) */
+#define EHCI_CAPLENGTH    0x00  /* 8 bits reg */
+#define EHCI_HCSPARAMS    0x04
+#define EHCI_HCCPARAMS    0x08
+
+#define EHCI_HCSPARAMS_N_PORTS  0x0000000F
+#define EHCI_HCSPARAMS_PPC      (1 << 4)    /* Port power control */
+#define EHCI_HCCPARAMS_EECP_OFF 8
 
+/* Host controller operational registers (32 bit word indexes) */
+#define EHCI_USBCMD       (0x00 / 4)
+#define EHCI_USBSTS       (0x04 / 4)
+#define EHCI_USBINTR      (0x08 / 4)
+#define EHCI_CTRLDSSEGMENT (0x10 / 4)
+#define EHCI_ASYNCLISTADDR (0x18 / 4)
+#define EHCI_CONFIGFLAG   (0x40 / 4)
+#define EHCI_PORTSC       (0x44 / 4)
+
+/* USB command register */
+#define EHCI_CMD_RUN            (1 << 0)
+#define EHCI_CMD_HCRESET        (1 << 1)
+#define EHCI_CMD_ASE            (1 << 5)    /* Asynchronous schedule enable */
+#define EHCI_CMD_ITC_OFF        16          /* Interrupt threshold (micro-frames) */
+
+/* USB status and interrupt enable registers */
+#define EHCI_STS_USBINT         (1 << 0)
+#define EHCI_STS_USBERRINT      (1 << 1)
+#define EHCI_STS_HALTED         (1 << 12)
+#define EHCI_STS_ASS            (1 << 15)   /* Asynchronous schedule status */
+#define EHCI_STS_INT_MASK       0x0000003F
+
+/* Port status and control register */
+#define EHCI_PORTSC_CONNECT     (1 << 0)
+#define EHCI_PORTSC_CONNECT_CHANGE (1 << 1)
+#define EHCI_PORTSC_ENABLE      (1 << 2)
+#define EHCI_PORTSC_ENABLE_CHANGE (1 << 3)
+#define EHCI_PORTSC_OC_CHANGE   (1 << 5)
+#define EHCI_PORTSC_RESUME      (1 << 6)
+#define EHCI_PORTSC_SUSPEND     (1 << 7)
+#define EHCI_PORTSC_RESET       (1 << 8)
+#define EHCI_PORTSC_LINE_STATUS (3 << 10)
+#define EHCI_PORTSC_LINE_K      (1 << 10)   /* Low speed device attached */
+#define EHCI_PORTSC_POWER       (1 << 12)
+#define EHCI_PORTSC_OWNER       (1 << 13)   /* Port handed to a companion controller */
+/* Writing 1 to these clears them */
+#define EHCI_PORTSC_CHANGE_MASK \
+  (EHCI_PORTSC_CONNECT_CHANGE | EHCI_PORTSC_ENABLE_CHANGE | EHCI_PORTSC_OC_CHANGE)
+
+/* Link pointers (QH horizontal, qTD next and alternate) */
+#define EHCI_LP_ADDR_MASK       0xFFFFFFE0
+#define EHCI_LP_QH              (1 << 1)
+#define EHCI_LP_TERMINATE       (1 << 0)
+
+/* Queue head endpoint characteristics and capabilities */
 #define EHCI_QH_RL_OFF              28
 #define EHCI_QH_C_OFF               27
 #define EHCI_QH_MAX_PACKET_LEN_OFF  16
@@ -25,6 +118,7 @@ struct ehci_queue_head {
 #define EHCI_QH_ENDPT_OFF           8
 #define EHCI_QH_I_OFF               7
 #define EHCI_QH_ADDR_MASK       0x0000007F
+#define EHCI_QH_EPS_HS          2
 
 #define EHCI_QH_MULT_OFF          30
 #define EHCI_QH_PORT_NUM_OFF      23
@@ -32,22 +126,23 @@ struct ehci_queue_head {
 #define EHCI_QH_UFRAME_CMASK_OFF  8
 #define EHCI_QH_UFRAME_SMASK_OFF  0
 
+/* Queue element transfer descriptor token */
 #define EHCI_TD_DATA_TOGGLE_OFF 31
 #define EHCI_TD_TOTAL_SIZE_OFF  16
+#define EHCI_TD_TOTAL_SIZE_MASK 0x7FFF
 #define EHCI_TD_IOC_OFF         15
 #define EHCI_TD_CERR_OFF        10
 #define EHCI_TD_PID_OFF         8
 
-#define EHCI_PID_OUT    0xE1
-#define EHCI_PID_IN     0x69
-#define EHCI_PID_SETUP  0x2D
+/* Token PID codes */
+#define EHCI_PID_OUT    0
+#define EHCI_PID_IN     1
+#define EHCI_PID_SETUP  2
 
 #define EHCI_TD_STATUS_MASK     0x000000FF
 
 #define EHCI_TD_BPOINTER_MASK   0xFFFFF000
-#define EHCI_TD_POINTER_MASK    0xFFFFFFF0
-#define EHCI_TD_TERMINATE       0x00000001
-
+#define EHCI_TD_PAGES           5           /* Buffer pages per qTD, 20kB */
 
 #define EHCI_STATUS_ACTIVE      0x80
 #define EHCI_STATUS_HALTED      0x40
@@ -58,7 +153,4 @@ struct ehci_queue_head {
 #define EHCI_STATUS_SPLIT       0x02
 #define EHCI_STATUS_PING        0x01
 
-
-
-
 #endif
@@ -1,64 +1,91 @@
-#include "pci.h"
+#include "ehci.h"
 #include "ehci_pci.h"
+#include "pci.h"
+#include "allocator.h"
+#include "error.h"
 #include "debug.h"
+#include "../memory.h"
 #include "../util.h"
 
-DEBUG_NAME("EHCI");
+#undef DEBUG_NAME
+#define DEBUG_NAME "PCI EH"
 
 /*
- * The only task of this initialisation is to take 
- * control over EHCI chip and to disable it. 
- * As a result all USB v2 devices will be redirected
- * to USB v1 ports
+ * Takes the controller over from the BIOS, which may use it
+ * to emulate a PS/2 keyboard or a boot disk (EHCI spec. 5.1)
  */
+static void ehci_pci_handoff(struct pci_dev *pci, uint32_t eecp) {
+  int i;
+
+  if (eecp < 0x40 ||
+      pci_read_dev_reg8(pci, eecp) != EHCI_USBLEGSUP_ID)
+    return;
+
+  pci_write_dev_reg8(pci, eecp + EHCI_USBLEGSUP_OS_SEM, 1);
+  for (i = 0; i < 100 && pci_read_dev_reg8(pci, eecp + EHCI_USBLEGSUP_BIOS_SEM); i++)
+    ms_delay(10);
+  DEBUG("   BIOS handoff %s", i < 100 ? "done" : "timed out");
+
+  /* No SMIs from the controller */
+  pci_write_dev_reg32(pci, eecp + EHCI_USBLEGCTLSTS, 0);
+}
+
 int ehci_pci_init(struct pci_dev *pci) {
-  uint8_t *hccreg_base;
-  uint8_t *opreg_base;
-  uint8_t cap_length;
+  struct ehci *eh;
+  uint32_t base;
   uint32_t hcc_params;
-  uint32_t eecp;
-  uint32_t *usbcmd;
-  int i;
+  int err;
 
   DEBUG("Found EHCI controler");
 
-  /* EHCI registers are located in memory address space */
-  hccreg_base = (uint8_t *)(pci_read_dev_reg32(pci, EHCI_PCIREG_BASE) & 0xffffff00);
-  DEBUG("   address %x", hccreg_base);
+  eh = kzalloc(sizeof(struct ehci));
+  if (eh == NULL)
+    return ERR_NO_MEM;
+
+  /* Attach this EHCI state to the PCI device */
+  pci->driver = (void *)eh;
+
+  /*
+   * EHCI registers are located in memory address space, above
+   * physical memory, so the kernel has to map them
+   */
+  base = pci_read_dev_reg32(pci, EHCI_PCIREG_BASE) & 0xffffff00;
+  DEBUG("   address %x", base);
+  memory_map_device(base, EHCI_REG_SIZE);
+  eh->capreg_base = (volatile uint8_t *)base;
+
+  /* Bus master & memory space enabled */
+  pci_write_dev_reg16(pci, PCI_DEV_COMMAND,
+                      pci_read_dev_reg16(pci, PCI_DEV_COMMAND) | 0x0006);
 
-  cap_length = *((uint8_t *)(hccreg_base + EHCI_HCCREG_CAPLENGTH));
-  DEBUG("   cap length %d", cap_length);
+  hcc_params = *(volatile uint32_t *)(eh->capreg_base + EHCI_HCCPARAMS);
+  ehci_pci_handoff(pci, (hcc_params >> EHCI_HCCPARAMS_EECP_OFF) & 0xff);
 
-  hcc_params = *((uint32_t *)(hccreg_base + EHCI_HCCREG_HCCPARAMS));
-  eecp = (hcc_params & 0x0000ff00) >> 16;   /* EHCI extended capability pointer */
-  DEBUG("   EECP %x", eecp);
-  
-  opreg_base = hccreg_base + cap_length;
-  usbcmd = (uint32_t *)(opreg_base + EHCI_OPREG_USBCMD);
-  DEBUG("   USBCMD reg %x", *usbcmd);
-  DEBUG("   Reseting the device...");
-  *usbcmd = 0x2;
+  /* Initialise EHCI for this device */
+  if ((err = ehci_init(eh)) < 0)
+    return err;
 
-  i = 0;
-  while (*((volatile uint32_t *)usbcmd) & 0x2)
-    i++;
+  return 0;
+}
+
+/* Interrupt handler only forwards the interrupt to EHCI */
+void ehci_pci_interrupt(void *driver) {
+  struct ehci *eh = (struct ehci *)driver;
 
-  DEBUG("   Device is reset and disable (it took %d count cycles)", i);
+  ehci_interrupt(eh);
 
-  return 1;
+  return;
 }
 
 /* EHCI PCI interface */
 static struct pci_dev_driver ehci_pci_driver = {
-  .class_code = 0x0c,
-  .subclass_code = 0x03,
-  .prog_ifc = 0x20,
+  .class_code = 0x0c,             /* Serial Bus Controllers */
+  .subclass_code = 0x03,          /* USB Controller         */
+  .prog_ifc = 0x20,               /* USB EHCI interface     */
   .init = ehci_pci_init,
-  .interrupt = NULL,
+  .interrupt = ehci_pci_interrupt,
 };
 
 void ehci_pci_dev_driver_register() {
   pci_dev_driver_register(&ehci_pci_driver);
 }
-
-
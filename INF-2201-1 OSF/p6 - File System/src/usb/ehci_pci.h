@@ -3,21 +3,21 @@
 
 void ehci_pci_dev_driver_register();
 
+/*
+ * Host controller capability and operational registers
+ * are located in memory address space starting from
+ * the address in EHCI_PCIREG_BASE (see ehci.h)
+ */
 #define EHCI_PCIREG_BASE 0x10
+#define EHCI_REG_SIZE    0x100
 
-/* 
- * Host controler capability registers (HCCREG) 
- * are located in address memory starting 
- * from address pointed to by EHCI_PCIREG_BASE
- */
-#define EHCI_HCCREG_CAPLENGTH 0x00  /* 8 bits reg */
-#define EHCI_HCCREG_HCCPARAMS 0x08  /* 32 bits reg */
 /*
- * Host controler operational registers (OPREG)
- * are located in address memory starting from 
- * address pointed to by 
- *  EHCI_PCIREG_BASE + EHCI_HCCREG_CAPLENGTH
+ * USB legacy support capability, found in PCI configuration
+ * space at the EHCI extended capability pointer (EECP)
  */
-#define EHCI_OPREG_USBCMD     0x00  /* 32 bits reg */
+#define EHCI_USBLEGSUP_ID        0x01
+#define EHCI_USBLEGSUP_BIOS_SEM  2      /* 8 bits, HC BIOS owned semaphore */
+#define EHCI_USBLEGSUP_OS_SEM    3      /* 8 bits, HC OS owned semaphore   */
+#define EHCI_USBLEGCTLSTS        4      /* 32 bits, SMI enables            */
 
 #endif
@@ -14,6 +14,27 @@ DEBUG_NAME("SCSI");
 static struct scsi_dev *scsi = NULL;
 static spinlock_t scsi_dev_lock;
 
+/*
+ * Request queue. scsi_submit adds requests and the I/O thread serves
+ * them in scsi_serve, one device command at a time. The queue is kept
+ * sorted by block and served like a one-way elevator (C-SCAN): the
+ * next request is the first one at or above the block after the last
+ * command, wrapping around to the lowest block. Requests of the same
+ * direction for consecutive blocks are merged into one command of at
+ * most SCSI_MERGE_MAX blocks (scsi_read and scsi_write split larger
+ * ones). A request is never served before an older one for an
+ * overlapping block, unless both are reads.
+ */
+static struct scsi_request *queue; /* sorted by block_start */
+static unsigned queue_seq;         /* seq of the next request */
+static int queue_pos;              /* block after the last command */
+static lock_t queue_lock;
+static condition_t queue_more;     /* signalled when a request is added */
+static condition_t queue_done;     /* broadcast when requests complete */
+
+/* Merged requests whose buffers are not adjacent go through here */
+static char *merge_buf;
+
 static int scsi_read_write(int dir, int block_start,
     int block_count, char *data);
 
@@ -22,6 +43,12 @@ static int scsi_test_unit_ready(void);
 
 void scsi_static_init(void) {
   spinlock_init(&scsi_dev_lock);
+  lock_init(&queue_lock);
+  condition_init(&queue_more);
+  condition_init(&queue_done);
+  queue = NULL;
+  queue_seq = 0;
+  queue_pos = 0;
 }
 
 int scsi_init(struct scsi_ifc *ifc) {
@@ -181,7 +208,7 @@ static int scsi_read_capacity(void) {
 }
 
 /*
- * Read a number of blocks from the drive
+ * Send one READ(10) or WRITE(10) command to the drive
  */
 static int scsi_read_write(int dir, int block_start, 
     int block_count, char *data) {
@@ -223,14 +250,200 @@ static int scsi_read_write(int dir, int block_start,
 
   return 0;
 }
+
+/*
+ * Queue a request for the I/O thread and return at once. The request
+ * goes after the queued ones with the same start block.
+ */
+void scsi_submit(struct scsi_request *req) {
+  struct scsi_request **p;
+
+  lock_acquire(&queue_lock);
+  req->status = SCSI_REQ_PENDING;
+  req->seq = queue_seq++;
+  for (p = &queue; *p != NULL && (*p)->block_start <= req->block_start;
+       p = &(*p)->next)
+    ;
+  req->next = *p;
+  *p = req;
+  condition_signal(&queue_more);
+  lock_release(&queue_lock);
+}
+
+/*
+ * Block until req has completed, and return its result
+ */
+int scsi_wait(struct scsi_request *req) {
+  int rc;
+
+  lock_acquire(&queue_lock);
+  while (req->status == SCSI_REQ_PENDING)
+    condition_wait(&queue_lock, &queue_done);
+  rc = req->status;
+  lock_release(&queue_lock);
+
+  return rc;
+}
+
+/* True if a and b touch a common block and one of them writes it */
+static int conflicts(struct scsi_request *a, struct scsi_request *b) {
+  if (a->dir == SCSI_READ && b->dir == SCSI_READ)
+    return 0;
+  return a->block_start < b->block_start + b->block_count &&
+    b->block_start < a->block_start + a->block_count;
+}
+
+/* True if no older queued request must be served before req */
+static int ready(struct scsi_request *req) {
+  struct scsi_request *r;
+
+  for (r = queue; r != NULL; r = r->next)
+    if (r->seq < req->seq && conflicts(r, req))
+      return 0;
+  return 1;
+}
+
+/*
+ * Take the next command off the queue: the first ready request from
+ * queue_pos up (or from the start), and the ready requests that
+ * continue it. Returns the number of requests put in run[], which are
+ * in block order. Must be called with queue_lock held.
+ */
+static int dequeue(struct scsi_request *run[]) {
+  struct scsi_request **p, **first = NULL, *r;
+  int n, blocks;
+
+  for (p = &queue; *p != NULL; p = &(*p)->next) {
+    if (!ready(*p))
+      continue;
+    if ((*p)->block_start >= queue_pos) {
+      first = p;
+      break;
+    }
+    if (first == NULL)
+      first = p;
+  }
+  ASSERT(first != NULL);
+
+  /* Unlink the first request and the ones merged with it */
+  r = *first;
+  *first = r->next;
+  run[0] = r;
+  n = 1;
+  blocks = r->block_count;
+  while (merge_buf != NULL && n < SCSI_MERGE_MAX &&
+         (r = *first) != NULL && r->dir == run[0]->dir &&
+         r->block_start == run[0]->block_start + blocks &&
+         blocks + r->block_count <= SCSI_MERGE_MAX && ready(r)) {
+    *first = r->next;
+    run[n++] = r;
+    blocks += r->block_count;
+  }
+
+  queue_pos = run[0]->block_start + blocks;
+  return n;
+}
+
 /*
- * SCSI interface functions 
+ * Body of the I/O thread: wait for requests, serve the next command
+ * and complete the requests in it.
  */
+void scsi_serve(void) {
+  struct scsi_request *run[SCSI_MERGE_MAX];
+  void (*done[SCSI_MERGE_MAX])(struct scsi_request *, int);
+  char *data;
+  int i, n, blocks = 0, adjacent = 1, rc;
+
+  /* Buffer for merging, without it requests are served one by one */
+  if (merge_buf == NULL)
+    merge_buf = kzalloc(SCSI_MERGE_MAX * SECTOR_SIZE);
+
+  lock_acquire(&queue_lock);
+  while (queue == NULL)
+    condition_wait(&queue_lock, &queue_more);
+  n = dequeue(run);
+  lock_release(&queue_lock);
+
+  for (i = 0; i < n; i++) {
+    if (i > 0 && run[i]->data != run[i - 1]->data +
+        run[i - 1]->block_count * SECTOR_SIZE)
+      adjacent = 0;
+    blocks += run[i]->block_count;
+  }
+
+  /* Requests with adjacent buffers need no copying */
+  data = adjacent ? run[0]->data : merge_buf;
+  if (!adjacent && run[0]->dir == SCSI_WRITE)
+    for (i = 0; i < n; i++)
+      bcopy(run[i]->data, &merge_buf[(run[i]->block_start -
+            run[0]->block_start) * SECTOR_SIZE],
+            run[i]->block_count * SECTOR_SIZE);
+
+  rc = scsi_read_write(run[0]->dir, run[0]->block_start, blocks, data);
+
+  if (!adjacent && run[0]->dir == SCSI_READ && rc == 0)
+    for (i = 0; i < n; i++)
+      bcopy(&merge_buf[(run[i]->block_start - run[0]->block_start) *
+            SECTOR_SIZE], run[i]->data,
+            run[i]->block_count * SECTOR_SIZE);
+
+  /* A waiter may reuse its request as soon as the status is set */
+  lock_acquire(&queue_lock);
+  for (i = 0; i < n; i++) {
+    done[i] = run[i]->done;
+    run[i]->status = rc;
+  }
+  condition_broadcast(&queue_done);
+  lock_release(&queue_lock);
+
+  for (i = 0; i < n; i++)
+    if (done[i] != NULL)
+      done[i](run[i], rc);
+}
+
+/*
+ * SCSI interface functions, they queue a request and wait for it.
+ * A request of more than SCSI_MERGE_MAX blocks is split into commands
+ * of that size. The next command is queued before we wait for the
+ * previous one, so the I/O thread starts it as soon as the previous
+ * status is in, and the drive streams the whole request.
+ */
+static int scsi_request(int dir, int block_start, int block_count,
+    char *data) {
+  struct scsi_request req[2], *r, *prev = NULL;
+  int i = 0, n, rc = 0;
+
+  do {
+    /* Reuses the request we waited for in the last round */
+    r = &req[i++ % 2];
+    n = block_count < SCSI_MERGE_MAX ? block_count : SCSI_MERGE_MAX;
+    r->dir = dir;
+    r->block_start = block_start;
+    r->block_count = n;
+    r->data = data;
+    r->done = NULL;
+    scsi_submit(r);
+
+    block_start += n;
+    block_count -= n;
+    data += n * SECTOR_SIZE;
+
+    if (prev != NULL && scsi_wait(prev) != 0)
+      rc = -1;
+    prev = r;
+  } while (block_count > 0);
+
+  if (scsi_wait(prev) != 0)
+    rc = -1;
+
+  return rc;
+}
+
 int scsi_read(int block_start, int block_count, char *data) {
-  return scsi_read_write(SCSI_READ, block_start, block_count, data);
+  return scsi_request(SCSI_READ, block_start, block_count, data);
 }
 
 int scsi_write(int block_start, int block_count, char *data) {
-  return scsi_read_write(SCSI_WRITE, block_start, block_count, data);
+  return scsi_request(SCSI_WRITE, block_start, block_count, data);
 }
 
@@ -38,10 +38,43 @@ struct scsi_ifc {
                int len, char *data);
 };
 
+/*
+ * A block request for the I/O thread. The submitter fills in dir,
+ * block_start, block_count, data and done, and keeps the request
+ * until scsi_wait returns, or until done has been called. done (if
+ * not NULL) is called by the I/O thread when the transfer is over,
+ * with rc 0 or -1.
+ */
+struct scsi_request {
+  int dir;           /* SCSI_READ or SCSI_WRITE */
+  int block_start;
+  int block_count;
+  char *data;
+  void (*done)(struct scsi_request *req, int rc);
+  void *arg;         /* for the submitter, not used by the queue */
+
+  /* Kept by the queue */
+  int status;        /* SCSI_REQ_PENDING until done, then rc */
+  unsigned seq;      /* submission order */
+  struct scsi_request *next;
+};
+
+#define SCSI_REQ_PENDING 1
+
+/*
+ * Most blocks moved by one command, made of merged requests or split
+ * from a larger one. READ(10) allows 65535, but the transfer
+ * descriptors of a command come from the small USB heap.
+ */
+#define SCSI_MERGE_MAX 16
+
 void scsi_static_init(void);
 int scsi_init(struct scsi_ifc *ifc);
 int scsi_read(int block_start, int block_count, char *data);
 int scsi_write(int block_start, int block_count, char *data);
+void scsi_submit(struct scsi_request *req);
+int scsi_wait(struct scsi_request *req);
+void scsi_serve(void);
 void scsi_free();
 int scsi_up();
 
@@ -13,40 +13,50 @@
 
 DEBUG_NAME("UHCI");
 
-/* Heads of free transfer transfer units */
-static struct slist free_xfer_slist_head;
-static struct slist free_tdc_slist_head;
-
-/* Transfer descriptor container cache */
-static struct uhci_td_container *tdc_alloc() {
-  struct uhci_td_container *tdc;
+/*
+ * TD containers and transfer units come from per-controller pools made
+ * by uhci_init. Freed entries go to the back of the free lists, stamped
+ * with the current frame number, and are taken from the front. An entry
+ * freed in the current frame may still be read by the UHCI, see
+ * xfer_alloc, so it is only reused after that frame. The stamp is
+ * compared with the frame number read at allocation time, as entries
+ * can be freed while a transfer is being built. With FIFO lists this
+ * hardly ever has to wait. The lists are only touched with interrupts
+ * off, for a few instructions.
+ */
+static void pool_wait_frame(struct uhci *uh, uint32_t freed_frame_num) {
+  if (freed_frame_num == UHCI_FRAME_NONE)
+    return;
 
-  SLIST_LOCK(&free_tdc_slist_head);
-  LIST_FIRST(&free_tdc_slist_head, tdc);
-  if ((void *)tdc != (void *)&free_tdc_slist_head) {
-    LIST_UNLINK(tdc);
-    SLIST_UNLOCK(&free_tdc_slist_head);
+  while (uhci_pci_read(uh->iobase, UHCI_FRAME_NUM) == freed_frame_num)
+    ms_delay(1);
+}
 
-    return tdc;
-  }
-  SLIST_UNLOCK(&free_tdc_slist_head);
+/* Transfer descriptor container pool */
+static struct uhci_td_container *tdc_alloc(struct uhci *uh) {
+  struct uhci_td_container *tdc;
 
-  tdc = kzalloc(sizeof(struct uhci_td_container));
-  if (tdc == NULL)
-    return NULL;
-  tdc->td = kzalloc_align(sizeof(struct uhci_transfer_descriptor), 16);
-  if (tdc->td == NULL) {
-    kfree(tdc);
+  enter_critical();
+  LIST_FIRST(&uh->free_tdc_list_head, tdc);
+  if ((void *)tdc == (void *)&uh->free_tdc_list_head) {
+    leave_critical();
     return NULL;
   }
+  LIST_UNLINK(tdc);
+  leave_critical();
+
+  pool_wait_frame(uh, tdc->frame_num);
 
   return tdc;
 }
 
-static void tdc_free(struct uhci_td_container *tdc) {
-  SLIST_LOCK(&free_tdc_slist_head);
-  LIST_LINK(&free_tdc_slist_head, tdc);
-  SLIST_UNLOCK(&free_tdc_slist_head);
+static void tdc_free(struct uhci *uh, struct uhci_td_container *tdc,
+                     uint32_t frame_num) {
+  tdc->frame_num = frame_num;
+
+  enter_critical();
+  LIST_LINK(&uh->free_tdc_list_head, tdc);
+  leave_critical();
 }
 
 /*
@@ -77,7 +87,7 @@ td_build(struct usb_pipe *pipe, uint8_t pid, int size, char *data) {
   int usb_dev_speed;
   int interrupt_pipe;
 
-  tdc = tdc_alloc();
+  tdc = tdc_alloc((struct uhci *)pipe->udev->hc);
   if (tdc == NULL)
     return NULL;
   
@@ -89,6 +99,8 @@ td_build(struct usb_pipe *pipe, uint8_t pid, int size, char *data) {
   td->lp = UHCI_LP_TERMINATE;
 
   td->control_status = 
+    (pid == UHCI_TD_PID_IN && !interrupt_pipe ?
+     UHCI_TD_SPD_BIT : 0) |                  /* A short packet ends the transfer          */
     (usb_dev_speed << UHCI_TD_LS_DEV_OFF) |  /* USB device speed                          */
     (3 << UHCI_TD_ERROR_COUNTDOWN_OFF) |     /* Allow up to three errors in transmission  */
     (interrupt_pipe  << UHCI_TD_IOC_OFF) |   /* Generate Interrupt on transfer complete
@@ -120,54 +132,26 @@ td_build(struct usb_pipe *pipe, uint8_t pid, int size, char *data) {
  *  4. UHCI begins to process the QH with modified content. 
  *
  * If we ensure that QH is left untouched in this frame we can safely 
- * reuse it in the next frame, since it is removed from the UHCI schedule
+ * reuse it in the next frame, since it is removed from the UHCI schedule.
  */
-static struct uhci_transfer_unit *xfer_alloc() {
+static struct uhci_transfer_unit *xfer_alloc(struct uhci *uh) {
   struct uhci_transfer_unit *xfer;
-  struct uhci *uh;
-  uint32_t frame_num;
-
-  /* To ensure consistency */
-  SLIST_LOCK(&free_xfer_slist_head);
-  /* Try to reuse already allocated xfer container */
-  LIST_FOR_EACH(&free_xfer_slist_head, xfer) {
-    /*
-     * Does this transfer unit belong to some UHCI? If so, check whether 
-     * it has been released in this time frame. 
-     * We do not reuse transfer units that has been released in this 
-     * time frame, since this can be still processed by UHCI.
-     */
-    if (xfer->uh != NULL) {
-      uh = xfer->uh; 
-      frame_num = uhci_pci_read(uh->iobase, UHCI_FRAME_NUM);
-      if (xfer->frame_num == frame_num)
-        continue;
-    }
-    /* First transfer unit that matches our conditions */
 
-    /* Unlink this transfer unit */
-    LIST_UNLINK(xfer);
-
-    SLIST_UNLOCK(&free_xfer_slist_head);
-
-    /* Prepare and return it */
-    bzero((char *)xfer, sizeof(struct uhci_transfer_unit));
-
-    xfer->qh.horiz_lp = UHCI_LP_TERMINATE;
-    xfer->qh.vert_lp = UHCI_LP_TERMINATE;
-    LIST_INIT(&xfer->td_list_head);
-
-    return xfer;
+  enter_critical();
+  LIST_FIRST(&uh->free_xfer_list_head, xfer);
+  if ((void *)xfer == (void *)&uh->free_xfer_list_head) {
+    leave_critical();
+    return NULL;
   }
+  LIST_UNLINK(xfer);
+  leave_critical();
 
-  /* No free transfer units */
-  SLIST_UNLOCK(&free_xfer_slist_head);
-
-  /* Allocate a new one */
-  xfer = kzalloc(sizeof(struct uhci_transfer_unit));
+  pool_wait_frame(uh, xfer->frame_num);
 
+  /* Prepare and return it */
   xfer->qh.horiz_lp = UHCI_LP_TERMINATE;
   xfer->qh.vert_lp = UHCI_LP_TERMINATE;
+  xfer->qh.prev_qh = NULL;
   LIST_INIT(&xfer->td_list_head);
 
   return xfer;
@@ -179,31 +163,59 @@ static struct uhci_transfer_unit *xfer_alloc() {
  */
 static void xfer_free(struct uhci_transfer_unit *xfer) {
   struct uhci_td_container *tdc, *tdc_helper;
+  struct uhci *uh = xfer->uh;
+  uint32_t frame_num;
+
+  /* Mark frame number when this transfer unit is freed */
+  frame_num = uhci_pci_read(uh->iobase, UHCI_FRAME_NUM);
 
   LIST_FOR_EACH_SAFE(&xfer->td_list_head, tdc, tdc_helper) {
     LIST_UNLINK(tdc);
-    tdc_free(tdc);
+    tdc_free(uh, tdc, frame_num);
   }
   
   /* Put this transfer unit onto the free list */
-  SLIST_LOCK(&free_xfer_slist_head);
-  LIST_LINK(&free_xfer_slist_head, xfer);
-  SLIST_UNLOCK(&free_xfer_slist_head);
+  xfer->frame_num = frame_num;
+  enter_critical();
+  LIST_LINK(&uh->free_xfer_list_head, xfer);
+  leave_critical();
 }
 
 /*
- * Count transmitted bytes 
+ * Count transmitted bytes, TDs that never ran (after a short packet)
+ * moved nothing
  */
 int xfer_count_bytes(struct uhci_transfer_unit *xfer) {
   struct uhci_td_container *tdc;
   int xfer_bytes = 0;
 
   LIST_FOR_EACH(&xfer->td_list_head, tdc)
-    xfer_bytes += (tdc->td->control_status + 1) & UHCI_TD_ACTLEN;
+    if ((tdc->td->control_status & UHCI_TD_ACTIVE_BIT) == 0)
+      xfer_bytes += (tdc->td->control_status + 1) & UHCI_TD_ACTLEN;
 
   return xfer_bytes;
 }
 
+/*
+ * Returns the TD that received a short packet, or NULL. With SPD set
+ * the UHCI stops the queue there, so the TDs after it never run.
+ */
+static struct uhci_transfer_descriptor *
+xfer_short_packet(struct uhci_transfer_unit *xfer) {
+  struct uhci_td_container *tdc;
+  struct uhci_transfer_descriptor *td;
+
+  LIST_FOR_EACH(&xfer->td_list_head, tdc) {
+    td = tdc->td;
+    if ((td->control_status & (UHCI_TD_ACTIVE_BIT | UHCI_TD_SPD_BIT)) == UHCI_TD_SPD_BIT &&
+        ((td->control_status + 1) & UHCI_TD_ACTLEN) <
+        (((td->token >> UHCI_TD_MAX_LEN_OFF) + 1) & UHCI_TD_ACTLEN))
+      return td;
+  }
+
+  return NULL;
+}
+
 /*
  * Returns the cumulative status from all TDs
  */
@@ -263,7 +275,6 @@ static void xfer_enqueue(struct uhci_transfer_unit *xfer,
                   struct uhci *uh,
                   struct uhci_queue_head *uhci_qh) {
   struct uhci_queue_head *next_qh;
-  xfer->uh = uh;
   /*
    * This function must be atomic with respect to 
    * multiple processes accessing it. Atomicity with
@@ -338,8 +349,6 @@ static void xfer_dequeue(struct uhci_transfer_unit *xfer) {
   else
     prev_qh->horiz_lp = qh->horiz_lp;
 
-  /* Mark frame number when this transfer unit is freed */
-  xfer->frame_num = uhci_pci_read(uh->iobase, UHCI_FRAME_NUM);
   spinlock_release(&uh->xfer_qh_lock);
 }
 
@@ -370,32 +379,27 @@ void xfer_print(struct uhci_transfer_unit *xfer) {
   DEBUG("TD actlen %2d, status %s", actlen, status_text);
 }
 
-/*
- * Sets up a free transfer descriptor list
- */
-void uhci_static_init() {
-  SLIST_INIT(&free_xfer_slist_head);
-  SLIST_INIT(&free_tdc_slist_head);
-
-  return;
-}
-
 /* 
  * Read/write operation over USB pipes
  *
  * This function support the RW operation even if data transfer
  * exceeds the maximum packet size. In such case the transfer 
  * is split into multiple packets that carry subsequent data
- * chunks. 
+ * chunks. The TDs of all n buffers are put on the schedule as
+ * one transfer unit.
  */
-static int uhci_read_write(struct usb_pipe *pipe, int pid, int size, char *data) {
-  struct uhci_td_container *tdc;
+static int uhci_read_write(struct usb_pipe *pipe, int pid,
+                           int n, struct usb_buffer *bufs) {
+  struct uhci_td_container *tdc = NULL;
+  struct uhci_transfer_descriptor *short_td;
   struct uhci_transfer_unit *xfer_container;
   struct uhci *uh;
   uint32_t status;
-  int remaining_size = size;
+  int remaining_size;
   int packet_size;
+  char *data;
   int err = 0;
+  int i;
 
   uh = (struct uhci *)pipe->udev->hc;
 
@@ -406,29 +410,42 @@ static int uhci_read_write(struct usb_pipe *pipe, int pid, int size, char *data)
   if (pid == UHCI_TD_PID_SETUP)
     pipe->toggle_bit = 0;
 
-  if ((xfer_container = xfer_alloc()) == NULL) 
+  if ((xfer_container = xfer_alloc(uh)) == NULL) 
     return ERR_NO_MEM;
   
 
-  /* Transfers must also handle packets with size 0 */
-  do {
-    packet_size = remaining_size > pipe->max_packet_size ?
-      pipe->max_packet_size : remaining_size;
-    remaining_size -= packet_size;
+  for (i = 0; i < n; i++) {
+    remaining_size = bufs[i].size;
+    data = bufs[i].data;
 
-    tdc = td_build(pipe, pid, packet_size, data);
-    data += packet_size;
+    /* Transfers must also handle packets with size 0 */
+    do {
+      packet_size = remaining_size > pipe->max_packet_size ?
+        pipe->max_packet_size : remaining_size;
+      remaining_size -= packet_size;
 
-    if (tdc == NULL) {
-      err = ERR_NO_MEM;
-      goto error_uhci_rw;
-    }
+      tdc = td_build(pipe, pid, packet_size, data);
+      data += packet_size;
 
-    pipe->toggle_bit = 1 - pipe->toggle_bit;
-    xfer_add_tdc(xfer_container, tdc);
+      if (tdc == NULL) {
+        err = ERR_NO_MEM;
+        goto error_uhci_rw;
+      }
 
-  } while (remaining_size > 0);
+      pipe->toggle_bit = 1 - pipe->toggle_bit;
+      xfer_add_tdc(xfer_container, tdc);
+
+    } while (remaining_size > 0);
+  }
 
+  /* Nothing to put on the schedule (n == 0) */
+  if (tdc == NULL) {
+    err = ERR_PROTO;
+    goto error_uhci_rw;
+  }
+
+  /* The last TD interrupts on completion, see the wait below */
+  tdc->td->control_status |= (1 << UHCI_TD_IOC_OFF);
 
   /*
    * Enqueue this transfer unit on the UHCI schedule 
@@ -440,7 +457,14 @@ static int uhci_read_write(struct usb_pipe *pipe, int pid, int size, char *data)
     default : err = ERR_PROTO; goto error_uhci_rw;
   }
 
-  /* Wait until all TD are executed */
+  /*
+   * Wait until all TD are executed. The last TD raises an interrupt
+   * on completion and an error raises one at once, so uhci_interrupt
+   * wakes us when there is something to check. Interrupts stay off
+   * from the status check until we are blocked, so the wakeup cannot
+   * be lost.
+   */
+  enter_critical();
   while((status = xfer_get_status(xfer_container)) != 0) {
     /* If status bits are != 0 this indicates either:
      *  there are active TD pending for execution
@@ -452,9 +476,23 @@ static int uhci_read_write(struct usb_pipe *pipe, int pid, int size, char *data)
       err = ERR_DEV_STALLED;
       break;
     }
+    /*
+     * A short packet ends the transfer, the data toggle goes on
+     * from the last packet moved rather than the last TD built
+     */
+    if ((short_td = xfer_short_packet(xfer_container)) != NULL) {
+      pipe->toggle_bit = (short_td->token & UHCI_TD_DATA_TOGGLE_BIT) ? 0 : 1;
+      break;
+    }
+    /* Retries used up (CRC/timeout, babble), no interrupt will come */
+    if ((status & UHCI_TD_ACTIVE_BIT) == 0) {
+      err = ERR_XFER;
+      break;
+    }
     /* Wait */
-    yield();
+    block(&uh->xfer_waiting, NULL);
   }
+  leave_critical();
   
   xfer_dequeue(xfer_container);
 
@@ -474,16 +512,26 @@ error_uhci_rw:
 
 /* Standard read write UHCI functions */
 static int uhci_read(struct usb_pipe *pipe, int size, char *data) {
-  return uhci_read_write(pipe, UHCI_TD_PID_IN, size, data);
+  struct usb_buffer buf = {size, data};
+
+  return uhci_read_write(pipe, UHCI_TD_PID_IN, 1, &buf);
 }
 
 static int uhci_write(struct usb_pipe *pipe, int size, char *data) {
-  return uhci_read_write(pipe, UHCI_TD_PID_OUT, size, data);
+  struct usb_buffer buf = {size, data};
+
+  return uhci_read_write(pipe, UHCI_TD_PID_OUT, 1, &buf);
+}
+
+static int uhci_transfer(struct usb_pipe *pipe, int n, struct usb_buffer *bufs) {
+  return uhci_read_write(pipe, pipe->direction == USB_PIPE_DIR_IN ?
+                         UHCI_TD_PID_IN : UHCI_TD_PID_OUT, n, bufs);
 }
 
 static int uhci_setup(struct usb_pipe *pipe, struct usb_dev_setup_request *data) {
-  return uhci_read_write(pipe, UHCI_TD_PID_SETUP, 8, (char *)data);  
-      /* Setup packet size is always 8B */
+  struct usb_buffer buf = {8, (char *)data};  /* Setup packet size is always 8B */
+
+  return uhci_read_write(pipe, UHCI_TD_PID_SETUP, 1, &buf);
 }
 
 static uint8_t uhci_get_next_address(struct usb_dev *udev) {
@@ -520,8 +568,10 @@ static int uhci_register_interrupt_h(struct usb_interrupt *ui) {
    * Enqueue interrupt transfer on UHCI schedule 
    * We assume that data transfer fits one packet
    */
-  if ((xfer_container = xfer_alloc()) == NULL)
+  if ((xfer_container = xfer_alloc(uh)) == NULL) {
+    kfree(iq_element);
     return ERR_NO_MEM;
+  }
 
   tdc = td_build(ui->pipe, UHCI_TD_PID_IN, ui->size, ui->buff);
   if (!tdc) {
@@ -604,6 +654,12 @@ void uhci_interrupt(struct uhci *uh) {
    * Clear Interrupt Status Register (ISR) to re-enable interrupts
    */
   uhci_pci_write(uh->iobase, UHCI_STATUS, int_status);
+
+  /* A transfer has completed or failed, let its waiter check it */
+  if ((int_status & (UHCI_SS_USB_INT | UHCI_SS_ERR_INT)) != 0)
+    while (uh->xfer_waiting != NULL)
+      unblock(&uh->xfer_waiting);
+
   /*
    * Interrupt on status complete 
    *   This may indicate that some data transfer is 
@@ -731,6 +787,7 @@ struct usb_hub_ops uhci_hub_ops = {
 struct usb_hc_ops uhci_hc_ops = {
   .read = uhci_read,
   .write = uhci_write,
+  .transfer = uhci_transfer,
   .setup = uhci_setup,
   .get_next_addr = uhci_get_next_address,
   .register_interrupt_h = uhci_register_interrupt_h,
@@ -749,6 +806,9 @@ struct usb_hc_ops uhci_hc_ops = {
  */
 
 int uhci_init(struct uhci *uh) {
+  struct uhci_transfer_descriptor *td_pool;
+  struct uhci_td_container *tdc_pool;
+  struct uhci_transfer_unit *xfer_pool;
   uint32_t *frame_list_pointer;
   struct usb_hub *root_hub;
   int i;
@@ -779,9 +839,36 @@ int uhci_init(struct uhci *uh) {
   /* Initialise spin lock */
   spinlock_init(&uh->xfer_qh_lock);
 
+  /*
+   * TD and transfer unit pools, see tdc_alloc and xfer_alloc.
+   * Allocator chunks are 64 bytes, so the pools are cache aligned.
+   */
+  tdc_pool = kzalloc(UHCI_TD_POOL_SIZE * sizeof(struct uhci_td_container));
+  td_pool = kzalloc(UHCI_TD_POOL_SIZE * sizeof(struct uhci_transfer_descriptor));
+  xfer_pool = kzalloc(UHCI_XFER_POOL_SIZE * sizeof(struct uhci_transfer_unit));
+  if (tdc_pool == NULL || td_pool == NULL || xfer_pool == NULL)
+    return ERR_NO_MEM;
+
+  LIST_INIT(&uh->free_tdc_list_head);
+  for (i = 0; i < UHCI_TD_POOL_SIZE; i++) {
+    tdc_pool[i].td = &td_pool[i];
+    tdc_pool[i].frame_num = UHCI_FRAME_NONE;
+    LIST_LINK(&uh->free_tdc_list_head, &tdc_pool[i]);
+  }
+
+  LIST_INIT(&uh->free_xfer_list_head);
+  for (i = 0; i < UHCI_XFER_POOL_SIZE; i++) {
+    xfer_pool[i].uh = uh;
+    xfer_pool[i].frame_num = UHCI_FRAME_NONE;
+    LIST_LINK(&uh->free_xfer_list_head, &xfer_pool[i]);
+  }
+
   /* Setup address enumeration */
   uh->next_address = 1;
 
+  /* Nobody waits for a transfer yet */
+  uh->xfer_waiting = NULL;
+
   /* Interrupt handlers queue head */
   LIST_INIT(&uh->interrupt_handler_list_head);
 
@@ -818,8 +905,8 @@ int uhci_init(struct uhci *uh) {
   /* Clear frame number counter */
   uhci_pci_write(uh->iobase, UHCI_FRAME_NUM, 0);
 
-  /* Enable interrupts on complete */
-  uhci_pci_write(uh->iobase, UHCI_INT_EN, 0x0004);
+  /* Enable interrupts on complete, on short packets and on transfer errors */
+  uhci_pci_write(uh->iobase, UHCI_INT_EN, 0x000D);
 
   /* Enable UHCI */
   uhci_pci_write(uh->iobase, UHCI_COMMAND, 0x00C1); /* 0x80 64B packets allowed at SOF 
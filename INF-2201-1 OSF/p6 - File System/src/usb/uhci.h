@@ -44,6 +44,7 @@ struct uhci_transfer_descriptor {
 struct uhci_td_container {
   struct list list;
   struct uhci_transfer_descriptor *td;
+  uint32_t frame_num;                       /* Frame number when freed */
 };
 
 /* 
@@ -82,6 +83,13 @@ struct uhci {
    */
   spinlock_t xfer_qh_lock;
 
+  /* Threads blocked until uhci_interrupt reports a completed transfer */
+  pcb_t *xfer_waiting;
+
+  /* Free TD containers and transfer units of the pools, oldest first */
+  struct list free_tdc_list_head;
+  struct list free_xfer_list_head;
+
   /* Address allocator */
   int next_address;
 
@@ -101,14 +109,20 @@ int uhci_init(struct uhci *);
 
 void uhci_interrupt(struct uhci *);
 
+/* Frame List Pointer size */
+#define UHCI_FRAME_LIST_SIZE 1024
+
 /*
- * Global UHC initialisation function. 
- * The main task is to set up transfer descriptor list.
+ * Pool sizes per UHC. The largest transfers are mass storage commands
+ * of SCSI_MERGE_MAX blocks with their wrapper (129 TDs). There are TDs
+ * for two of them, so the next command seldom needs the TDs freed in
+ * the current frame, and some for control and interrupt transfers.
  */
-void uhci_static_init(); 
+#define UHCI_TD_POOL_SIZE   272
+#define UHCI_XFER_POOL_SIZE 16
 
-/* Frame List Pointer size */
-#define UHCI_FRAME_LIST_SIZE 1024
+/* Frame number of pool entries that were never used */
+#define UHCI_FRAME_NONE 0xffffffff
 
 /*
  * Link pointer related defines. These are use in:
@@ -133,6 +147,7 @@ void uhci_static_init();
 #define UHCI_TD_MAX_LEN_OFF     21
 
  /* Control and status related */
+#define UHCI_TD_SPD_BIT         (1 << 29)  /* Short packet detect */
 #define UHCI_TD_ERROR_COUNTDOWN_OFF 27
 #define UHCI_TD_LS_DEV_OFF      26
 #define UHCI_TD_ISO_BIT         (1 << 25)
@@ -359,6 +359,18 @@ int usb_write(struct usb_pipe *pipe, int size, char *data) {
   return udev->hc_ops->write(pipe, size, data);
 }
 
+/*
+ * Moves the n buffers in one transfer, in the direction of the pipe,
+ * so the host controller goes from one buffer to the next without
+ * waiting for us. Returns the bytes moved in all buffers. An IN
+ * transfer ends at a short packet, the buffers after it stay unused.
+ */
+int usb_transfer(struct usb_pipe *pipe, int n, struct usb_buffer *bufs) {
+  struct usb_dev *udev = pipe->udev;
+
+  return udev->hc_ops->transfer(pipe, n, bufs);
+}
+
 int usb_setup(struct usb_pipe *pipe, struct usb_dev_setup_request *req,
               int dir, int size, char *data) {
   struct usb_dev *udev = pipe->udev;
@@ -393,7 +405,6 @@ int usb_static_init() {
   usb_hub_static_init();
   usb_msd_static_init();
   usb_hid_static_init();
-  uhci_static_init();
   pci_static_init();
 
   return 0;
@@ -92,9 +92,18 @@ struct usb_dev {
  */
 struct usb_dev_setup_request;
 struct usb_interrupt;
+/*
+ * One of the buffers of a transfer made with usb_transfer
+ */
+struct usb_buffer {
+  int size;
+  char *data;
+};
+
 struct usb_hc_ops {
   int (*read)(struct usb_pipe *, int size, char *data);
   int (*write)(struct usb_pipe *, int size, char *data);
+  int (*transfer)(struct usb_pipe *, int n, struct usb_buffer *bufs);
   int (*setup)(struct usb_pipe *, struct usb_dev_setup_request *data);
   uint8_t (*get_next_addr)(struct usb_dev *);
   int (*register_interrupt_h)(struct usb_interrupt *);
@@ -123,6 +132,7 @@ struct usb_driver_list {
  */
 int usb_read(struct usb_pipe *pipe, int size, char *data);
 int usb_write(struct usb_pipe *pipe, int size, char *data);
+int usb_transfer(struct usb_pipe *pipe, int n, struct usb_buffer *bufs);
 /* Control direction */
 #define USB_CREAD 1
 #define USB_CWRITE 0
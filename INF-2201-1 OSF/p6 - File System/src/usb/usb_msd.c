@@ -55,6 +55,9 @@ static int usb_msd_clear_halt(struct usb_pipe *pipe) {
   if (rc != 0)
     return ERR_XFER;
 
+  /* The endpoint starts over with DATA0 */
+  pipe->toggle_bit = 0;
+
   return 0;
 }
 
@@ -169,6 +172,14 @@ void usb_msd_free(struct usb_dev *udev) {
  *  This function encapsulates a command block for 
  *  a destination device into a command block wrapper
  *  according to USB Mass Storage Device specification.
+ *
+ *  The three stages take two transfers: a write sends the
+ *  data right behind the wrapper, and a read collects the
+ *  status right behind the data, so the host controller
+ *  goes on with the next stage without waiting for us.
+ *  A short packet ends the read, so a device that sends
+ *  less data than asked never gets its status taken for
+ *  data: the read comes up short and the device is reset.
  */
 #define MSD_READ 0
 #define MSD_WRITE 1
@@ -195,6 +206,19 @@ static int usb_msd_read_write(struct usb_msd_dev *umd, int dir,
 
   struct command_status_wrapper csw;
 
+  cbw_size = sizeof(struct command_block_wrapper);
+  csw_size = sizeof(struct command_status_wrapper);
+
+  /* Buffers of the bulk-out and the bulk-in transfer */
+  struct usb_buffer out[2] = {
+    {cbw_size, (char *)&cbw},
+    {length, data}
+  };
+  struct usb_buffer in[2] = {
+    {length, data},
+    {csw_size, (char *)&csw}
+  };
+
   /* 
    * Verify whether Command Block size is in 
    * the permissible range 
@@ -205,30 +229,23 @@ static int usb_msd_read_write(struct usb_msd_dev *umd, int dir,
   /* Copy Command Block data to the wrapper */
   bcopy(cb_data, (char *)cbw.CBWCB, cb_size);
   
-  /* Send the command to the USB device */
-  cbw_size = sizeof(struct command_block_wrapper);
-  rc = usb_write(umd->bulk_out, cbw_size, (char *)&cbw);
+  /* Send the command (and the data) to the USB device */
+  if (dir == MSD_WRITE && length > 0)
+    rc = usb_transfer(umd->bulk_out, 2, out) - length;
+  else
+    rc = usb_transfer(umd->bulk_out, 1, out);
 
   if (rc != cbw_size)
     goto reset_dev;
-  
-  /* Read/write data from/to the mass storage device */
-  if (length > 0) {
-    if (dir == MSD_READ) 
-      rc = usb_read(umd->bulk_in, length, data);
-    else
-      rc = usb_write(umd->bulk_out, length, data);
-
-    if (rc < length)
-      goto reset_dev;
-  }
 
   /*
-   * Read the operation status, any error is handled 
-   * by device reset 
+   * Read (the data and) the operation status, any error
+   * is handled by device reset
    */
-  csw_size = sizeof(struct command_status_wrapper);
-  rc = usb_read(umd->bulk_in, csw_size, (char *)&csw);
+  if (dir == MSD_READ && length > 0)
+    rc = usb_transfer(umd->bulk_in, 2, in) - length;
+  else
+    rc = usb_transfer(umd->bulk_in, 1, &in[1]);
 
   if (rc != csw_size)
     goto reset_dev;